@@ -0,0 +1,258 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/math.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/detail/subpathsampler.h>
+#include <lightmetrica/detail/parallel.h>
+#include <vector>
+#include <algorithm>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Adaptive importance for the photon emission.
+    \ingroup detail
+
+    Learns which primary samples of the initial light vertex
+    generate photons contributing to the visible measurement points,
+    in the spirit of the robust adaptive photon tracing [Hachisuka & Jensen 2011].
+    Instead of the Markov chain in the original paper, the importance is represented
+    as a piecewise-constant density in the primary sample space:
+    a 1D histogram for the emitter selection and a 4D histogram for the position and direction samples.
+    The density is mixed with the uniform density (`emission_guide_uniform_fraction`)
+    and the photon throughputs must be divided by the PDF of the sample (`EmissionSample::pdf`),
+    thus the estimates stay unbiased.
+
+    Usage:
+      1. Trace the photons with `TracePhoton`, which samples the initial vertex with `Sample`
+         and `Record`s the photon paths that deposited photons near the measurement points.
+      2. `Update` the densities after each pass.
+*/
+class EmissionGuide
+{
+public:
+
+    //! Primary samples for the initial vertex of a light subpath.
+    struct EmissionSample
+    {
+        Float uC;           //!< Sample for the emitter selection
+        Vec2 uP;            //!< Sample for the position
+        Vec2 uD;            //!< Sample for the direction
+        int cellC;          //!< Cell index of the emitter selection histogram
+        int cell;           //!< Cell index of the position and direction histogram
+        Float pdf;          //!< PDF in the primary sample space
+    };
+
+public:
+
+    auto Load(const PropertyNode* prop) -> void
+    {
+        enabled_ = prop->ChildAs<int>("emission_guide", 0) != 0;
+        res_ = Math::Max(1, prop->ChildAs<int>("emission_guide_resolution", 8));
+        resC_ = Math::Max(1, prop->ChildAs<int>("emission_guide_emitter_resolution", 16));
+        uniformFraction_ = Math::Clamp(prop->ChildAs<Float>("emission_guide_uniform_fraction", 0.2_f), 0_f, 1_f);
+    }
+
+    //! Reset the learned densities and allocate per-thread statistics.
+    auto Start() -> void
+    {
+        const int numCells = res_ * res_ * res_ * res_;
+        importance_.assign(numCells, 0.0);
+        importanceC_.assign(resC_, 0.0);
+        stats_.assign(Parallel::GetNumThreads(), Stats{ std::vector<double>(numCells, 0.0), std::vector<double>(resC_, 0.0) });
+        BuildCDF(importance_, cdf_);
+        BuildCDF(importanceC_, cdfC_);
+    }
+
+    auto Enabled() const -> bool { return enabled_; }
+
+public:
+
+    //! Sample the primary samples for the initial vertex.
+    auto Sample(Random* rng) const -> EmissionSample
+    {
+        EmissionSample s;
+
+        // Emitter selection
+        {
+            const auto cell = SampleCell(cdfC_, rng->Next());
+            s.cellC = cell;
+            s.uC = ((Float)(cell) + rng->Next()) / resC_;
+        }
+
+        // Position and direction
+        {
+            const auto cell = SampleCell(cdf_, rng->Next());
+            s.cell = cell;
+            const int i0 = cell % res_;
+            const int i1 = (cell / res_) % res_;
+            const int i2 = (cell / res_ / res_) % res_;
+            const int i3 = cell / res_ / res_ / res_;
+            s.uP.x = ((Float)(i0) + rng->Next()) / res_;
+            s.uP.y = ((Float)(i1) + rng->Next()) / res_;
+            s.uD.x = ((Float)(i2) + rng->Next()) / res_;
+            s.uD.y = ((Float)(i3) + rng->Next()) / res_;
+        }
+
+        s.pdf = PDF(cdfC_, s.cellC) * PDF(cdf_, s.cell);
+        return s;
+    }
+
+    /*!
+        \brief Sampler function utilizing the emission sample.
+        To be used with `SubpathSampler::TraceSubpathFromEndpointWithSampler`.
+    */
+    auto Sampler(const EmissionSample& s, Random* rng) const -> SubpathSampler::SamplerFunc
+    {
+        return [&s, rng](int numVertices, const Primitive* primitive, SubpathSampler::SampleUsage usage, int index) -> Float
+        {
+            if (numVertices == 1)
+            {
+                switch (usage)
+                {
+                    case SubpathSampler::SampleUsage::EmitterSelection: { return s.uC; }
+                    case SubpathSampler::SampleUsage::Position:         { return s.uP[index]; }
+                    case SubpathSampler::SampleUsage::Direction:        { return s.uD[index]; }
+                    default: break;
+                }
+            }
+            return rng->Next();
+        };
+    }
+
+    /*!
+        \brief Trace a photon path.
+        With the emission guide, the initial vertex is sampled from the learned density
+        and the throughput is divided by its PDF. The path is recorded if `visibleFunc(p, numVertices)`
+        is true for any D or G vertex, i.e., the photon contributes to some measurement point.
+        Without the emission guide, the photon is traced with `SubpathSampler::TraceSubpath`.
+    */
+    template <typename VisibleFunc>
+    auto TracePhoton(const Scene3* scene, Random* rng, int threadid, int maxNumVertices, const VisibleFunc& visibleFunc, const SubpathSampler::ProcessPathVertexFunc& processPathVertexFunc) -> void
+    {
+        if (!enabled_)
+        {
+            SubpathSampler::TraceSubpath(scene, rng, maxNumVertices, TransportDirection::LE, processPathVertexFunc);
+            return;
+        }
+
+        const auto s = Sample(rng);
+        bool visible = false;
+        SubpathSampler::TraceSubpathFromEndpointWithSampler(scene, nullptr, nullptr, 0, maxNumVertices, TransportDirection::LE, Sampler(s, rng), [&](int numVertices, const Vec2& rasterPos, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+        {
+            if (numVertices == 1)
+            {
+                throughput /= s.pdf;
+            }
+            else if (!visible && ((v.type & SurfaceInteractionType::D) > 0 || (v.type & SurfaceInteractionType::G) > 0))
+            {
+                visible = visibleFunc(v.geom.p, numVertices);
+            }
+            return processPathVertexFunc(numVertices, rasterPos, pv, v, throughput);
+        });
+
+        if (visible)
+        {
+            Record(threadid, s, 1_f);
+        }
+    }
+
+    //! Record the contribution (e.g., visibility) of the photon path generated by the sample.
+    auto Record(int threadid, const EmissionSample& s, Float value) -> void
+    {
+        auto& stats = stats_[threadid];
+        stats.importance[s.cell] += value / s.pdf;
+        stats.importanceC[s.cellC] += value / s.pdf;
+    }
+
+    //! Update the densities with the recorded contributions.
+    auto Update() -> void
+    {
+        for (auto& stats : stats_)
+        {
+            for (size_t i = 0; i < importance_.size(); i++) { importance_[i] += stats.importance[i]; stats.importance[i] = 0.0; }
+            for (size_t i = 0; i < importanceC_.size(); i++) { importanceC_[i] += stats.importanceC[i]; stats.importanceC[i] = 0.0; }
+        }
+        BuildCDF(importance_, cdf_);
+        BuildCDF(importanceC_, cdfC_);
+    }
+
+private:
+
+    // Build the CDF of the mixture of the normalized importance and the uniform distribution
+    auto BuildCDF(const std::vector<double>& importance, std::vector<double>& cdf) const -> void
+    {
+        const auto n = importance.size();
+        double sum = 0;
+        for (const auto& v : importance) { sum += v; }
+        const double uniformFraction = sum > 0 ? uniformFraction_ : 1.0;
+        cdf.assign(n + 1, 0.0);
+        for (size_t i = 0; i < n; i++)
+        {
+            const double p = uniformFraction / n + (sum > 0 ? (1.0 - uniformFraction) * importance[i] / sum : 0.0);
+            cdf[i + 1] = cdf[i] + p;
+        }
+        for (auto& v : cdf) { v /= cdf[n]; }
+    }
+
+    static auto SampleCell(const std::vector<double>& cdf, Float u) -> int
+    {
+        const int n = (int)(cdf.size()) - 1;
+        const auto it = std::upper_bound(cdf.begin(), cdf.end(), (double)(u));
+        return Math::Clamp((int)(std::distance(cdf.begin(), it)) - 1, 0, n - 1);
+    }
+
+    // PDF of the primary sample in the cell (w.r.t. the unit hypercube)
+    static auto PDF(const std::vector<double>& cdf, int cell) -> Float
+    {
+        const int n = (int)(cdf.size()) - 1;
+        return (Float)((cdf[cell + 1] - cdf[cell]) * n);
+    }
+
+private:
+
+    struct Stats
+    {
+        std::vector<double> importance;
+        std::vector<double> importanceC;
+    };
+
+    bool enabled_ = false;
+    int res_;                               // Resolution of the position and direction histogram per dimension
+    int resC_;                              // Resolution of the emitter selection histogram
+    Float uniformFraction_;                 // Fraction of the uniform density in the mixture
+    std::vector<double> importance_;        // Accumulated importance of the position and direction histogram
+    std::vector<double> importanceC_;       // Accumulated importance of the emitter selection histogram
+    std::vector<double> cdf_;
+    std::vector<double> cdfC_;
+    std::vector<Stats> stats_;              // Per-thread recorded contributions
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,331 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/math.h>
+#include <lightmetrica/bound.h>
+#include <tbb/tbb.h>
+#include <atomic>
+#include <array>
+#include <vector>
+#include <algorithm>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Hashed uniform grid for fixed-radius range queries.
+    \ingroup detail
+
+    Sorts the points by the hashed cell index [Teschner et al. 2003]
+    with the counting sort executed in parallel.
+    The cell size is usually set to the twice of the maximum query radius so that
+    a query only needs to visit 2x2x2 neighbouring cells.
+    The grid only stores the sorted indices of the points;
+    the users are expected to reorder the point data according to `SortedIndices`
+    so that the points in a cell are contiguous in memory.
+*/
+class HashGrid
+{
+public:
+
+    /*!
+        \brief Build the grid.
+        \param numPoints  Number of points
+        \param cellSize   Cell size. If non-positive, selected to have roughly one point per cell.
+        \param position   Function to get the position of the i-th point
+    */
+    template <typename PositionFunc>
+    auto Build(int numPoints, Float cellSize, const PositionFunc& position) -> void
+    {
+        #pragma region Grid parameters
+        bound_ = tbb::parallel_reduce(tbb::blocked_range<int>(0, numPoints), Bound(), [&](const tbb::blocked_range<int>& range, Bound b) -> Bound
+        {
+            for (int i = range.begin(); i != range.end(); i++) { b = Math::Union(b, position(i)); }
+            return b;
+        }, [](const Bound& b1, const Bound& b2) -> Bound
+        {
+            return Math::Union(b1, b2);
+        });
+        if (cellSize <= 0_f)
+        {
+            const auto e = numPoints > 0 ? bound_.max - bound_.min : Vec3(1_f);
+            cellSize = Math::Max(e.x, Math::Max(e.y, e.z)) / Math::Max(1_f, std::cbrt((Float)(numPoints)));
+        }
+        cellSize_ = Math::Max(Math::Eps(), cellSize);
+        invCellSize_ = 1_f / cellSize_;
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Count number of points in each cell
+        numCells_ = Math::Max(1, numPoints);
+        std::vector<int> cellIndices(numPoints);
+        std::vector<std::atomic<int>> counts(numCells_);
+        for (auto& c : counts) { c = 0; }
+        tbb::parallel_for(tbb::blocked_range<int>(0, numPoints), [&](const tbb::blocked_range<int>& range) -> void
+        {
+            for (int i = range.begin(); i != range.end(); i++)
+            {
+                const auto c = CellIndex(CellCoord(position(i)));
+                cellIndices[i] = c;
+                counts[c]++;
+            }
+        });
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Compute offsets of the cells
+        cellBegin_.assign(numCells_ + 1, 0);
+        for (int c = 0; c < numCells_; c++)
+        {
+            cellBegin_[c + 1] = cellBegin_[c] + counts[c];
+            counts[c] = cellBegin_[c];
+        }
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Scatter the indices
+        sortedIndices_.resize(numPoints);
+        tbb::parallel_for(tbb::blocked_range<int>(0, numPoints), [&](const tbb::blocked_range<int>& range) -> void
+        {
+            for (int i = range.begin(); i != range.end(); i++)
+            {
+                sortedIndices_[counts[cellIndices[i]]++] = i;
+            }
+        });
+        #pragma endregion
+    }
+
+    /*!
+        \brief Query the cells overlapping with a sphere.
+
+        Calls `func(begin, end)` for the ranges of the sorted points
+        in the cells overlapping with the sphere of `radius` centered at `p`.
+        Each sorted point is visited at most once.
+        The caller must check the distance of the points in the ranges.
+    */
+    template <typename Func>
+    auto Query(const Vec3& p, Float radius, const Func& func) const -> void
+    {
+        if (sortedIndices_.empty())
+        {
+            return;
+        }
+
+        // Range of the cells overlapping with the query sphere.
+        // If the radius does not exceed the half of the cell size, the range is at most 2x2x2 cells.
+        const auto c0 = CellCoord(p - Vec3(radius));
+        const auto c1 = CellCoord(p + Vec3(radius));
+        const long long numQueryCells = (long long)(c1[0] - c0[0] + 1) * (c1[1] - c0[1] + 1) * (c1[2] - c0[2] + 1);
+        if (numQueryCells >= numCells_)
+        {
+            func(0, (int)(sortedIndices_.size()));
+            return;
+        }
+
+        // Hashed cell indices of the cells in the range
+        // Hash collision can map different cells into the same index, which must be visited only once.
+        int localCells[8];
+        std::vector<int> cellsVec;
+        int* cells = localCells;
+        if (numQueryCells > 8)
+        {
+            cellsVec.resize(numQueryCells);
+            cells = cellsVec.data();
+        }
+        int numCells = 0;
+        for (int z = c0[2]; z <= c1[2]; z++)
+        {
+            for (int y = c0[1]; y <= c1[1]; y++)
+            {
+                for (int x = c0[0]; x <= c1[0]; x++)
+                {
+                    const auto c = CellIndex({ { x, y, z } });
+                    if (std::find(cells, cells + numCells, c) == cells + numCells)
+                    {
+                        cells[numCells++] = c;
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < numCells; i++)
+        {
+            const int c = cells[i];
+            if (cellBegin_[c] < cellBegin_[c + 1])
+            {
+                func(cellBegin_[c], cellBegin_[c + 1]);
+            }
+        }
+    }
+
+    /*!
+        \brief Query the cells in the order of the distance from a point.
+
+        Visits the cells in rings of increasing Chebyshev distance from the cell containing `p`
+        within `maxRadius`, and calls `func(begin, end)` for the ranges of the sorted points
+        in the cells closer to `p` than the current search radius given by `radius2()` (squared).
+        Since `radius2()` is re-evaluated for each cell, the search shrinks as the radius shrinks,
+        e.g., with the k-th nearest distance in the k-nearest neighbour queries.
+        The query terminates when the closest remaining ring is farther than the current radius.
+        Each sorted point is visited at most once.
+    */
+    template <typename Radius2Func, typename Func>
+    auto QueryNearest(const Vec3& p, Float maxRadius, const Radius2Func& radius2, const Func& func) const -> void
+    {
+        if (sortedIndices_.empty())
+        {
+            return;
+        }
+
+        const auto c = CellCoord(p);
+        const int maxRing = (int)(std::ceil(maxRadius * invCellSize_));
+        const long long side = 2LL * maxRing + 1;
+        if (side * side * side >= numCells_)
+        {
+            func(0, (int)(sortedIndices_.size()));
+            return;
+        }
+
+        // Distance from p to the closest face of the cell containing p,
+        // which bounds the distance to the cells in the ring k by (k-1) * cellSize_ + minToFace.
+        Float minToFace = cellSize_;
+        for (int i = 0; i < 3; i++)
+        {
+            const auto lo = bound_.min[i] + c[i] * cellSize_;
+            minToFace = Math::Min(minToFace, Math::Min(p[i] - lo, lo + cellSize_ - p[i]));
+        }
+        minToFace = Math::Max(0_f, minToFace);
+
+        // Hashed cell indices of the visited cells
+        // Hash collision can map different cells into the same index, which must be visited only once.
+        int localCells[64];
+        std::vector<int> cellsVec;
+        int numVisited = 0;
+        const auto Visit = [&](const std::array<int, 3>& cc) -> void
+        {
+            // Squared distance from p to the cell
+            Float dist2 = 0_f;
+            for (int i = 0; i < 3; i++)
+            {
+                const auto lo = bound_.min[i] + cc[i] * cellSize_;
+                const auto d = Math::Max(0_f, Math::Max(lo - p[i], p[i] - lo - cellSize_));
+                dist2 += d * d;
+            }
+            if (dist2 >= radius2())
+            {
+                return;
+            }
+
+            const int ci = CellIndex(cc);
+            const int* visited = cellsVec.empty() ? localCells : cellsVec.data();
+            if (std::find(visited, visited + numVisited, ci) != visited + numVisited)
+            {
+                return;
+            }
+            if (numVisited < 64)
+            {
+                localCells[numVisited++] = ci;
+            }
+            else
+            {
+                if (cellsVec.empty())
+                {
+                    cellsVec.assign(localCells, localCells + 64);
+                }
+                cellsVec.push_back(ci);
+                numVisited++;
+            }
+
+            if (cellBegin_[ci] < cellBegin_[ci + 1])
+            {
+                func(cellBegin_[ci], cellBegin_[ci + 1]);
+            }
+        };
+
+        for (int k = 0; k <= maxRing; k++)
+        {
+            if (k > 0)
+            {
+                const auto ringDist = (k - 1) * cellSize_ + minToFace;
+                if (ringDist * ringDist >= radius2())
+                {
+                    break;
+                }
+            }
+
+            // Cells on the surface of the cube of the Chebyshev distance k
+            for (int z = -k; z <= k; z++)
+            {
+                for (int y = -k; y <= k; y++)
+                {
+                    const bool inner = std::abs(y) < k && std::abs(z) < k;
+                    for (int x = -k; x <= k; x += (inner && k > 0) ? 2 * k : 1)
+                    {
+                        Visit({ { c[0] + x, c[1] + y, c[2] + z } });
+                    }
+                }
+            }
+        }
+    }
+
+public:
+
+    //! Indices of the points sorted by the cells.
+    auto SortedIndices() const -> const std::vector<int>& { return sortedIndices_; }
+
+    //! Cell size.
+    auto CellSize() const -> Float { return cellSize_; }
+
+private:
+
+    auto CellCoord(const Vec3& p) const -> std::array<int, 3>
+    {
+        const auto d = (p - bound_.min) * invCellSize_;
+        return { { (int)(std::floor(d.x)), (int)(std::floor(d.y)), (int)(std::floor(d.z)) } };
+    }
+
+    auto CellIndex(const std::array<int, 3>& c) const -> int
+    {
+        // Spatial hashing [Teschner et al. 2003]
+        const auto h = ((unsigned int)(c[0]) * 73856093u) ^ ((unsigned int)(c[1]) * 19349663u) ^ ((unsigned int)(c[2]) * 83492791u);
+        return (int)(h % (unsigned int)(numCells_));
+    }
+
+private:
+
+    Bound bound_;
+    Float cellSize_ = 0_f;
+    Float invCellSize_ = 0_f;
+    int numCells_ = 0;
+    std::vector<int> sortedIndices_;        // Indices of the points sorted by cell
+    std::vector<int> cellBegin_;            // Offsets of the hashed cells in the sorted indices (size: #cells + 1)
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,504 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/math.h>
+#include <lightmetrica/bound.h>
+#include <lightmetrica/spectrum.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/scene3.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/emitter.h>
+#include <lightmetrica/ray.h>
+#include <lightmetrica/intersection.h>
+#include <lightmetrica/surfacegeometry.h>
+#include <lightmetrica/renderutils.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/detail/serial.h>
+#include <tbb/tbb.h>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <cstdint>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief World-space irradiance cache.
+    \ingroup detail
+
+    Caches the irradiance at diffuse surfaces with the translational and rotational gradients
+    [Ward & Heckbert 1992] and interpolates the cached records with the error metric of Ward et al. [1988].
+    A record is computed lazily by the stratified hemisphere sampling when no cached record
+    is valid at the query point. The validity radius of a record is `irradiance_cache_error`
+    times the harmonic mean distance to the surrounding surfaces, clamped by
+    `irradiance_cache_min_spacing` and `irradiance_cache_max_spacing` relative to the scene extent.
+
+    The records are stored in a uniform grid with the cell size of the maximum validity diameter,
+    that is, a record is registered to at most 8 cells.
+    The records can be inserted and looked up concurrently.
+    If `irradiance_cache_path` is given, the records are loaded from the file before rendering
+    and saved after rendering, so that the cache can be reused for the frames with the same lighting.
+    The file is skipped if it was saved with the different error threshold, scene bound,
+    or with/without the emission (e.g., the cache of renderer::pt loaded by renderer::ptdirect).
+*/
+class IrradianceCache
+{
+public:
+
+    //! Cached irradiance.
+    struct Record
+    {
+        Vec3 p;                                 //!< Position
+        Vec3 n;                                 //!< Normal
+        SPD E;                                  //!< Irradiance
+        Float R;                                //!< Harmonic mean distance
+        std::array<Vec3, 3> gradT;              //!< Translational gradient per channel
+        std::array<Vec3, 3> gradR;              //!< Rotational gradient per channel
+
+        template <typename Archive>
+        auto serialize(Archive& ar) -> void
+        {
+            ar(p, n, E, R, gradT[0], gradT[1], gradT[2], gradR[0], gradR[1], gradR[2]);
+        }
+    };
+
+private:
+
+    //! Header of the cache file.
+    struct FileHeader
+    {
+        std::uint32_t magic = Magic;              //!< Magic number
+        std::uint32_t version = Version;          //!< Format version
+        std::uint32_t floatSize = sizeof(Float);  //!< Size of the floating point type of the records
+        std::uint32_t includeEmission;            //!< 1 if the records include the emission
+        Float error;                              //!< Error threshold
+        Bound bound;                              //!< Scene bound
+
+        template <typename Archive>
+        auto serialize(Archive& ar) -> void
+        {
+            ar(magic, version, floatSize, includeEmission, error, bound);
+        }
+    };
+
+    static constexpr std::uint32_t Magic = 0x43524d4c;   // "LMRC"
+    static constexpr std::uint32_t Version = 1;
+
+public:
+
+    auto Load(const PropertyNode* prop) -> void
+    {
+        enabled_ = prop->ChildAs<int>("irradiance_cache", 0) != 0;
+        error_ = Math::Max(Math::EpsLarge(), prop->ChildAs<Float>("irradiance_cache_error", 0.2_f));
+        minSpacing_ = prop->ChildAs<Float>("irradiance_cache_min_spacing", 0.001_f);
+        maxSpacing_ = prop->ChildAs<Float>("irradiance_cache_max_spacing", 0.05_f);
+        numSamplesTheta_ = Math::Max(2, prop->ChildAs<int>("irradiance_cache_num_samples_theta", 8));
+        numSamplesPhi_ = Math::Max(2, prop->ChildAs<int>("irradiance_cache_num_samples_phi", 4 * numSamplesTheta_));
+        path_ = prop->ChildAs<std::string>("irradiance_cache_path", "");
+    }
+
+    auto Enabled() const -> bool { return enabled_; }
+
+    /*!
+        \brief Setup the grid for the scene and load the cached records if available.
+        \param includeEmission Include the emitted radiance of the surfaces visible from the query points.
+    */
+    auto Start(const Bound& bound, bool includeEmission) -> void
+    {
+        const auto extent = Math::Length(bound.max - bound.min);
+        minRadius_ = minSpacing_ * extent;
+        maxRadius_ = Math::Max(minRadius_, maxSpacing_ * extent);
+        cellSize_ = Math::Max(Math::Eps(), 2_f * error_ * maxRadius_);
+        bound_ = bound;
+        includeEmission_ = includeEmission;
+
+        records_.clear();
+        cells_.clear();
+        numLookups_ = 0;
+        numMisses_ = 0;
+
+        if (path_.empty())
+        {
+            return;
+        }
+        std::ifstream ifs(path_, std::ios::in | std::ios::binary);
+        if (!ifs)
+        {
+            return;
+        }
+        std::vector<Record> records;
+        {
+            cereal::PortableBinaryInputArchive ia(ifs);
+            FileHeader header;
+            ia(header.magic, header.version);
+            if (header.magic != Magic || header.version != Version)
+            {
+                LM_LOG_WARN("Unsupported irradiance cache format: " + path_ + ". Skipping.");
+                return;
+            }
+            ia(header.floatSize, header.includeEmission);
+            if (header.floatSize != sizeof(Float) || (header.includeEmission != 0) != includeEmission_)
+            {
+                LM_LOG_WARN("Irradiance cache was saved with the different precision or renderer: " + path_ + ". Skipping.");
+                return;
+            }
+            ia(header.error, header.bound);
+            if (header.error != error_ || header.bound.min != bound_.min || header.bound.max != bound_.max)
+            {
+                LM_LOG_WARN("Irradiance cache was saved with the different error threshold or scene: " + path_ + ". Skipping.");
+                return;
+            }
+            ia(records);
+        }
+        for (const auto& r : records)
+        {
+            Insert(r);
+        }
+        LM_LOG_INFO(boost::str(boost::format("Loaded %d irradiance cache records from %s") % records.size() % path_));
+    }
+
+    //! Save the cached records if the path is given.
+    auto Finish() const -> void
+    {
+        LM_LOG_INFO(boost::str(boost::format("# of irradiance cache records: %d (%d lookups, %d misses)") % records_.size() % numLookups_ % numMisses_));
+        if (path_.empty())
+        {
+            return;
+        }
+        std::ofstream ofs(path_, std::ios::out | std::ios::binary);
+        if (!ofs)
+        {
+            LM_LOG_WARN("Failed to save irradiance cache: " + path_);
+            return;
+        }
+        cereal::PortableBinaryOutputArchive oa(ofs);
+        FileHeader header;
+        header.includeEmission = includeEmission_ ? 1 : 0;
+        header.error = error_;
+        header.bound = bound_;
+        oa(header, std::vector<Record>(records_.begin(), records_.end()));
+    }
+
+public:
+
+    /*!
+        \brief Irradiance at the diffuse surface.
+        Interpolates the cached records, or computes a new record if no record is valid.
+        \param n Normal on the side of the incident radiance.
+        \param maxNumVertices Maximum number of vertices of the paths from `p` (-1: unlimited).
+    */
+    auto Irradiance(const Scene3* scene, Random* rng, const Vec3& p, const Vec3& n, int maxNumVertices) -> SPD
+    {
+        numLookups_++;
+        SPD E;
+        if (Lookup(p, n, E))
+        {
+            return E;
+        }
+        numMisses_++;
+        const auto r = ComputeRecord(scene, rng, p, n, includeEmission_, maxNumVertices);
+        Insert(r);
+        return r.E;
+    }
+
+private:
+
+    auto Lookup(const Vec3& p, const Vec3& n, SPD& E) const -> bool
+    {
+        const auto it = cells_.equal_range(CellKey(CellIndex(p)));
+        Float sumW = 0_f;
+        Vec3 sumE;
+        for (auto i = it.first; i != it.second; ++i)
+        {
+            const auto& r = records_[i->second];
+
+            // Error metric of Ward et al.
+            const auto d = p - r.p;
+            const auto e = Math::Length(d) / r.R + Math::Sqrt(Math::Max(0_f, 1_f - Math::Dot(n, r.n)));
+            if (e >= error_)
+            {
+                continue;
+            }
+
+            // Reject the record in front of the point
+            if (Math::Dot(d, (n + r.n) * 0.5_f) < -0.01_f * r.R)
+            {
+                continue;
+            }
+
+            // Extrapolation with the gradients
+            const auto w = 1_f / Math::Max(e, Math::Eps());
+            const auto nc = Math::Cross(r.n, n);
+            Vec3 Ei;
+            for (int c = 0; c < 3; c++)
+            {
+                Ei[c] = Math::Max(0_f, r.E.v[c] + Math::Dot(nc, r.gradR[c]) + Math::Dot(d, r.gradT[c]));
+            }
+            sumE += Ei * w;
+            sumW += w;
+        }
+        if (sumW <= 0_f)
+        {
+            return false;
+        }
+        E = SPD::FromRGB(sumE / sumW);
+        return true;
+    }
+
+    auto Insert(const Record& r) -> void
+    {
+        const size_t index = records_.push_back(r) - records_.begin();
+        const auto radius = error_ * r.R;
+        const auto minIndex = CellIndex(r.p - Vec3(radius));
+        const auto maxIndex = CellIndex(r.p + Vec3(radius));
+        for (int z = minIndex[2]; z <= maxIndex[2]; z++)
+        for (int y = minIndex[1]; y <= maxIndex[1]; y++)
+        for (int x = minIndex[0]; x <= maxIndex[0]; x++)
+        {
+            cells_.insert(std::make_pair(CellKey({{ x, y, z }}), index));
+        }
+    }
+
+    //! Computes a record with the stratified cosine-weighted hemisphere sampling.
+    auto ComputeRecord(const Scene3* scene, Random* rng, const Vec3& p, const Vec3& n, bool includeEmission, int maxNumVertices) const -> Record
+    {
+        const int M = numSamplesTheta_;
+        const int N = numSamplesPhi_;
+        Vec3 u, v;
+        Math::OrthonormalBasis(n, u, v);
+        const auto LocalToWorld = [&](Float x, Float y, Float z) -> Vec3 { return u * x + v * y + n * z; };
+
+        // Incident radiance and distance for each stratum
+        std::vector<SPD> L(M * N);
+        std::vector<Float> r(M * N);
+        std::vector<Float> sinTheta(M * N);
+        Float invDistSum = 0_f;
+        for (int k = 0; k < N; k++)
+        {
+            for (int j = 0; j < M; j++)
+            {
+                const auto s = rng->Next2D();
+                const auto sinT = Math::Sqrt(((Float)(j) + s.x) / M);
+                const auto cosT = Math::Sqrt(Math::Max(0_f, 1_f - sinT * sinT));
+                const auto phi = 2_f * Math::Pi() * ((Float)(k) + s.y) / N;
+                const auto wo = LocalToWorld(sinT * Math::Cos(phi), sinT * Math::Sin(phi), cosT);
+                Float dist;
+                L[j * N + k] = IncidentRadiance(scene, rng, { p, wo }, includeEmission, maxNumVertices, dist);
+                r[j * N + k] = dist;
+                sinTheta[j * N + k] = sinT;
+                invDistSum += 1_f / dist;
+            }
+        }
+
+        Record rec;
+        rec.p = p;
+        rec.n = n;
+
+        // Irradiance
+        for (const auto& Ljk : L) rec.E += Ljk;
+        rec.E *= Math::Pi() / (M * N);
+
+        // Gradients [Ward & Heckbert 1992]
+        for (int c = 0; c < 3; c++)
+        {
+            rec.gradT[c] = Vec3();
+            rec.gradR[c] = Vec3();
+        }
+        for (int k = 0; k < N; k++)
+        {
+            const auto phiK = 2_f * Math::Pi() * ((Float)(k) + 0.5_f) / N;
+            const auto phiKm = 2_f * Math::Pi() * (Float)(k) / N;
+            const auto uk = LocalToWorld(Math::Cos(phiK), Math::Sin(phiK), 0_f);
+            const auto vk = LocalToWorld(-Math::Sin(phiK), Math::Cos(phiK), 0_f);
+            const auto vkm = LocalToWorld(-Math::Sin(phiKm), Math::Cos(phiKm), 0_f);
+            const int km = (k + N - 1) % N;
+            for (int j = 0; j < M; j++)
+            {
+                const int i = j * N + k;
+                const auto sinTm2 = (Float)(j) / M;
+                const auto cosTm = Math::Sqrt(1_f - (Float)(j) / M);
+                const auto cosTp = Math::Sqrt(Math::Max(0_f, 1_f - (Float)(j + 1) / M));
+                const auto cosT = Math::Sqrt(Math::Max(0_f, 1_f - sinTheta[i] * sinTheta[i]));
+                for (int c = 0; c < 3; c++)
+                {
+                    if (j > 0)
+                    {
+                        const int ip = (j - 1) * N + k;
+                        rec.gradT[c] += uk * (2_f * Math::Pi() / N * sinTm2 / Math::Min(r[i], r[ip]) * (L[i].v[c] - L[ip].v[c]));
+                    }
+                    const int ik = j * N + km;
+                    rec.gradT[c] += vkm * ((cosTm - cosTp) / (Math::Max(sinTheta[i], Math::Eps()) * Math::Min(r[i], r[ik])) * (L[i].v[c] - L[ik].v[c]));
+                    rec.gradR[c] += vk * (Math::Pi() / (M * N) * -(sinTheta[i] / Math::Max(cosT, Math::Eps())) * L[i].v[c]);
+                }
+            }
+        }
+
+        // Harmonic mean distance, also limited by the translational gradient
+        auto R = invDistSum > 0_f ? (M * N) / invDistSum : maxRadius_;
+        const auto lumE = rec.E.Luminance();
+        const auto lumGradT = Math::Length(rec.gradT[0] * 0.212671_f + rec.gradT[1] * 0.715160_f + rec.gradT[2] * 0.072169_f);
+        if (lumGradT > 0_f && lumE > 0_f)
+        {
+            R = Math::Min(R, lumE / lumGradT);
+        }
+        rec.R = Math::Clamp(R, minRadius_, maxRadius_);
+
+        return rec;
+    }
+
+    /*!
+        \brief Estimates the incident radiance along the ray.
+        Path tracing with the direct light sampling from the first intersection.
+    */
+    static auto IncidentRadiance(const Scene3* scene, Random* rng, const Ray& initRay, bool includeEmission, int maxNumVertices, Float& dist) -> SPD
+    {
+        SPD L;
+        dist = Math::Inf();
+
+        Intersection isect;
+        if (!scene->Intersect(initRay, isect))
+        {
+            return L;
+        }
+        if (!isect.geom.infinite)
+        {
+            dist = Math::Max(Math::Length(isect.geom.p - initRay.o), Math::Eps());
+        }
+        if (includeEmission && (isect.primitive->Type() & SurfaceInteractionType::L) > 0)
+        {
+            L += isect.primitive->EvaluateDirection(isect.geom, SurfaceInteractionType::L, Vec3(), -initRay.d, TransportDirection::EL, false) * isect.primitive->EvaluatePosition(isect.geom, false);
+        }
+        if (isect.geom.infinite)
+        {
+            return L;
+        }
+
+        SPD throughput(1_f);
+        auto geom = isect.geom;
+        const auto* primitive = isect.primitive;
+        int type = primitive->Type() & ~SurfaceInteractionType::Emitter;
+        Vec3 wi = -initRay.d;
+        int numVertices = 2;
+        while (maxNumVertices == -1 || numVertices < maxNumVertices)
+        {
+            #pragma region Direct light sampling
+            {
+                const auto* Le = scene->SampleEmitter(SurfaceInteractionType::L, rng->Next());
+                const auto pdfL = scene->EvaluateEmitterPDF(Le);
+                SurfaceGeometry geomL;
+                Le->SamplePositionGivenPreviousPosition(rng->Next2D(), geom, geomL);
+                const auto pdfPL = Le->EvaluatePositionGivenPreviousPositionPDF(geomL, geom, false);
+                if (pdfL.v > 0_f && pdfPL.v > 0_f && scene->Visible(geom.p, geomL.p))
+                {
+                    const auto ppL = Math::Normalize(geomL.p - geom.p);
+                    const auto fsE = primitive->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, true);
+                    const auto fsL = Le->EvaluateDirection(geomL, SurfaceInteractionType::L, Vec3(), -ppL, TransportDirection::LE, false);
+                    const auto G = RenderUtils::GeometryTerm(geom, geomL);
+                    const auto LeP = Le->EvaluatePosition(geomL, false);
+                    L += throughput * fsE * G * fsL * LeP / pdfL / pdfPL;
+                }
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Sample next direction
+            Vec3 wo;
+            primitive->SampleDirection(rng->Next2D(), rng->Next(), type, geom, wi, wo);
+            const auto pdfD = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
+            const auto fs = primitive->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false);
+            if (fs.Black() || pdfD.v <= 0_f)
+            {
+                break;
+            }
+            throughput *= fs / pdfD;
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Intersection and path termination
+            Ray ray = { geom.p, wo };
+            if (!scene->Intersect(ray, isect) || isect.geom.infinite)
+            {
+                break;
+            }
+            const Float rrProb = 0.5_f;
+            if (rng->Next() > rrProb)
+            {
+                break;
+            }
+            throughput /= rrProb;
+            #pragma endregion
+
+            geom = isect.geom;
+            primitive = isect.primitive;
+            type = primitive->Type() & ~SurfaceInteractionType::Emitter;
+            wi = -ray.d;
+            numVertices++;
+        }
+
+        return L;
+    }
+
+private:
+
+    auto CellIndex(const Vec3& p) const -> std::array<int, 3>
+    {
+        const auto t = (p - bound_.min) / cellSize_;
+        return {{ (int)(std::floor(t.x)), (int)(std::floor(t.y)), (int)(std::floor(t.z)) }};
+    }
+
+    static auto CellKey(const std::array<int, 3>& i) -> long long
+    {
+        const auto k = [](int v) -> long long { return (long long)(v) & ((1LL << 21) - 1); };
+        return (k(i[0]) << 42) | (k(i[1]) << 21) | k(i[2]);
+    }
+
+private:
+
+    bool enabled_ = false;
+    Float error_;                               // Error threshold of the interpolation
+    Float minSpacing_;                          // Minimum validity radius relative to the scene extent
+    Float maxSpacing_;                          // Maximum validity radius relative to the scene extent
+    int numSamplesTheta_;                       // Number of strata in theta
+    int numSamplesPhi_;                         // Number of strata in phi
+    std::string path_;                          // Path of the persistent cache
+
+    Float minRadius_;
+    Float maxRadius_;
+    Float cellSize_;
+    Bound bound_;
+    bool includeEmission_;                      // Include the emission in the records
+    tbb::concurrent_vector<Record> records_;
+    tbb::concurrent_unordered_multimap<long long, size_t> cells_;
+    std::atomic<long long> numLookups_;
+    std::atomic<long long> numMisses_;
+
+};
+
+LM_NAMESPACE_END
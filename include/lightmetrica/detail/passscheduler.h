@@ -0,0 +1,214 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/film.h>
+#include <chrono>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Scheduler for multi-pass renderers.
+    \ingroup detail
+
+    Controls the iteration of the renderers with multiple passes (e.g., SPPM, PPM, and VCM).
+    The rendering is terminated either after the given number of passes (`num_iteration_pass`)
+    or after the given wall-clock time (`render_time`, in seconds).
+
+    With the time budget, the cost of a pass is predicted from the previous passes
+    as a sum of the fixed cost and the cost proportional to the number of photon trace samples.
+    The number of photon trace samples of the last pass is reduced
+    so that the rendering finishes within the time budget.
+
+    Intermediate images are saved every `progress_image_update_interval` seconds
+    (0 for every pass, negative to disable) to the path `progress_image_path`
+    formatted with the pass index.
+    The deprecated `debug_output_path` is accepted in place of `progress_image_path`,
+    in which case the images are saved every pass by default as before.
+*/
+class PassScheduler
+{
+public:
+
+    auto Load(const PropertyNode* prop, long long defaultNumIterationPass, long long defaultNumPhotonTraceSamples) -> void
+    {
+        numIterationPass_ = prop->ChildAs<long long>("num_iteration_pass", defaultNumIterationPass);
+        numPhotonTraceSamples_ = prop->ChildAs<long long>("num_photon_trace_samples", defaultNumPhotonTraceSamples);
+        renderTime_ = prop->ChildAs<double>("render_time", -1);
+        if (!prop->Child("progress_image_path") && prop->Child("debug_output_path"))
+        {
+            LM_LOG_WARN("'debug_output_path' is deprecated; use 'progress_image_path' and 'progress_image_update_interval'");
+            progressImageUpdateInterval_ = prop->ChildAs<double>("progress_image_update_interval", 0);
+            progressImagePath_ = prop->ChildAs<std::string>("debug_output_path", "progress_%010d");
+        }
+        else
+        {
+            progressImageUpdateInterval_ = prop->ChildAs<double>("progress_image_update_interval", -1);
+            progressImagePath_ = prop->ChildAs<std::string>("progress_image_path", "progress_%010d");
+        }
+    }
+
+public:
+
+    //! Reset the statistics. Call before the first pass.
+    auto Start() -> void
+    {
+        pass_ = -1;
+        currentNumPhotonTraceSamples_ = 0;
+        totalPhotonTraceSamples_ = 0;
+        totalPhotonTime_ = 0;
+        totalFixedTime_ = 0;
+        renderStartTime_ = std::chrono::high_resolution_clock::now();
+        prevImageUpdateTime_ = renderStartTime_;
+    }
+
+    /*!
+        \brief Begin a pass.
+        Determines the number of photon trace samples for the next pass.
+        \retval true  Rendering continues with the next pass.
+        \retval false Rendering is finished.
+    */
+    auto BeginPass() -> bool
+    {
+        pass_++;
+        passStartTime_ = std::chrono::high_resolution_clock::now();
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Fixed number of passes
+        if (renderTime_ < 0)
+        {
+            currentNumPhotonTraceSamples_ = numPhotonTraceSamples_;
+            return pass_ < numIterationPass_;
+        }
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Time budget
+        const double remaining = renderTime_ - Elapsed(renderStartTime_);
+        if (remaining <= 0)
+        {
+            return false;
+        }
+        if (pass_ == 0)
+        {
+            // No statistics is available in the first pass
+            currentNumPhotonTraceSamples_ = numPhotonTraceSamples_;
+            return true;
+        }
+
+        // Predicted cost of the pass
+        const double fixedCost = totalFixedTime_ / pass_;
+        const double photonCost = totalPhotonTraceSamples_ > 0 ? totalPhotonTime_ / totalPhotonTraceSamples_ : 0;
+        if (fixedCost + photonCost * numPhotonTraceSamples_ <= remaining)
+        {
+            currentNumPhotonTraceSamples_ = numPhotonTraceSamples_;
+            return true;
+        }
+
+        // Last pass with reduced number of photons
+        const auto n = photonCost > 0 ? (long long)((remaining - fixedCost) / photonCost) : numPhotonTraceSamples_;
+        if (n <= 0)
+        {
+            return false;
+        }
+        LM_LOG_INFO(boost::str(boost::format("Last pass with %d photon trace samples (%.2fs remaining)") % n % remaining));
+        currentNumPhotonTraceSamples_ = n;
+        return true;
+        #pragma endregion
+    }
+
+    /*!
+        \brief End a pass.
+        Updates the cost statistics.
+        \param photonTime Time spent in the phases proportional to the number of photon trace samples.
+    */
+    auto EndPass(double photonTime) -> void
+    {
+        const double passTime = Elapsed(passStartTime_);
+        totalPhotonTime_ += photonTime;
+        totalFixedTime_ += Math::Max(0.0, passTime - photonTime);
+        totalPhotonTraceSamples_ += currentNumPhotonTraceSamples_;
+    }
+
+    //! Save an intermediate image if the update interval is elapsed.
+    auto SaveProgress(Film* film) -> void
+    {
+        if (progressImageUpdateInterval_ < 0)
+        {
+            return;
+        }
+        if (Elapsed(prevImageUpdateTime_) < progressImageUpdateInterval_)
+        {
+            return;
+        }
+        prevImageUpdateTime_ = std::chrono::high_resolution_clock::now();
+
+        boost::format f(progressImagePath_);
+        f.exceptions(boost::io::all_error_bits ^ (boost::io::too_many_args_bit | boost::io::too_few_args_bit));
+        LM_LOG_INFO("Saving progress");
+        LM_LOG_INDENTER();
+        film->Save(boost::str(f % pass_));
+    }
+
+public:
+
+    //! Index of the current pass.
+    auto Pass() const -> long long { return pass_; }
+
+    //! Number of photon trace samples in the current pass.
+    auto NumPhotonTraceSamples() const -> long long { return currentNumPhotonTraceSamples_; }
+
+    //! Elapsed time in seconds from the given time point.
+    static auto Elapsed(const std::chrono::high_resolution_clock::time_point& start) -> double
+    {
+        const auto currentTime = std::chrono::high_resolution_clock::now();
+        return (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - start).count()) / 1000.0;
+    }
+
+private:
+
+    long long numIterationPass_;                    //!< Number of passes
+    long long numPhotonTraceSamples_;               //!< Number of photon trace samples per pass
+    double renderTime_;                             //!< Render time
+    double progressImageUpdateInterval_;            //!< Update interval of intermediate images
+    std::string progressImagePath_;                 //!< Output path of intermediate images
+
+    long long pass_ = -1;
+    long long currentNumPhotonTraceSamples_ = 0;
+    long long totalPhotonTraceSamples_ = 0;
+    double totalPhotonTime_ = 0;
+    double totalFixedTime_ = 0;
+    std::chrono::high_resolution_clock::time_point renderStartTime_;
+    std::chrono::high_resolution_clock::time_point passStartTime_;
+    std::chrono::high_resolution_clock::time_point prevImageUpdateTime_;
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,294 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/math.h>
+#include <lightmetrica/detail/photonmap.h>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#if LM_COMPILER_MSVC
+#include <intrin.h>
+#endif
+
+// SIMD width of the photon range tests, independent of the precision of `Float`
+// since the photon positions are always stored in single precision.
+#if defined(__AVX__)
+    #define LM_PHOTON_GATHER_AVX 1
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+    #define LM_PHOTON_GATHER_SSE 1
+    #include <emmintrin.h>
+#endif
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Utility functions for the photon gathering.
+    \ingroup detail
+*/
+class PhotonGatherUtils
+{
+public:
+
+    LM_DISABLE_CONSTRUCT(PhotonGatherUtils);
+
+public:
+
+    /*!
+        \brief Test the photons in [begin, end) against the query sphere.
+        Calls `acceptFunc(i)` for the indices of the photons within the radius.
+        The positions are read directly from the compact photons without an additional SoA copy:
+        the first four floats of four photons are loaded and transposed into the x, y, z lanes,
+        and tested eight (AVX) or four (SSE) at a time.
+    */
+    template <typename AcceptFunc>
+    static auto TestRange(const CompactPhoton* photons, int begin, int end, const Vec3& p, Float radius2, const AcceptFunc& acceptFunc) -> void
+    {
+        const float px = (float)(p.x);
+        const float py = (float)(p.y);
+        const float pz = (float)(p.z);
+        const float r2 = (float)(radius2);
+
+        int i = begin;
+        #if LM_PHOTON_GATHER_AVX
+        {
+            const auto vpx = _mm256_set1_ps(px);
+            const auto vpy = _mm256_set1_ps(py);
+            const auto vpz = _mm256_set1_ps(pz);
+            const auto vr2 = _mm256_set1_ps(r2);
+            for (; i + 8 <= end; i += 8)
+            {
+                __m128 x0, y0, z0, x1, y1, z1;
+                LoadPositions4(photons + i, x0, y0, z0);
+                LoadPositions4(photons + i + 4, x1, y1, z1);
+                const auto dx = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1), vpx);
+                const auto dy = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1), vpy);
+                const auto dz = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1), vpz);
+                const auto d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+                ForEachBit(_mm256_movemask_ps(_mm256_cmp_ps(d2, vr2, _CMP_LT_OQ)), i, acceptFunc);
+            }
+        }
+        #elif LM_PHOTON_GATHER_SSE
+        {
+            const auto vpx = _mm_set1_ps(px);
+            const auto vpy = _mm_set1_ps(py);
+            const auto vpz = _mm_set1_ps(pz);
+            const auto vr2 = _mm_set1_ps(r2);
+            for (; i + 4 <= end; i += 4)
+            {
+                __m128 x, y, z;
+                LoadPositions4(photons + i, x, y, z);
+                const auto dx = _mm_sub_ps(x, vpx);
+                const auto dy = _mm_sub_ps(y, vpy);
+                const auto dz = _mm_sub_ps(z, vpz);
+                const auto d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                ForEachBit(_mm_movemask_ps(_mm_cmplt_ps(d2, vr2)), i, acceptFunc);
+            }
+        }
+        #endif
+
+        // Remaining photons
+        for (; i < end; i++)
+        {
+            const float dx = photons[i].p[0] - px;
+            const float dy = photons[i].p[1] - py;
+            const float dz = photons[i].p[2] - pz;
+            if (dx * dx + dy * dy + dz * dz < r2)
+            {
+                acceptFunc(i);
+            }
+        }
+    }
+
+private:
+
+    #if LM_PHOTON_GATHER_AVX || LM_PHOTON_GATHER_SSE
+    // Strided load of the positions of four photons. Each load reads the position and the following
+    // 4-byte throughput of a photon (24-byte stride), which are transposed into the lanes of x, y, z.
+    static auto LoadPositions4(const CompactPhoton* photons, __m128& x, __m128& y, __m128& z) -> void
+    {
+        auto r0 = _mm_loadu_ps(photons[0].p);
+        auto r1 = _mm_loadu_ps(photons[1].p);
+        auto r2 = _mm_loadu_ps(photons[2].p);
+        auto r3 = _mm_loadu_ps(photons[3].p);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        x = r0;
+        y = r1;
+        z = r2;
+    }
+    #endif
+
+    template <typename AcceptFunc>
+    static auto ForEachBit(int mask, int offset, const AcceptFunc& acceptFunc) -> void
+    {
+        while (mask)
+        {
+            #if LM_COMPILER_MSVC
+            unsigned long j;
+            _BitScanForward(&j, (unsigned long)(mask));
+            #else
+            const int j = __builtin_ctz((unsigned int)(mask));
+            #endif
+            acceptFunc(offset + (int)(j));
+            mask &= mask - 1;
+        }
+    }
+
+};
+
+/*!
+    \brief Buffer of the accepted photons.
+    \ingroup detail
+
+    Unpacks the accepted photons into a fixed-size buffer
+    and passes them to the batch collect function when the buffer is full,
+    so that the callback is invoked once per batch instead of once per photon.
+*/
+class PhotonGatherBuffer
+{
+public:
+
+    static constexpr int BatchSize = 64;
+
+public:
+
+    PhotonGatherBuffer(const PhotonMap::CollectBatchFunc& collectFunc)
+        : collectFunc_(collectFunc)
+    {}
+
+    ~PhotonGatherBuffer()
+    {
+        Flush();
+    }
+
+    LM_DISABLE_COPY_AND_MOVE(PhotonGatherBuffer);
+
+public:
+
+    auto Add(const CompactPhoton& photon) -> void
+    {
+        photons_[numPhotons_++] = photon.Unpack();
+        if (numPhotons_ == BatchSize)
+        {
+            Flush();
+        }
+    }
+
+    auto Flush() -> void
+    {
+        if (numPhotons_ > 0)
+        {
+            collectFunc_(photons_, numPhotons_);
+            numPhotons_ = 0;
+        }
+    }
+
+private:
+
+    const PhotonMap::CollectBatchFunc& collectFunc_;
+    Photon photons_[BatchSize];
+    int numPhotons_ = 0;
+
+};
+
+/*!
+    \brief Bounded max-heap for the k-nearest neighbour queries.
+    \ingroup detail
+
+    Keeps the `k` nearest photons found so far.
+    Once the heap is full, the search radius shrinks to the distance
+    to the farthest photon in the heap.
+    The entries are stored in a per-thread buffer reused across the queries.
+*/
+class PhotonKNNHeap
+{
+public:
+
+    PhotonKNNHeap(int k, Float maxRadius)
+        : k_(k)
+        , radius2_(maxRadius * maxRadius)
+        , heap_(Buffer())
+    {
+        heap_.clear();
+        heap_.reserve(k);
+    }
+
+    LM_DISABLE_COPY_AND_MOVE(PhotonKNNHeap);
+
+public:
+
+    //! Current squared search radius.
+    auto Radius2() const -> Float { return radius2_; }
+
+    //! Add a photon of the index `i` with the squared distance `dist2`.
+    auto Add(Float dist2, int i) -> void
+    {
+        if (dist2 >= radius2_)
+        {
+            return;
+        }
+        if ((int)(heap_.size()) < k_)
+        {
+            heap_.emplace_back(dist2, i);
+            std::push_heap(heap_.begin(), heap_.end());
+        }
+        else
+        {
+            std::pop_heap(heap_.begin(), heap_.end());
+            heap_.back() = std::make_pair(dist2, i);
+            std::push_heap(heap_.begin(), heap_.end());
+        }
+        if ((int)(heap_.size()) == k_)
+        {
+            radius2_ = heap_.front().first;
+        }
+    }
+
+    //! Collected photons as the pairs of the squared distance and the index.
+    auto Entries() const -> const std::vector<std::pair<Float, int>>& { return heap_; }
+
+    //! True if `k` photons are collected.
+    auto Full() const -> bool { return (int)(heap_.size()) == k_; }
+
+private:
+
+    static auto Buffer() -> std::vector<std::pair<Float, int>>&
+    {
+        static thread_local std::vector<std::pair<Float, int>> buffer;
+        return buffer;
+    }
+
+private:
+
+    int k_;
+    Float radius2_;
+    std::vector<std::pair<Float, int>>& heap_;
+
+};
+
+LM_NAMESPACE_END
@@ -27,6 +27,10 @@
 #include <lightmetrica/component.h>
 #include <lightmetrica/spectrum.h>
 #include <functional>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
 
 LM_NAMESPACE_BEGIN
 
@@ -44,19 +48,144 @@ struct Photon : public SIMDAlignedType
     int numVertices;    //!< Number of path vertices of the light path that the photon is generated
 };
 
+/*!
+    \brief Compact photon.
+
+    Packed representation of `Photon` stored in the photon maps (24 bytes).
+    The position is stored in single precision,
+    the throughput in the shared-exponent RGBE format [Ward 1991],
+    and the incident direction in the octahedral encoding with 16 bits per component [Cigolle et al. 2014].
+*/
+struct CompactPhoton
+{
+    float p[3];                     //!< Position on the surface
+    std::uint8_t throughput[4];     //!< Current throughput (RGBE)
+    std::uint16_t wi[2];            //!< Incident ray direction (octahedral)
+    std::uint16_t numVertices;      //!< Number of path vertices of the light path that the photon is generated
+
+public:
+
+    //! Pack a photon.
+    static auto Pack(const Photon& photon) -> CompactPhoton
+    {
+        CompactPhoton cp;
+        cp.p[0] = (float)(photon.p.x);
+        cp.p[1] = (float)(photon.p.y);
+        cp.p[2] = (float)(photon.p.z);
+        EncodeRGBE(photon.throughput.ToRGB(), cp.throughput);
+        EncodeOctahedral(photon.wi, cp.wi);
+        cp.numVertices = (std::uint16_t)(Math::Min(photon.numVertices, 0xffff));
+        return cp;
+    }
+
+    //! Unpack the photon.
+    auto Unpack() const -> Photon
+    {
+        Photon photon;
+        photon.p = Position();
+        photon.throughput = SPD::FromRGB(DecodeRGBE(throughput));
+        photon.wi = DecodeOctahedral(wi);
+        photon.numVertices = numVertices;
+        return photon;
+    }
+
+    //! Position of the photon, which is the only element needed for the range test.
+    auto Position() const -> Vec3
+    {
+        return Vec3(Float(p[0]), Float(p[1]), Float(p[2]));
+    }
+
+private:
+
+    static auto EncodeRGBE(const Vec3& c, std::uint8_t* rgbe) -> void
+    {
+        const Float m = Math::Max(c.x, Math::Max(c.y, c.z));
+        if (m < 1e-32_f)
+        {
+            rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+            return;
+        }
+        int e;
+        const Float scale = std::frexp(m, &e) * 256_f / m;
+        rgbe[0] = (std::uint8_t)(Math::Max(0_f, c.x * scale));
+        rgbe[1] = (std::uint8_t)(Math::Max(0_f, c.y * scale));
+        rgbe[2] = (std::uint8_t)(Math::Max(0_f, c.z * scale));
+        rgbe[3] = (std::uint8_t)(e + 128);
+    }
+
+    static auto DecodeRGBE(const std::uint8_t* rgbe) -> Vec3
+    {
+        if (rgbe[3] == 0)
+        {
+            return Vec3();
+        }
+        const Float f = std::ldexp(1_f, (int)(rgbe[3]) - (128 + 8));
+        return Vec3(((Float)(rgbe[0]) + 0.5_f) * f, ((Float)(rgbe[1]) + 0.5_f) * f, ((Float)(rgbe[2]) + 0.5_f) * f);
+    }
+
+    static auto EncodeOctahedral(const Vec3& d, std::uint16_t* o) -> void
+    {
+        // Project onto the octahedron and fold the lower hemisphere
+        const Float invL1 = 1_f / (Math::Abs(d.x) + Math::Abs(d.y) + Math::Abs(d.z));
+        Float u = d.x * invL1;
+        Float v = d.y * invL1;
+        if (d.z < 0_f)
+        {
+            const Float tu = (1_f - Math::Abs(v)) * (u >= 0_f ? 1_f : -1_f);
+            const Float tv = (1_f - Math::Abs(u)) * (v >= 0_f ? 1_f : -1_f);
+            u = tu;
+            v = tv;
+        }
+        o[0] = (std::uint16_t)(std::round(Math::Clamp(u * 0.5_f + 0.5_f, 0_f, 1_f) * 65535_f));
+        o[1] = (std::uint16_t)(std::round(Math::Clamp(v * 0.5_f + 0.5_f, 0_f, 1_f) * 65535_f));
+    }
+
+    static auto DecodeOctahedral(const std::uint16_t* o) -> Vec3
+    {
+        Float u = (Float)(o[0]) / 65535_f * 2_f - 1_f;
+        Float v = (Float)(o[1]) / 65535_f * 2_f - 1_f;
+        const Float z = 1_f - Math::Abs(u) - Math::Abs(v);
+        if (z < 0_f)
+        {
+            const Float tu = (1_f - Math::Abs(v)) * (u >= 0_f ? 1_f : -1_f);
+            const Float tv = (1_f - Math::Abs(u)) * (v >= 0_f ? 1_f : -1_f);
+            u = tu;
+            v = tv;
+        }
+        return Math::Normalize(Vec3(u, v, z));
+    }
+
+};
+
+static_assert(sizeof(CompactPhoton) == 24, "Unexpected size of CompactPhoton");
+
 ///! Base class of photon map
 struct PhotonMap : public Component
 {
     LM_INTERFACE_CLASS(PhotonMap, Component, 0);
     virtual ~PhotonMap() {}
 
+    /*!
+        \brief Set the maximum query radius
+
+        Informs the maximum radius of the queries until the next build.
+        Call before `Build`. Some implementations (e.g., hash grid)
+        configure the underlying spatial data structure with the radius.
+        The default implementation does nothing.
+
+        \param radius    Maximum query radius
+    */
+    virtual auto SetMaxQueryRadius(Float radius) -> void {}
+
     /*!
         \brief Build the photon map
 
         Build the photon map with the underlying spatial data structure
         utilizing the given vector of photons.
+        The photons are passed in the compact representation to reduce the memory footprint,
+        and unpacked only when collected.
     */
-    virtual auto Build(std::vector<Photon>&& photons) -> void = 0;
+    virtual auto Build(std::vector<CompactPhoton>&& photons) -> void = 0;
 
     /*!
         \brief Collect photons
@@ -69,6 +198,65 @@ struct PhotonMap : public Component
         \param collected  Collected photons
     */
     virtual auto CollectPhotons(const Vec3& p, Float radius, const std::function<void(const Photon&)>& collectFunc) const -> void = 0;
+
+    //! Callback function type for the batched collection.
+    using CollectBatchFunc = std::function<void(const Photon* photons, int numPhotons)>;
+
+    /*!
+        \brief Collect photons in batches
+
+        Same as `CollectPhotons` but the collected photons are passed in batches,
+        which amortizes the cost of the callback over multiple photons.
+        The default implementation passes the photons one by one.
+
+        \param p            Gather point
+        \param radius       Maximum distance from the gather point
+        \param collectFunc  Function called for each batch of the collected photons
+    */
+    virtual auto CollectPhotonsBatch(const Vec3& p, Float radius, const CollectBatchFunc& collectFunc) const -> void
+    {
+        CollectPhotons(p, radius, [&](const Photon& photon) -> void
+        {
+            collectFunc(&photon, 1);
+        });
+    }
+
+    /*!
+        \brief Collect k-nearest photons
+
+        Collect at most `k` nearest photons within the distance `maxRadius` from `p`.
+        The default implementation collects all the photons within `maxRadius`
+        and selects the nearest ones.
+
+        \param p          Gather point
+        \param k          Maximum number of photons to collect
+        \param maxRadius  Maximum distance from the gather point
+        \param collected  Collected photons (cleared before the query)
+        \return Distance to the farthest collected photon if `k` photons are collected, otherwise `maxRadius`
+    */
+    virtual auto CollectKNearestPhotons(const Vec3& p, int k, Float maxRadius, std::vector<Photon>& collected) const -> Float
+    {
+        collected.clear();
+        if (k <= 0)
+        {
+            return maxRadius;
+        }
+        CollectPhotons(p, maxRadius, [&](const Photon& photon) -> void
+        {
+            collected.push_back(photon);
+        });
+        if ((int)(collected.size()) < k)
+        {
+            return maxRadius;
+        }
+        const auto Comp = [&](const Photon& p1, const Photon& p2) -> bool
+        {
+            return Math::Length2(p1.p - p) < Math::Length2(p2.p - p);
+        };
+        std::nth_element(collected.begin(), collected.begin() + (k - 1), collected.end(), Comp);
+        collected.resize(k);
+        return Math::Length(std::max_element(collected.begin(), collected.end(), Comp)->p - p);
+    }
 };
 
 //! \}
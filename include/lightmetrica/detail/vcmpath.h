@@ -0,0 +1,365 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/math.h>
+#include <lightmetrica/scene3.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/sensor.h>
+#include <lightmetrica/renderutils.h>
+#include <lightmetrica/surfacegeometry.h>
+#include <lightmetrica/detail/subpathsampler.h>
+#include <vector>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Path structures shared by the vertex connection and merging family of renderers.
+    \ingroup detail
+
+    `VCMPath` constructs a full path by connecting (s,t) or merging the subpaths,
+    and evaluates its measurement contribution and path PDF for the given strategy.
+    Used by `renderer::vcm` and `renderer::bdpt_lvc`.
+*/
+struct VCMPathVertex
+{
+    int type;
+    SurfaceGeometry geom;
+    const Primitive* primitive = nullptr;
+};
+
+struct VCMSubpath
+{
+    std::vector<VCMPathVertex> vertices;
+    auto SampleSubpath(const Scene3* scene, Random* rng, TransportDirection transDir, int maxNumVertices) -> void
+    {
+        vertices.clear();
+        SubpathSampler::TraceSubpath(scene, rng, maxNumVertices, transDir, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+        {
+            VCMPathVertex v_;
+            v_.type = v.type;
+            v_.geom = v.geom;
+            v_.primitive = v.primitive;
+            vertices.emplace_back(v_);
+            return true;
+        });
+    }
+};
+
+struct VCMPath
+{
+    std::vector<VCMPathVertex> vertices;
+
+    auto ConnectSubpaths(const Scene3* scene, const VCMSubpath& subpathL, const VCMSubpath& subpathE, int s, int t) -> bool
+    {
+        assert(s >= 0);
+        assert(t >= 0);
+        vertices.clear();
+        if (s == 0 && t > 0)
+        {
+            vertices.insert(vertices.end(), subpathE.vertices.rend() - t, subpathE.vertices.rend());
+            if ((vertices.front().primitive->Type() & SurfaceInteractionType::L) == 0) { return false; }
+            vertices.front().type = SurfaceInteractionType::L;
+        }
+        else if (s > 0 && t == 0)
+        {
+            vertices.insert(vertices.end(), subpathL.vertices.begin(), subpathL.vertices.begin() + s);
+            if ((vertices.back().primitive->Type() & SurfaceInteractionType::E) == 0) { return false; }
+            vertices.back().type = SurfaceInteractionType::E;
+        }
+        else
+        {
+            const auto& vL = subpathL.vertices[s - 1];
+            const auto& vE = subpathE.vertices[t - 1];
+            if (vL.geom.infinite || vE.geom.infinite) { return false; }
+            if (!scene->Visible(vL.geom.p, vE.geom.p)) { return false; }
+            vertices.insert(vertices.end(), subpathL.vertices.begin(), subpathL.vertices.begin() + s);
+            vertices.insert(vertices.end(), subpathE.vertices.rend() - t, subpathE.vertices.rend());
+        }
+        return true;
+    }
+
+    auto MergeSubpaths(const VCMSubpath& subpathL, const VCMSubpath& subpathE, int s, int t) -> bool
+    {
+        assert(s >= 1);
+        assert(t >= 1);
+        vertices.clear();
+        const auto& vL = subpathL.vertices[s - 1];
+        const auto& vE = subpathE.vertices[t - 1];
+        if (vL.primitive->IsDeltaPosition(vL.type) || vE.primitive->IsDeltaPosition(vE.type)) { return false; }
+        if (vL.geom.infinite || vE.geom.infinite) { return false; }
+        vertices.insert(vertices.end(), subpathL.vertices.begin(), subpathL.vertices.begin() + s);
+        vertices.insert(vertices.end(), subpathE.vertices.rend() - t, subpathE.vertices.rend());
+        return true;
+    }
+
+    auto EvaluateF(int s, bool merge) const -> SPD
+    {
+        const int n = (int)(vertices.size());
+        const int t = n - s;
+        assert(n >= 2);
+
+        // --------------------------------------------------------------------------------
+
+        SPD fL;
+        if (s == 0) { fL = SPD(1_f); }
+        else
+        {
+            {
+                const auto* vL = &vertices[0];
+                fL = vL->primitive->EvaluatePosition(vL->geom, false);
+            }
+            for (int i = 0; i < (merge ? s : s - 1); i++)
+            {
+                const auto* v = &vertices[i];
+                const auto* vPrev = i >= 1 ? &vertices[i - 1] : nullptr;
+                const auto* vNext = &vertices[i + 1];
+                const auto wi = vPrev ? Math::Normalize(vPrev->geom.p - v->geom.p) : Vec3();
+                const auto wo = Math::Normalize(vNext->geom.p - v->geom.p);
+                fL *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::LE, false);
+                fL *= RenderUtils::GeometryTerm(v->geom, vNext->geom);
+            }
+        }
+        if (fL.Black()) { return SPD(); }
+
+        // --------------------------------------------------------------------------------
+
+        SPD fE;
+        if (t == 0) { fE = SPD(1_f); }
+        else
+        {
+            {
+                const auto* vE = &vertices[n - 1];
+                fE = vE->primitive->EvaluatePosition(vE->geom, false);
+            }
+            for (int i = n - 1; i > s; i--)
+            {
+                const auto* v = &vertices[i];
+                const auto* vPrev = &vertices[i - 1];
+                const auto* vNext = i < n - 1 ? &vertices[i + 1] : nullptr;
+                const auto wi = vNext ? Math::Normalize(vNext->geom.p - v->geom.p) : Vec3();
+                const auto wo = Math::Normalize(vPrev->geom.p - v->geom.p);
+                fE *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, false);
+                fE *= RenderUtils::GeometryTerm(v->geom, vPrev->geom);
+            }
+        }
+        if (fE.Black()) { return SPD(); }
+
+        // --------------------------------------------------------------------------------
+
+        SPD cst;
+        if (!merge)
+        {
+            if (s == 0 && t > 0)
+            {
+                const auto& v = vertices[0];
+                const auto& vNext = vertices[1];
+                cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, v.type, Vec3(), Math::Normalize(vNext.geom.p - v.geom.p), TransportDirection::EL, false);
+            }
+            else if (s > 0 && t == 0)
+            {
+                const auto& v = vertices[n - 1];
+                const auto& vPrev = vertices[n - 2];
+                cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, v.type, Vec3(), Math::Normalize(vPrev.geom.p - v.geom.p), TransportDirection::LE, false);
+            }
+            else if (s > 0 && t > 0)
+            {
+                const auto* vL = &vertices[s - 1];
+                const auto* vE = &vertices[s];
+                const auto* vLPrev = s - 2 >= 0 ? &vertices[s - 2] : nullptr;
+                const auto* vENext = s + 1 < n ? &vertices[s + 1] : nullptr;
+                const auto fsL = vL->primitive->EvaluateDirection(vL->geom, vL->type, vLPrev ? Math::Normalize(vLPrev->geom.p - vL->geom.p) : Vec3(), Math::Normalize(vE->geom.p - vL->geom.p), TransportDirection::LE, true);
+                const auto fsE = vE->primitive->EvaluateDirection(vE->geom, vE->type, vENext ? Math::Normalize(vENext->geom.p - vE->geom.p) : Vec3(), Math::Normalize(vL->geom.p - vE->geom.p), TransportDirection::EL, true);
+                const Float G = RenderUtils::GeometryTerm(vL->geom, vE->geom);
+                cst = fsL * G * fsE;
+            }
+        }
+        else
+        {
+            assert(s >= 1);
+            assert(t >= 1);
+            const auto& v = vertices[s];
+            const auto& vPrev = vertices[s - 1];
+            const auto& vNext = vertices[s + 1];
+            const auto fs = v.primitive->EvaluateDirection(v.geom, v.type, Math::Normalize(vNext.geom.p - v.geom.p), Math::Normalize(vPrev.geom.p - v.geom.p), TransportDirection::EL, true);
+            cst = fs;
+        }
+
+        // --------------------------------------------------------------------------------
+
+        return fL * cst * fE;
+    }
+
+    auto EvaluatePathPDF(const Scene3* scene, int s, bool merge, Float radius) const -> PDFVal
+    {
+        const int n = (int)(vertices.size());
+        const int t = n - s;
+        assert(n >= 2);
+
+        if (!merge)
+        {
+            // Check if the path is samplable by vertex connection
+            if (s == 0 && t > 0)
+            {
+                const auto& v = vertices[0];
+                if (v.primitive->IsDeltaPosition(v.type)) { return PDFVal(PDFMeasure::ProdArea, 0_f); }
+            }
+            else if (s > 0 && t == 0)
+            {
+                const auto& v = vertices[n - 1];
+                if (v.primitive->IsDeltaPosition(v.type)) { return PDFVal(PDFMeasure::ProdArea, 0_f); }
+            }
+            else if (s > 0 && t > 0)
+            {
+                const auto& vL = vertices[s - 1];
+                const auto& vE = vertices[s];
+                if (vL.primitive->IsDeltaDirection(vL.type) || vE.primitive->IsDeltaDirection(vE.type)) { return PDFVal(PDFMeasure::ProdArea, 0_f); }
+            }
+        }
+        else
+        {
+            // Check if the path is samplable by vertex merging
+            if (s == 0 || t == 0) { return PDFVal(PDFMeasure::ProdArea, 0_f); }
+            const auto& vE = vertices[s];
+            if (vE.primitive->IsDeltaPosition(vE.type) || vE.primitive->IsDeltaDirection(vE.type)) { return PDFVal(PDFMeasure::ProdArea, 0_f); }
+        }
+
+        // Otherwise the path can be generated with the given strategy (s,t,merge) so p_{s,t,merge} can be safely evaluated.
+        PDFVal pdf(PDFMeasure::ProdArea, 1_f);
+        if (s > 0)
+        {
+            pdf *= vertices[0].primitive->EvaluatePositionGivenDirectionPDF(vertices[0].geom, Math::Normalize(vertices[1].geom.p - vertices[0].geom.p), false) * scene->EvaluateEmitterPDF(vertices[0].primitive).v;
+            for (int i = 0; i < (merge ? s : s - 1); i++)
+            {
+                const auto* vi = &vertices[i];
+                const auto* vip = i - 1 >= 0 ? &vertices[i - 1] : nullptr;
+                const auto* vin = &vertices[i + 1];
+                pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vip ? Math::Normalize(vip->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vin->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vin->geom);
+            }
+        }
+        if (t > 0)
+        {
+            pdf *= vertices[n - 1].primitive->EvaluatePositionGivenDirectionPDF(vertices[n - 1].geom, Math::Normalize(vertices[n - 2].geom.p - vertices[n - 1].geom.p), false) * scene->EvaluateEmitterPDF(vertices[n - 1].primitive).v;
+            for (int i = n - 1; i >= s + 1; i--)
+            {
+                const auto* vi = &vertices[i];
+                const auto* vip = &vertices[i - 1];
+                const auto* vin = i + 1 < n ? &vertices[i + 1] : nullptr;
+                pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vin ? Math::Normalize(vin->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vip->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vip->geom);
+            }
+        }
+
+        if (merge)
+        {
+            pdf.v *= (Math::Pi() * radius * radius);
+        }
+
+        return pdf;
+    }
+
+    auto EvaluateMISWeight_VCM(const Scene3* scene, int s_, bool merge, Float radius, long long numPhotonTraceSamples) const -> Float
+    {
+        const int n = static_cast<int>(vertices.size());
+        const auto ps = EvaluatePathPDF(scene, s_, merge, radius);
+        assert(ps > 0_f);
+
+        Float invw = 0_f;
+        for (int s = 0; s <= n; s++)
+        {
+            for (int type = 0; type < 2; type++)
+            {
+                const auto pi = EvaluatePathPDF(scene, s, type > 0, radius);
+                if (pi > 0_f)
+                {
+                    const auto r = pi.v / ps.v;
+                    invw += r*r*(type > 0 ? (Float)(numPhotonTraceSamples) : 1_f);
+                }
+            }
+        }
+
+        return 1_f / invw;
+    }
+
+    auto EvaluateMISWeight_BDPT(const Scene3* scene, int s_) const -> Float
+    {
+        const int n = static_cast<int>(vertices.size());
+        const auto ps = EvaluatePathPDF(scene, s_, false, 0_f);
+        assert(ps > 0_f);
+
+        Float invw = 0_f;
+        for (int s = 0; s <= n; s++)
+        {
+            const auto pi = EvaluatePathPDF(scene, s, false, 0_f);
+            if (pi > 0_f)
+            {
+                const auto r = pi.v / ps.v;
+                invw += r*r;
+            }
+        }
+
+        return 1_f / invw;
+    }
+
+    auto EvaluateMISWeight_BDPM(const Scene3* scene, int s_, Float radius, long long numPhotonTraceSamples) const -> Float
+    {
+        const int n = static_cast<int>(vertices.size());
+        const auto ps = EvaluatePathPDF(scene, s_, true, radius);
+        assert(ps > 0_f);
+
+        Float invw = 0_f;
+        for (int s = 0; s <= n; s++)
+        {
+            const auto pi = EvaluatePathPDF(scene, s, true, radius);
+            if (pi > 0_f)
+            {
+                const auto r = pi.v / ps.v;
+                invw += r*r*(Float)(numPhotonTraceSamples);
+            }
+        }
+
+        return 1_f / invw;
+    }
+
+    auto RasterPosition() const -> Vec2
+    {
+        const auto& v = vertices[vertices.size() - 1];
+        const auto& vPrev = vertices[vertices.size() - 2];
+        Vec2 rasterPos;
+        v.primitive->sensor->RasterPosition(Math::Normalize(vPrev.geom.p - v.geom.p), v.geom, rasterPos);
+        return rasterPos;
+    }
+
+    auto RasterPosition(Vec2& rasterPos) const -> bool
+    {
+        const auto& v = vertices[vertices.size() - 1];
+        const auto& vPrev = vertices[vertices.size() - 2];
+        return v.primitive->sensor->RasterPosition(Math::Normalize(vPrev.geom.p - v.geom.p), v.geom, rasterPos);
+    }
+
+};
+
+LM_NAMESPACE_END
@@ -44,7 +44,7 @@ class Scene3 : public Scene
 {
 public:
 
-    LM_INTERFACE_CLASS(Scene3, Scene, 11);
+    LM_INTERFACE_CLASS(Scene3, Scene, 12);
 
 public:
 
@@ -102,6 +102,15 @@ public:
     //! Get a number of light primitives.
     LM_INTERFACE_F(10, NumLightPrimitives, int());
 
+    /*!
+        \brief Get the number of intersection queries.
+
+        Returns the number of the calls of `Intersect` and `IntersectWithRange`
+        issued from the calling thread. The counter is never reset,
+        so the number of queries spent in an operation is obtained by the difference.
+    */
+    LM_INTERFACE_F(11, NumIntersectQueries, long long());
+
 public:
 
     auto Visible(const Vec3& p1, const Vec3& p2) const -> bool
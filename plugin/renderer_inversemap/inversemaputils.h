@@ -58,13 +58,20 @@ struct Subpath
     }
 
     auto SampleSubpathWithPrimarySamples(const Scene3* scene, const std::vector<Float>& us, TransportDirection transDir, int maxNumVertices) -> void
+    {
+        SampleSubpathWithPrimarySampleFunc(scene, [&](int i) -> Float { return us[i]; }, transDir, maxNumVertices);
+    }
+
+    // Primary samples are requested on demand by index, used for lazy evaluation of the mutations
+    template <typename PrimarySampleFunc>
+    auto SampleSubpathWithPrimarySampleFunc(const Scene3* scene, const PrimarySampleFunc& u, TransportDirection transDir, int maxNumVertices) -> void
     {
         int idx = 0;
         vertices.clear();
         SubpathSampler::TraceSubpathFromEndpointWithSampler(scene, nullptr, nullptr, 0, maxNumVertices, transDir,
             [&](int numVertices, const Primitive* primitive, SubpathSampler::SampleUsage usage, int index) -> Float
             {
-                return us[idx++];
+                return u(idx++);
             },
             [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::SubpathSampler::PathVertex& pv, const SubpathSampler::SubpathSampler::PathVertex& v, SPD& throughput) -> bool
             {
@@ -25,6 +25,7 @@
 #include <pch_test.h>
 #include <lightmetrica/math.h>
 #include <lightmetrica/bsdf.h>
+#include <lightmetrica/random.h>
 #include <lightmetrica-test/mathutils.h>
 
 #include "manifoldutils.h"
@@ -139,4 +140,61 @@ TEST_F(ManifoldTest, ExampleFromJacob2012)
     }
 }
 
+// --------------------------------------------------------------------------------
+
+// Linear-time block solver and determinant must agree with the dense reference implementations
+TEST_F(ManifoldTest, BlockSolverAgreesWithDense)
+{
+    std::unique_ptr<StubS> stubS(new StubS);
+    std::unique_ptr<Primitive> S(new Primitive);
+    S->bsdf = stubS.get();
+
+    Random rng;
+    rng.SetSeed(1);
+    const auto RandomVec3 = [&]() -> Vec3 { return Vec3(rng.Next(), rng.Next(), rng.Next()) * 2_f - Vec3(1_f); };
+
+    for (int n = 3; n <= 10; n++)
+    {
+        // Random chain of vertices with specular interior vertices
+        Subpath subpath;
+        for (int i = 0; i < n; i++)
+        {
+            SubpathSampler::PathVertex v;
+            v.type = i == 0 || i == n - 1 ? SurfaceInteractionType::D : SurfaceInteractionType::S;
+            v.primitive = S.get();
+            v.geom.degenerated = false;
+            v.geom.p = Vec3(0_f, (Float)(i), 0_f) + RandomVec3() * 0.5_f;
+            v.geom.sn = v.geom.gn = Math::Normalize(Vec3(0_f, 0_f, 1_f) + RandomVec3() * 0.5_f);
+            Math::OrthonormalBasis(v.geom.sn, v.geom.dpdu, v.geom.dpdv);
+            v.geom.dndu = RandomVec3() * 0.1_f;
+            v.geom.dndv = RandomVec3() * 0.1_f;
+            subpath.vertices.push_back(v);
+        }
+
+        // Determinant
+        {
+            const auto expected = ManifoldUtils::ComputeConstraintJacobianDeterminantDense(subpath);
+            const auto actual = ManifoldUtils::ComputeConstraintJacobianDeterminant(subpath);
+            EXPECT_TRUE(ExpectNear(expected, actual, Math::EpsLarge() * expected + Math::Eps()));
+        }
+
+        // Linear equation
+        {
+            ConstraintJacobian nablaC(n - 2);
+            ManifoldUtils::ComputeConstraintJacobian(subpath, nablaC);
+            std::vector<Vec2> V;
+            for (int i = 0; i < n - 2; i++) { V.push_back(Vec2(rng.Next(), rng.Next())); }
+            std::vector<Vec2> expected;
+            std::vector<Vec2> actual;
+            ManifoldUtils::SolveBlockLinearEqDense(nablaC, V, expected);
+            ManifoldUtils::SolveBlockLinearEq(nablaC, V, actual);
+            for (int i = 0; i < n - 2; i++)
+            {
+                const auto scale = Math::Max(1_f, Math::Length(expected[i]));
+                EXPECT_TRUE(ExpectVecNear(expected[i], actual[i], Math::EpsLarge() * scale));
+            }
+        }
+    }
+}
+
 LM_TEST_NAMESPACE_END
@@ -36,7 +36,7 @@
 #include <eigen3/Eigen/Dense>
 #endif
 
-#define INVERSEMAP_MANIFOLDWALK_USE_EIGEN_SOLVER 1
+#define INVERSEMAP_MANIFOLDWALK_USE_EIGEN_SOLVER 0
 #define INVERSEMAP_MANIFOLDWALK_BETA_EXT 0
 
 LM_NAMESPACE_BEGIN
@@ -54,29 +54,82 @@ auto serialize(Archive& archive, Vec3& v) -> void
 namespace
 {
 
-auto SolveBlockLinearEq(const ConstraintJacobian& nablaC, const std::vector<Vec2>& V, std::vector<Vec2>& W) -> void
+auto Det(const Mat2& m) -> Float
 {
-	const int n = (int)(nablaC.size());
-	assert(V.size() == nablaC.size());
-		
-	// --------------------------------------------------------------------------------
+	return m[0][0] * m[1][1] - m[1][0] * m[0][1];
+}
 
-	#pragma region LU decomposition
+// Block LU decomposition of the block tridiagonal matrix \nabla C (without pivoting)
+auto DecomposeBlockLU(const ConstraintJacobian& nablaC, std::vector<Mat2>& L, std::vector<Mat2>& U) -> void
+{
+	const int n = (int)(nablaC.size());
 
 	// A'_{0,n-1} = B_{0,n-1}
 	// B'_{0,n-2} = C_{0,n-2}
 	// C'_{0,n-2} = A_{1,n-1}
-	std::vector<Mat2> L(n);
-	std::vector<Mat2> U(n);
+	L.assign(n, Mat2());
+	U.assign(n, Mat2());
+
+	// U_1 = A'_1
+	U[0] = nablaC[0].B;
+	for (int i = 1; i < n; i++)
 	{
-		// U_1 = A'_1
-		U[0] = nablaC[0].B;
-		for (int i = 1; i < n; i++)
+		L[i] = nablaC[i].A * Math::Inverse(U[i-1]);		// L_i = C'_i U_{i-1}^-1
+		U[i] = nablaC[i].B - L[i] * nablaC[i-1].C;		// U_i = A'_i - L_i * B'_{i-1}
+	}
+}
+
+// Dense representation of \nabla C
+auto ToDenseMatrix(const ConstraintJacobian& nablaC) -> Matrix
+{
+	const int n = (int)(nablaC.size());
+	Matrix A;
+	A.setZero(2 * n, 2 * n);
+	for (int i = 0; i < n; i++)
+	{
+		if (i > 0)
+		{
+			const auto& A_ = nablaC[i].A;
+			Eigen::Array22d m;
+			m << A_[0][0], A_[1][0],
+			     A_[0][1], A_[1][1];
+			A.block<2, 2>(i * 2, (i - 1) * 2) = m;
+		}
 		{
-			L[i] = nablaC[i].A * Math::Inverse(U[i-1]);		// L_i = C'_i U_{i-1}^-1
-			U[i] = nablaC[i].B - L[i] * nablaC[i-1].C;		// U_i = A'_i - L_i * B'_{i-1}
+			const auto& B_ = nablaC[i].B;
+			Eigen::Array22d m;
+			m << B_[0][0], B_[1][0],
+			     B_[0][1], B_[1][1];
+			A.block<2, 2>(i * 2, i * 2) = m;
+		}
+		if (i < n - 1)
+		{
+			const auto& C_ = nablaC[i].C;
+			Eigen::Array22d m;
+			m << C_[0][0], C_[1][0],
+			     C_[0][1], C_[1][1];
+			A.block<2, 2>(i * 2, (i + 1) * 2) = m;
 		}
 	}
+	return A;
+}
+
+}
+
+// --------------------------------------------------------------------------------
+
+auto ManifoldUtils::SolveBlockLinearEq(const ConstraintJacobian& nablaC, const std::vector<Vec2>& V, std::vector<Vec2>& W) -> void
+{
+	const int n = (int)(nablaC.size());
+	assert(V.size() == nablaC.size());
+		
+	// --------------------------------------------------------------------------------
+
+	#pragma region LU decomposition
+
+	std::vector<Mat2> L;
+	std::vector<Mat2> U;
+	DecomposeBlockLU(nablaC, L, U);
 
 	#pragma endregion
 
@@ -106,15 +159,27 @@ auto SolveBlockLinearEq(const ConstraintJacobian& nablaC, const std::vector<Vec2
 
 	for (int i = n - 2; i >= 0; i--)
 	{
-		// Solve U_i W_i = V'_i - V_i W_{i+1}
-		W[i] = Math::Inverse(U[i]) * (Vp[i] - V[i] * W[i + 1]);
+		// Solve U_i W_i = V'_i - B'_i W_{i+1}
+		W[i] = Math::Inverse(U[i]) * (Vp[i] - nablaC[i].C * W[i + 1]);
 	}
 
 	#pragma endregion
 }
 
+auto ManifoldUtils::SolveBlockLinearEqDense(const ConstraintJacobian& nablaC, const std::vector<Vec2>& V, std::vector<Vec2>& W) -> void
+{
+	const int n = (int)(nablaC.size());
+	const auto A = ToDenseMatrix(nablaC);
+	Vector V_;
+	V_.setZero(2 * n);
+	for (int i = 0; i < n; i++) { V_(2*i) = V[i].x; V_(2*i+1) = V[i].y; }
+	const Vector W_ = A.colPivHouseholderQr().solve(V_);
+	W.assign(n, Vec2());
+	for (int i = 0; i < n; i++) { W[i].x = W_(2 * i); W[i].y = W_(2 * i + 1); }
 }
 
+// --------------------------------------------------------------------------------
+
 #if 1
 auto ManifoldUtils::ComputeConstraintJacobian(const Subpath& path, ConstraintJacobian& nablaC) -> void
 {
@@ -337,37 +402,36 @@ auto ManifoldUtils::ComputeConstraintJacobianDeterminant(const Subpath& subpath)
 
     // --------------------------------------------------------------------------------
 
-    // A
-    Matrix A;
-    A.setZero(2 * (n - 2), 2 * (n - 2));
+    // det(P_2 A^-1 B_n) with A = \nabla C and B_n = C_{n-2}.
+    // Using the block LU decomposition A = LU, the first block of A^-1 B_n is given by the backward substitution
+    // W_{n-2} = U_{n-2}^-1 C_{n-2} and W_i = -U_i^-1 C_i W_{i+1}, thus det(W_1) = \prod_i det(C_i) / det(U_i).
+    std::vector<Mat2> L;
+    std::vector<Mat2> U;
+    DecomposeBlockLU(nablaC, L, U);
+    Float det = 1_f;
     for (int i = 0; i < n - 2; i++)
     {
-        if (i > 0)
-        {
-            const auto& A_ = nablaC[i].A;
-            Eigen::Array22d m;
-            m << A_[0][0], A_[1][0],
-                 A_[0][1], A_[1][1];
-            A.block<2, 2>(i * 2, (i - 1) * 2) = m;
-        }
-        {
-            const auto& B_ = nablaC[i].B;
-            Eigen::Array22d m;
-            m << B_[0][0], B_[1][0],
-                 B_[0][1], B_[1][1];
-            A.block<2, 2>(i * 2, i * 2) = m;
-        }
-        if (i < n - 2 - 1)
-        {
-            const auto& C_ = nablaC[i].C;
-            Eigen::Array22d m;
-            m << C_[0][0], C_[1][0],
-                 C_[0][1], C_[1][1];
-            A.block<2, 2>(i * 2, (i + 1) * 2) = m;
-        }
+        det *= Det(nablaC[i].C) / Det(U[i]);
     }
 
+    // --------------------------------------------------------------------------------
+    return Math::Abs(det);
+}
+
+auto ManifoldUtils::ComputeConstraintJacobianDeterminantDense(const Subpath& subpath) -> Float
+{
+    const int n = (int)(subpath.vertices.size());
+
+    // --------------------------------------------------------------------------------
+
+    ConstraintJacobian nablaC;
+    nablaC.assign(n - 2, VertexConstraintJacobian());
+    ComputeConstraintJacobian(subpath, nablaC);
+
+    // --------------------------------------------------------------------------------
+
     // A^-1
+    const auto A = ToDenseMatrix(nablaC);
     const decltype(A) invA = A.inverse();
     //const decltype(A) invA = PseudoInverse(A);
 
@@ -587,44 +651,10 @@ auto ManifoldUtils::WalkManifold(const Scene3* scene, const Subpath& seedPath, c
             std::vector<Vec2> W;
             W.assign(n - 2, Vec2());
 			for (int i = 0; i < n - 2; i++) { V[i] = i == n - 3 ? V_n2p : Vec2(); }
-            #if !INVERSEMAP_MANIFOLDWALK_USE_EIGEN_SOLVER
-			SolveBlockLinearEq(nablaC, V, W);
+            #if INVERSEMAP_MANIFOLDWALK_USE_EIGEN_SOLVER
+            SolveBlockLinearEqDense(nablaC, V, W);
             #else
-            Matrix nablaC_;
-            nablaC_.setZero(2 * (n - 2), 2 * (n - 2));
-            for (int i = 0; i < n - 2; i++)
-            {
-                if (i > 0)
-                {
-                    const auto& A = nablaC[i].A;
-                    Eigen::Array22d m;
-                    m << A[0][0], A[1][0],
-                         A[0][1], A[1][1];
-                    nablaC_.block<2, 2>(i * 2, (i - 1) * 2) = m;
-                }
-                {
-                    const auto& B = nablaC[i].B;
-                    Eigen::Array22d m;
-                    m << B[0][0], B[1][0],
-                         B[0][1], B[1][1];
-                    nablaC_.block<2, 2>(i * 2, i * 2) = m;
-                }
-                if (i < n - 2 - 1)
-                {
-                    const auto& C = nablaC[i].C;
-                    Eigen::Array22d m;
-                    m << C[0][0], C[1][0],
-                         C[0][1], C[1][1];
-                    nablaC_.block<2, 2>(i * 2, (i + 1) * 2) = m;
-
-                }
-            }
-            Vector V_;
-            V_.setZero(2 * (n - 2));
-            for (int i = 0; i < n - 2; i++) { V_(2*i) = V[i].x; V_(2*i+1) = V[i].y; }
-            Vector W_;
-            W_ = nablaC_.colPivHouseholderQr().solve(V_);
-            for (int i = 0; i < n - 2; i++) { W[i].x = W_(2 * i); W[i].y = W_(2 * i + 1); }
+			SolveBlockLinearEq(nablaC, V, W);
             #endif
 
 			// x_2, T(x_2)
@@ -56,6 +56,13 @@ public:
     static auto WalkManifold(const Scene3* scene, const Subpath& seedPath, const Vec3& target, Subpath& connPath) -> bool;
     static auto ComputeConstraintJacobianDeterminant(const Subpath& subpath) -> Float;
 
+    //! Solves \nabla C W = V in linear time with the block tridiagonal LU decomposition.
+    static auto SolveBlockLinearEq(const ConstraintJacobian& nablaC, const std::vector<Vec2>& V, std::vector<Vec2>& W) -> void;
+
+    //! Dense reference implementations with Eigen (only for testing).
+    static auto SolveBlockLinearEqDense(const ConstraintJacobian& nablaC, const std::vector<Vec2>& V, std::vector<Vec2>& W) -> void;
+    static auto ComputeConstraintJacobianDeterminantDense(const Subpath& subpath) -> Float;
+
 };
 
 LM_NAMESPACE_END
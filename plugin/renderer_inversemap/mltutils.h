@@ -25,6 +25,8 @@
 #pragma once
 
 #include "inversemaputils.h"
+#include <chrono>
+#include <fstream>
 
 #define INVERSEMAP_DEBUG_SIMPLIFY_BIDIR_MUT_DELETE_ALL 0
 #define INVERSEMAP_DEBUG_SIMPLIFY_BIDIR_MUT_PT 0
@@ -178,4 +180,360 @@ public:
 
 };
 
+// --------------------------------------------------------------------------------
+
+/*!
+    Per-strategy statistics of the mutations.
+    For each strategy the thread context records the number of proposals and acceptances,
+    the sum of the acceptance probabilities, and the wall time and the number of intersection queries spent in the mutations.
+    The statistics of the thread contexts are merged after rendering,
+    and saved as JSON to `mutation_stats_path` if specified, so that the mutation weights can be tuned.
+*/
+class MLTMutationStats
+{
+public:
+
+    struct Entry
+    {
+        long long proposed = 0;
+        long long accepted = 0;
+        double sumA = 0;            // Sum of the acceptance probabilities
+        double time = 0;            // Wall time in seconds
+        long long rays = 0;         // Number of intersection queries
+    };
+
+public:
+
+    //! Names of the path space mutation strategies, in the order of MLTStrategy
+    static auto StrategyNames() -> std::vector<std::string>
+    {
+        return { "bidirfixed", "bidir", "lens", "caustic", "multichain", "manifoldlens", "manifoldcaustic", "manifold", "identity" };
+    }
+
+public:
+
+    auto Init(const std::vector<std::string>& names) -> void
+    {
+        names_ = names;
+        entries_.assign(names.size(), Entry());
+    }
+
+    //! Starts the measurement of a mutation
+    auto Begin(const Scene3* scene) -> void
+    {
+        start_ = std::chrono::high_resolution_clock::now();
+        startRays_ = scene->NumIntersectQueries();
+    }
+
+    //! Ends the measurement of a mutation with the strategy `strategy` and the acceptance probability `A`
+    auto End(const Scene3* scene, int strategy, Float A, bool accept) -> void
+    {
+        auto& e = entries_[strategy];
+        e.proposed++;
+        if (accept) { e.accepted++; }
+        e.sumA += (double)(A);
+        e.time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_).count();
+        e.rays += scene->NumIntersectQueries() - startRays_;
+    }
+
+    auto Entries() const -> const std::vector<Entry>& { return entries_; }
+
+    auto Merge(const MLTMutationStats& o) -> void
+    {
+        for (size_t i = 0; i < entries_.size(); i++)
+        {
+            auto& e = entries_[i];
+            const auto& oe = o.entries_[i];
+            e.proposed += oe.proposed;
+            e.accepted += oe.accepted;
+            e.sumA += oe.sumA;
+            e.time += oe.time;
+            e.rays += oe.rays;
+        }
+    }
+
+public:
+
+    auto Print() const -> void
+    {
+        long long proposed = 0;
+        long long accepted = 0;
+        for (const auto& e : entries_)
+        {
+            proposed += e.proposed;
+            accepted += e.accepted;
+        }
+        LM_LOG_INFO(boost::str(boost::format("Ave. acceptance ratio: %.5f (%d / %d)") % (proposed > 0 ? (double)accepted / proposed : 0.0) % accepted % proposed));
+
+        LM_LOG_INFO("Mutation statistics per strategy");
+        LM_LOG_INDENTER();
+        for (size_t i = 0; i < entries_.size(); i++)
+        {
+            const auto& e = entries_[i];
+            if (e.proposed == 0)
+            {
+                LM_LOG_INFO(boost::str(boost::format("%-15s: N/A") % names_[i]));
+                continue;
+            }
+            LM_LOG_INFO(boost::str(boost::format("%-15s: acc %.5f (%d / %d), ave. A %.5f, time %.3fs, rays/mut %.2f")
+                % names_[i] % ((double)e.accepted / e.proposed) % e.accepted % e.proposed
+                % (e.sumA / e.proposed) % e.time % ((double)e.rays / e.proposed)));
+        }
+    }
+
+    auto Save(const std::string& path) const -> bool
+    {
+        std::ofstream out(path);
+        if (!out)
+        {
+            LM_LOG_ERROR("Failed to open mutation statistics: " + path);
+            return false;
+        }
+
+        out << "{\n  \"strategies\": [\n";
+        for (size_t i = 0; i < entries_.size(); i++)
+        {
+            const auto& e = entries_[i];
+            out << boost::str(boost::format("    { \"name\": \"%s\", \"proposed\": %d, \"accepted\": %d, \"sum_acceptance_prob\": %.10g, \"time\": %.10g, \"rays\": %d }%s\n")
+                % names_[i] % e.proposed % e.accepted % e.sumA % e.time % e.rays % (i + 1 < entries_.size() ? "," : ""));
+        }
+        out << "  ]\n}\n";
+
+        LM_LOG_INFO("Saved mutation statistics: " + path);
+        return true;
+    }
+
+private:
+
+    std::vector<std::string> names_;
+    std::vector<Entry> entries_;
+    std::chrono::high_resolution_clock::time_point start_;
+    long long startRays_ = 0;
+
+};
+
+// --------------------------------------------------------------------------------
+
+/*!
+    Adaptive selection of the mutation strategies.
+    During the burn-in of the first `adaptive_mutation_burnin` mutations of each thread context,
+    the selection weights are updated every `adaptive_mutation_update_interval` mutations
+    to the user weight times the expected acceptance probability per second measured by MLTMutationStats.
+    After the burn-in the weights are frozen, so the chain is a valid MCMC with a fixed mixture of the mutations.
+    The samples in the burn-in are not accumulated to the image.
+    To keep the chain ergodic, the weight of a strategy enabled by the user
+    never falls below `adaptive_mutation_min_weight` times the largest weight.
+*/
+class MLTAdaptiveMutationSelection
+{
+public:
+
+    auto Load(const PropertyNode* prop) -> void
+    {
+        enabled_ = prop->ChildAs<int>("adaptive_mutation", 0) != 0;
+        burnin_ = Math::Max(0ll, prop->ChildAs<long long>("adaptive_mutation_burnin", 100000));
+        updateInterval_ = Math::Max(1ll, prop->ChildAs<long long>("adaptive_mutation_update_interval", 1000));
+        minWeight_ = Math::Clamp(prop->ChildAs<Float>("adaptive_mutation_min_weight", 0.01_f), 0_f, 1_f);
+    }
+
+    auto Enabled() const -> bool { return enabled_; }
+
+    //! Checks if the `step`-th mutation of a thread context is in the burn-in
+    auto BurnIn(long long step) const -> bool { return enabled_ && step < burnin_; }
+
+    //! Updates the selection weights after the `step`-th mutation
+    auto Update(long long step, const std::vector<Float>& initWeights, const MLTMutationStats& stats, std::vector<Float>& weights) const -> void
+    {
+        if (!BurnIn(step) || ((step + 1) % updateInterval_ != 0 && step + 1 != burnin_))
+        {
+            return;
+        }
+
+        const auto& entries = stats.Entries();
+        const int n = (int)(initWeights.size());
+        std::vector<Float> eff(n, 0_f);
+        Float maxEff = 0_f;
+        for (int i = 0; i < n; i++)
+        {
+            const auto& e = entries[i];
+            if (initWeights[i] > 0_f && e.proposed > 0 && e.time > 0)
+            {
+                eff[i] = initWeights[i] * (Float)(e.sumA / e.time);
+                maxEff = Math::Max(maxEff, eff[i]);
+            }
+        }
+        if (maxEff <= 0_f)
+        {
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (initWeights[i] <= 0_f)
+            {
+                weights[i] = 0_f;
+            }
+            else if (entries[i].proposed == 0)
+            {
+                // Not yet observed
+                weights[i] = maxEff;
+            }
+            else
+            {
+                weights[i] = Math::Max(eff[i], minWeight_ * maxEff);
+            }
+        }
+    }
+
+    auto Print(const std::vector<std::string>& names, const std::vector<std::vector<Float>>& weights) const -> void
+    {
+        if (!enabled_ || weights.empty())
+        {
+            return;
+        }
+        LM_LOG_INFO("Adapted mutation selection probability (averaged over threads)");
+        LM_LOG_INDENTER();
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            Float p = 0_f;
+            for (const auto& w : weights)
+            {
+                Float sum = 0_f;
+                for (const auto& wi : w) { sum += wi; }
+                p += sum > 0_f ? w[i] / sum : 0_f;
+            }
+            LM_LOG_INFO(boost::str(boost::format("%-15s: %.5f") % names[i] % (p / weights.size())));
+        }
+    }
+
+private:
+
+    bool enabled_ = false;
+    long long burnin_;
+    long long updateInterval_;
+    Float minWeight_;
+
+};
+
+// --------------------------------------------------------------------------------
+
+/*!
+    Replica exchange (parallel tempering) for the MLT renderers.
+    Each thread context keeps a ladder of `num_replicas` chains targeting the tempered distributions f^beta,
+    where beta decreases geometrically from 1 (the original target) to `replica_min_beta`.
+    The chains with the smaller beta move more freely between the isolated modes of f,
+    and every `replica_swap_interval` steps the neighbouring chains propose to exchange their states
+    alternately between the even and odd pairs.
+    The ladder is local to the thread context, so the exchange requires no synchronization between threads.
+    Only the chain with beta = 1 contributes to the image.
+*/
+class MLTReplicaExchange
+{
+public:
+
+    struct Stats
+    {
+        std::vector<long long> attempted;
+        std::vector<long long> accepted;
+    };
+
+public:
+
+    auto Load(const PropertyNode* prop) -> void
+    {
+        numReplicas_ = Math::Max(1, prop->ChildAs<int>("num_replicas", 1));
+        minBeta_ = Math::Clamp(prop->ChildAs<Float>("replica_min_beta", 0.1_f), Math::EpsLarge(), 1_f);
+        swapInterval_ = Math::Max(1, prop->ChildAs<int>("replica_swap_interval", 1));
+        betas_.assign(numReplicas_, 1_f);
+        for (int r = 1; r < numReplicas_; r++)
+        {
+            betas_[r] = std::pow(minBeta_, (Float)(r) / (numReplicas_ - 1));
+        }
+    }
+
+    auto Enabled() const -> bool { return numReplicas_ > 1; }
+    auto NumReplicas() const -> int { return numReplicas_; }
+    auto Beta(int r) const -> Float { return betas_[r]; }
+
+    auto InitStats(Stats& stats) const -> void
+    {
+        stats.attempted.assign(numReplicas_, 0);
+        stats.accepted.assign(numReplicas_, 0);
+    }
+
+public:
+
+    /*!
+        Acceptance ratio of the mutation targeting f^beta.
+        `ratio` is the ratio for the original target f, and `currC` and `propC` are f of the current and proposed states.
+    */
+    static auto TemperedRatio(Float ratio, Float currC, Float propC, Float beta) -> Float
+    {
+        if (beta == 1_f || currC <= 0_f || propC <= 0_f)
+        {
+            return ratio;
+        }
+        return ratio * std::pow(propC / currC, beta - 1_f);
+    }
+
+    /*!
+        Proposes the exchanges of the states between the neighbouring chains.
+        `contrbFunc(r)` returns f of the current state of the chain r,
+        and `swapFunc(r1, r2)` exchanges the states of the two chains.
+    */
+    template <typename ContrbFunc, typename SwapFunc>
+    auto Exchange(long long step, Random& rng, Stats& stats, const ContrbFunc& contrbFunc, const SwapFunc& swapFunc) const -> void
+    {
+        if (!Enabled() || step % swapInterval_ != 0)
+        {
+            return;
+        }
+        const int parity = (int)((step / swapInterval_) % 2);
+        for (int r = parity; r + 1 < numReplicas_; r += 2)
+        {
+            const auto f1 = contrbFunc(r);
+            const auto f2 = contrbFunc(r + 1);
+
+            // A = min(1, (f2^b1 f1^b2) / (f1^b1 f2^b2))
+            const auto A = f1 <= 0_f ? 1_f : f2 <= 0_f ? 0_f : Math::Min(1_f, std::pow(f2 / f1, betas_[r] - betas_[r + 1]));
+            stats.attempted[r]++;
+            if (rng.Next() < A)
+            {
+                stats.accepted[r]++;
+                swapFunc(r, r + 1);
+            }
+        }
+    }
+
+    auto PrintStats(const std::vector<Stats>& stats) const -> void
+    {
+        if (!Enabled())
+        {
+            return;
+        }
+        LM_LOG_INFO("Replica exchange acceptance ratio");
+        LM_LOG_INDENTER();
+        for (int r = 0; r + 1 < numReplicas_; r++)
+        {
+            long long attempted = 0;
+            long long accepted = 0;
+            for (const auto& s : stats)
+            {
+                attempted += s.attempted[r];
+                accepted += s.accepted[r];
+            }
+            const double ave = attempted > 0 ? (double)accepted / attempted : 0.0;
+            LM_LOG_INFO(boost::str(boost::format("beta %.3f <-> %.3f: %.5f (%d / %d)") % betas_[r] % betas_[r + 1] % ave % accepted % attempted));
+        }
+    }
+
+private:
+
+    int numReplicas_ = 1;
+    Float minBeta_;
+    int swapInterval_;
+    std::vector<Float> betas_;
+
+};
+
 LM_NAMESPACE_END
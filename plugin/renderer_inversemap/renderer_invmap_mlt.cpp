@@ -29,7 +29,6 @@
 #include <boost/filesystem.hpp>
 
 #define INVERSEMAP_MLT_DEBUG_OUTPUT_PER_LENGTH_IMAGE 0
-#define INVERSEMAP_MLT_DEBUG_OUTPUT_AVE_ACC 1
 
 LM_NAMESPACE_BEGIN
 
@@ -48,9 +47,12 @@ public:
     long long numSeedSamples_;
     double seedRenderTime_;
     MLTMutationStrategy mut_;
+    MLTReplicaExchange replicaExchange_;
+    MLTAdaptiveMutationSelection adaptiveSelection_;
     std::vector<Float> initStrategyWeights_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
     std::vector<Float> invS1_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
     std::vector<Float> invS2_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
+    std::string mutationStatsPath_;
     #if INVERSEMAP_OMIT_NORMALIZATION
     Float normalization_;
     #endif
@@ -64,6 +66,9 @@ public:
         renderTime_ = prop->ChildAs<double>("render_time", -1);
         numSeedSamples_ = prop->ChildAs<long long>("num_seed_samples", 0);
         seedRenderTime_ = prop->ChildAs<double>("seed_render_time", -1);
+        replicaExchange_.Load(prop);
+        adaptiveSelection_.Load(prop);
+        mutationStatsPath_ = prop->ChildAs<std::string>("mutation_stats_path", "");
         {
             LM_LOG_INFO("Loading mutation strategy weights");
             LM_LOG_INDENTER();
@@ -145,25 +150,24 @@ public:
             {
                 Random rng;
                 Film::UniquePtr film{ nullptr, nullptr };
-                Path currP;
-                #if INVERSEMAP_MLT_DEBUG_OUTPUT_AVE_ACC
-                long long acceptCount = 0;
-                std::vector<long long> acceptCountPerTech;
-                std::vector<long long> sampleCountPerTech;
-                #endif
+                std::vector<Path> states;       // States of the replicas, states[0] is the chain with beta = 1
+                long long step = 0;
+                long long numBurnin = 0;                // Number of mutations in the burn-in of the adaptive mutation selection
+                MLTReplicaExchange::Stats replicaStats;
+                MLTMutationStats mutationStats;
+                std::vector<Float> strategyWeights;     // Current mutation strategy weights
             };
             std::vector<Context> contexts(Parallel::GetNumThreads());
             for (auto& ctx : contexts)
             {
                 ctx.rng.SetSeed(initRng->NextUInt());
                 ctx.film = ComponentFactory::Clone<Film>(film);
-                #if INVERSEMAP_MLT_DEBUG_OUTPUT_AVE_ACC
-                ctx.acceptCountPerTech.assign(initStrategyWeights_.size(), 0);
-                ctx.sampleCountPerTech.assign(initStrategyWeights_.size(), 0);
-                #endif
+                replicaExchange_.InitStats(ctx.replicaStats);
+                ctx.mutationStats.Init(MLTMutationStats::StrategyNames());
+                ctx.strategyWeights = initStrategyWeights_;
 
                 // Initial state
-                while (true)
+                while ((int)(ctx.states.size()) < replicaExchange_.NumReplicas())
                 {
                     // Generate initial path with bidirectional path tracing
                     const auto path = [&]() -> boost::optional<Path>
@@ -198,8 +202,7 @@ public:
                         continue;
                     }
 
-                    ctx.currP = *path;
-                    break;
+                    ctx.states.push_back(*path);
                 }
             }
 
@@ -208,11 +211,14 @@ public:
             const auto processed = Parallel::For({ renderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numMutations_, renderTime_ }, [&](long long index, int threadid, bool init) -> void
             {
                 auto& ctx = contexts[threadid];
+                const auto step = ctx.step++;
+                const bool burnin = adaptiveSelection_.BurnIn(step);
+                if (burnin) { ctx.numBurnin++; }
 
                 // --------------------------------------------------------------------------------
                 
-                struct MutationResult { bool accept; MLTStrategy strategy; };
-                const auto mutationResult = [&]() -> MutationResult
+                struct MutationResult { bool accept; MLTStrategy strategy; Float A; };
+                const auto Mutate = [&](Path& currP, Float beta) -> MutationResult
                 {
                     #pragma region Select mutation strategy
                     Distribution1D strategySelectionDist;
@@ -221,7 +227,7 @@ public:
                         strategySelectionDist.Clear();
                         for (size_t i = 0; i < initStrategyWeights_.size(); i++)
                         {
-                            const auto w = initStrategyWeights_[i];
+                            const auto w = ctx.strategyWeights[i];
                             if (MLTMutationStrategy::CheckMutatable((MLTStrategy)(i), path))
                             {
                                 strategySelectionDist.Add(w);
@@ -233,17 +239,17 @@ public:
                         }
                         strategySelectionDist.Normalize();
                     };
-                    UpdateStrategySelectionDist(ctx.currP);
+                    UpdateStrategySelectionDist(currP);
                     const auto strategy = (MLTStrategy)(strategySelectionDist.Sample(ctx.rng.Next()));
                     #pragma endregion
 
                     // --------------------------------------------------------------------------------
 
                     #pragma region Mutate the current path
-                    const auto prop = MLTMutationStrategy::Mutate(strategy, scene, ctx.rng, ctx.currP, maxNumVertices_, 1_f / invS1_[(int)strategy], 1_f / invS2_[(int)strategy]);
+                    const auto prop = MLTMutationStrategy::Mutate(strategy, scene, ctx.rng, currP, maxNumVertices_, 1_f / invS1_[(int)strategy], 1_f / invS2_[(int)strategy]);
                     if (!prop)
                     {
-                        return { false, strategy };
+                        return { false, strategy, 0_f };
                     }
                     #pragma endregion
 
@@ -251,9 +257,9 @@ public:
 
                     #pragma region MH update
                     {
-                        const auto Qxy = MLTMutationStrategy::Q(strategy, scene, ctx.currP, prop->p, prop->subspace, maxNumVertices_) * strategySelectionDist.EvaluatePDF((int)(strategy));
+                        const auto Qxy = MLTMutationStrategy::Q(strategy, scene, currP, prop->p, prop->subspace, maxNumVertices_) * strategySelectionDist.EvaluatePDF((int)(strategy));
                         UpdateStrategySelectionDist(prop->p);
-                        const auto Qyx = MLTMutationStrategy::Q(strategy, scene, prop->p, ctx.currP, prop->subspace.Reverse(), maxNumVertices_) * strategySelectionDist.EvaluatePDF((int)(strategy));
+                        const auto Qyx = MLTMutationStrategy::Q(strategy, scene, prop->p, currP, prop->subspace.Reverse(), maxNumVertices_) * strategySelectionDist.EvaluatePDF((int)(strategy));
                         Float A = 0_f;
                         if (Qxy <= 0_f || Qyx <= 0_f || std::isnan(Qxy) || std::isnan(Qyx))
                         {
@@ -261,48 +267,57 @@ public:
                         }
                         else
                         {
-                            A = Math::Min(1_f, Qyx / Qxy);
+                            // Target the tempered distribution
+                            const auto ratio = Qyx / Qxy;
+                            A = Math::Min(1_f, beta == 1_f ? ratio : MLTReplicaExchange::TemperedRatio(ratio,
+                                InversemapUtils::ScalarContrb(currP.EvaluateF(0)),
+                                InversemapUtils::ScalarContrb(prop->p.EvaluateF(0)), beta));
                         }
                         if (ctx.rng.Next() < A)
                         {
-                            ctx.currP = prop->p;
+                            currP = prop->p;
                         }
                         else
                         {
-                            return { false, strategy };
+                            return { false, strategy, A };
                         }
+                        return { true, strategy, A };
                     }
                     #pragma endregion
-
-                    // --------------------------------------------------------------------------------
-
-                    return { true, strategy };
-                }();
+                };
+                ctx.mutationStats.Begin(scene);
+                const auto mutationResult = Mutate(ctx.states[0], 1_f);
+                ctx.mutationStats.End(scene, (int)(mutationResult.strategy), mutationResult.A, mutationResult.accept);
+                adaptiveSelection_.Update(step, initStrategyWeights_, ctx.mutationStats, ctx.strategyWeights);
+                for (int r = 1; r < replicaExchange_.NumReplicas(); r++)
+                {
+                    Mutate(ctx.states[r], replicaExchange_.Beta(r));
+                }
 
                 // --------------------------------------------------------------------------------
 
-                #if INVERSEMAP_MLT_DEBUG_OUTPUT_AVE_ACC
-                if (mutationResult.accept) { ctx.acceptCount++; }
-                ctx.sampleCountPerTech[(int)(mutationResult.strategy)]++;
-                if (mutationResult.accept) { ctx.acceptCountPerTech[(int)(mutationResult.strategy)]++; }
-                #else
-                LM_UNUSED(mutationResult);
-                #endif
+                #pragma region Replica exchange
+                replicaExchange_.Exchange(step, ctx.rng, ctx.replicaStats,
+                    [&](int r) -> Float { return InversemapUtils::ScalarContrb(ctx.states[r].EvaluateF(0)); },
+                    [&](int r1, int r2) -> void { std::swap(ctx.states[r1], ctx.states[r2]); });
+                #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
                 #pragma region Accumulate contribution
+                if (!burnin)
                 {
-                    const auto currF = ctx.currP.EvaluateF(0);
+                    const auto& currP = ctx.states[0];
+                    const auto currF = currP.EvaluateF(0);
                     if (!currF.Black())
                     {
-                        const auto rp = ctx.currP.RasterPosition();
+                        const auto rp = currP.RasterPosition();
                         const auto C = currF * (b / InversemapUtils::ScalarContrb(currF));
                         ctx.film->Splat(rp, C);
                         #if INVERSEMAP_MLT_DEBUG_OUTPUT_PER_LENGTH_IMAGE
                         {
                             std::unique_lock<std::mutex> lock(perLengthFilmMutex);
-                            perLengthFilms[ctx.currP.vertices.size() - 2]->Splat(rp, C);
+                            perLengthFilms[currP.vertices.size() - 2]->Splat(rp, C);
                         }
                         #endif
                     }
@@ -312,37 +327,24 @@ public:
             
             // --------------------------------------------------------------------------------
 
-            #if INVERSEMAP_MLT_DEBUG_OUTPUT_AVE_ACC
             {
-                long long sum = 0;
-                for (auto& ctx : contexts) { sum += ctx.acceptCount; }
-                const double ave = (double)sum / processed;
-                LM_LOG_INFO(boost::str(boost::format("Ave. acceptance ratio: %.5f (%d / %d)") % ave % sum % processed));
+                MLTMutationStats mutationStats;
+                mutationStats.Init(MLTMutationStats::StrategyNames());
+                for (const auto& ctx : contexts) { mutationStats.Merge(ctx.mutationStats); }
+                mutationStats.Print();
+                if (!mutationStatsPath_.empty()) { mutationStats.Save(mutationStatsPath_); }
             }
             {
-                LM_LOG_INFO("Ave. acceptance ratio per strategy");
-                LM_LOG_INDENTER();
-                for (size_t i = 0; i < initStrategyWeights_.size(); i++)
-                {
-                    long long acceptCount = 0;
-                    long long sampleCount = 0;
-                    for (const auto& ctx : contexts)
-                    {
-                        acceptCount += ctx.acceptCountPerTech[i];
-                        sampleCount += ctx.sampleCountPerTech[i];
-                    }
-                    if (sampleCount > 0)
-                    {
-                        const double ave = (double)acceptCount / sampleCount;
-                        LM_LOG_INFO(boost::str(boost::format("%02d: %.5f (%d / %d)") % i % ave % acceptCount % sampleCount));
-                    }
-                    else
-                    {
-                        LM_LOG_INFO(boost::str(boost::format("%02d: N/A") % i));
-                    }
-                }
+                std::vector<std::vector<Float>> strategyWeights;
+                for (const auto& ctx : contexts) { strategyWeights.push_back(ctx.strategyWeights); }
+                adaptiveSelection_.Print(MLTMutationStats::StrategyNames(), strategyWeights);
+            }
+
+            {
+                std::vector<MLTReplicaExchange::Stats> replicaStats;
+                for (const auto& ctx : contexts) { replicaStats.push_back(ctx.replicaStats); }
+                replicaExchange_.PrintStats(replicaStats);
             }
-            #endif
 
             // --------------------------------------------------------------------------------
 
@@ -352,7 +354,19 @@ public:
             {
                 film->Accumulate(ctx.film.get());
             }
-            film->Rescale((Float)(film->Width() * film->Height()) / processed);
+            long long numBurnin = 0;
+            for (const auto& ctx : contexts) { numBurnin += ctx.numBurnin; }
+            if (processed <= numBurnin)
+            {
+                LM_LOG_WARN("All mutations are in the burn-in of the adaptive mutation selection. Decrease 'adaptive_mutation_burnin'");
+            }
+            film->Rescale((Float)(film->Width() * film->Height()) / Math::Max(1ll, processed - numBurnin));
+            #if INVERSEMAP_MLT_DEBUG_OUTPUT_PER_LENGTH_IMAGE
+            for (int i = 0; i < maxNumVertices_ - 1; i++)
+            {
+                perLengthFilms[i]->Rescale((Float)(film->Width() * film->Height()) / Math::Max(1ll, processed - numBurnin));
+            }
+            #endif
             #pragma endregion
         }
         #pragma endregion
@@ -367,7 +381,6 @@ public:
             #if INVERSEMAP_MLT_DEBUG_OUTPUT_PER_LENGTH_IMAGE
             for (int i = 0; i < maxNumVertices_ - 1; i++)
             {
-                perLengthFilms[i]->Rescale((Float)(film->Width() * film->Height()) / processed);
                 perLengthFilms[i]->Save((boost::filesystem::path(outputPath).remove_filename() / boost::str(boost::format("L%02d") % i)).string());
             }
             #endif
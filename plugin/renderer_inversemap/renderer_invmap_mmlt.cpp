@@ -24,9 +24,57 @@
 
 #include "inversemaputils.h"
 #include "multiplexeddensity.h"
+#include "mltutils.h"
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
+/*!
+    Weighted reservoir of the seed states for a path length.
+    Each slot independently keeps one of the candidates found in the seed phase,
+    selected with the probability proportional to the scalar contribution.
+*/
+struct MMLTSeedReservoir
+{
+    struct Slot
+    {
+        Float wsum = 0_f;                       // Sum of the contributions of the candidates
+        MultiplexedDensity::State state;        // Selected state
+    };
+    std::vector<Slot> slots;
+
+    // Adds a candidate with the contribution C. The state is constructed only if selected in any slot.
+    template <typename StateFunc>
+    auto Add(Random& rng, Float C, const StateFunc& makeState) -> void
+    {
+        boost::optional<MultiplexedDensity::State> state;
+        for (auto& slot : slots)
+        {
+            slot.wsum += C;
+            if (rng.Next() * slot.wsum < C)
+            {
+                if (!state) { state = makeState(); }
+                slot.state = *state;
+            }
+        }
+    }
+
+    auto Merge(Random& rng, const MMLTSeedReservoir& o) -> void
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            auto& slot = slots[i];
+            const auto& oslot = o.slots[i];
+            if (oslot.wsum <= 0_f) { continue; }
+            slot.wsum += oslot.wsum;
+            if (rng.Next() * slot.wsum < oslot.wsum)
+            {
+                slot.state = oslot.state;
+            }
+        }
+    }
+};
+
 ///! Multiplexed metropolis light transport
 class Renderer_Invmap_MMLT final : public Renderer
 {
@@ -42,6 +90,9 @@ public:
     long long numSeedSamples_;
     double seedRenderTime_;
     Float largeStepProb_;
+    int numSeedCandidates_;
+    int numProposals_;
+    MLTReplicaExchange replicaExchange_;
 
 public:
 
@@ -53,6 +104,9 @@ public:
         numSeedSamples_ = prop->ChildAs<long long>("num_seed_samples", 0);
         seedRenderTime_ = prop->ChildAs<double>("seed_render_time", -1);
         largeStepProb_ = prop->ChildAs<Float>("large_step_prob", 0.5_f);
+        numSeedCandidates_ = Math::Max(1, prop->ChildAs<int>("num_seed_candidates", 64));
+        numProposals_ = Math::Max(1, prop->ChildAs<int>("num_proposals", 1));
+        replicaExchange_.Load(prop);
         return true;
     };
 
@@ -64,6 +118,7 @@ public:
         // --------------------------------------------------------------------------------
 
         #pragma region Sample candidates for seed paths and normalization factor estimation
+        std::vector<MMLTSeedReservoir> seeds(maxNumVertices_ - 1);      // Seed states for each path length
         const auto b = [&]() -> std::vector<Float>
         {
             LM_LOG_INFO("Computing normalizagion factor");
@@ -73,22 +128,33 @@ public:
             {
                 Random rng;
                 std::vector<Float> b;
+                std::vector<MMLTSeedReservoir> seeds;
+                std::vector<Float> usL;
+                std::vector<Float> usE;
             };
             std::vector<Context> contexts(Parallel::GetNumThreads());
             for (auto& ctx : contexts)
             {
                 ctx.rng.SetSeed(initRng->NextUInt());
                 ctx.b.assign(maxNumVertices_ - 1, 0_f);
+                ctx.seeds.assign(maxNumVertices_ - 1, MMLTSeedReservoir());
+                for (auto& seed : ctx.seeds) { seed.slots.assign(numSeedCandidates_, MMLTSeedReservoir::Slot()); }
+                ctx.usL.assign(maxNumVertices_ * 3, 0_f);
+                ctx.usE.assign(maxNumVertices_ * 3, 0_f);
             }
 
             const auto processed = Parallel::For({ seedRenderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numSeedSamples_, seedRenderTime_ }, [&](long long index, int threadid, bool init)
             {
                 auto& ctx = contexts[threadid];
 
+                // Subpaths are sampled with primary samples so that the candidates can be stored as the states.
+                // The prefix of the primary samples maps to the same prefix of the subpath.
+                for (auto& u : ctx.usE) u = ctx.rng.Next();
+                for (auto& u : ctx.usL) u = ctx.rng.Next();
                 Subpath subpathE;
                 Subpath subpathL;
-                subpathE.SampleSubpathFromEndpoint(scene, &ctx.rng, TransportDirection::EL, maxNumVertices_);
-                subpathL.SampleSubpathFromEndpoint(scene, &ctx.rng, TransportDirection::LE, maxNumVertices_);
+                subpathE.SampleSubpathWithPrimarySamples(scene, ctx.usE, TransportDirection::EL, maxNumVertices_);
+                subpathL.SampleSubpathWithPrimarySamples(scene, ctx.usL, TransportDirection::LE, maxNumVertices_);
 
                 const int nL = (int)(subpathL.vertices.size());
                 const int nE = (int)(subpathE.vertices.size());
@@ -108,9 +174,19 @@ public:
                         if (Cstar.Black()) { continue; }
 
                         const auto w = fullpath.EvaluateMISWeight(scene, s);
-                        const auto C = Cstar * w;
+                        const auto C = InversemapUtils::ScalarContrb(Cstar * w);
                         
-                        ctx.b[n - 2] += InversemapUtils::ScalarContrb(C);
+                        ctx.b[n - 2] += C;
+                        ctx.seeds[n - 2].Add(ctx.rng, C, [&]() -> MultiplexedDensity::State
+                        {
+                            // Technique selection is fixed to t in [t/(n+1), (t+1)/(n+1))
+                            MultiplexedDensity::State state;
+                            state.numVertices_ = n;
+                            state.uT_ = ((Float)(t) + ctx.rng.Next()) / (Float)(n + 1);
+                            state.usL_.assign(ctx.usL.begin(), ctx.usL.begin() + n * 3);
+                            state.usE_.assign(ctx.usE.begin(), ctx.usE.begin() + n * 3);
+                            return state;
+                        });
                     }
                 }
             });
@@ -119,6 +195,12 @@ public:
             for (auto& ctx : contexts) { std::transform(b.begin(), b.end(), ctx.b.begin(), b.begin(), std::plus<Float>()); }
             for (auto& v : b) { v /= (Float)(processed); }
 
+            for (auto& seed : seeds) { seed.slots.assign(numSeedCandidates_, MMLTSeedReservoir::Slot()); }
+            for (auto& ctx : contexts)
+            {
+                for (int k = 0; k < maxNumVertices_ - 1; k++) { seeds[k].Merge(*initRng, ctx.seeds[k]); }
+            }
+
             {
                 LM_LOG_INFO("Normalization factor(s)");
                 LM_LOG_INDENTER();
@@ -154,55 +236,157 @@ public:
             {
                 Random rng;
                 Film::UniquePtr film{ nullptr, nullptr };
-                std::vector<MultiplexedDensity::State> curr;
+                std::vector<std::vector<MultiplexedDensity::State>> replicas;   // States of the replicas for each path length, replicas[0] is the chain with beta = 1
+                long long step = 0;
+                MLTReplicaExchange::Stats replicaStats;
+                std::unique_ptr<Random[]> proposalRngs;  // Random number generators for the parallel proposals
             };
-            std::vector<Context> contexts(Parallel::GetNumThreads());
+            std::vector<Context> contexts(numProposals_ > 1 ? 1 : Parallel::GetNumThreads());
             for (auto& ctx : contexts)
             {
                 ctx.rng.SetSeed(initRng->NextUInt());
                 ctx.film = ComponentFactory::Clone<Film>(film);
-                ctx.curr.assign(maxNumVertices_-1, MultiplexedDensity::State());
+                if (numProposals_ > 1)
+                {
+                    ctx.proposalRngs.reset(new Random[numProposals_]);
+                    for (int i = 0; i < numProposals_; i++) { ctx.proposalRngs[i].SetSeed(initRng->NextUInt()); }
+                }
+                ctx.replicas.assign(replicaExchange_.NumReplicas(), std::vector<MultiplexedDensity::State>(maxNumVertices_ - 1));
+                replicaExchange_.InitStats(ctx.replicaStats);
 
-                // Initial state
+                // Initial state, resampled from the seed candidates
+                for (auto& curr : ctx.replicas)
                 for (int k = 0; k < maxNumVertices_ - 1; k++)
                 {
-                    //LM_LOG_INFO("Setting initial state for k = " + std::to_string(k));
-                    //LM_LOG_INDENTER();
-
                     // Skip if no valid path with given length
                     if (pathLengthDist.EvaluatePDF(k) < Math::EpsLarge())
                     {
-                        //LM_LOG_INFO("Skipping");
                         continue;
                     }
 
-                    // Find initial state for given length
-                    long long i;
-                    const long long MaxInitialStateIter = 10000000;
-                    for (i = 0; i < MaxInitialStateIter; i++)
+                    const auto& slots = seeds[k].slots;
+                    const int offset = Math::Min((int)(initRng->Next() * slots.size()), (int)(slots.size()) - 1);
+                    for (size_t i = 0; i < slots.size(); i++)
                     {
-                        MultiplexedDensity::State state(initRng, k+2);
-                        const auto path = MultiplexedDensity::InvCDF(state, scene);
-                        if (!path)
+                        const auto& slot = slots[(offset + i) % slots.size()];
+                        if (slot.wsum <= 0_f || !MultiplexedDensity::InvCDF(slot.state, scene))
                         {
                             continue;
                         }
-
-                        //LM_LOG_INFO("Found with iter = " + std::to_string(i));
-                        ctx.curr[k] = std::move(state);
+                        curr[k] = slot.state;
                         break;
                     }
-                    if (i == MaxInitialStateIter)
+                }
+            }
+
+            // --------------------------------------------------------------------------------
+
+            // Multiple-proposal mode [Calderhead 2014].
+            // A single set of chains is updated, and in each step `num_proposals` proposals are evaluated in parallel.
+            // From the current state x, an auxiliary state z is sampled with the symmetric kernel (small or large step),
+            // and the proposals y_1..y_N are sampled from z with the same kernel.
+            // Then the stationary distribution over the N+1 states {x, y_1, .., y_N} is proportional to f^beta,
+            // so all states are splatted with the stationary probabilities as the weights,
+            // and the next state is selected according to them.
+            // Each step counts as `num_proposals` mutations.
+            const auto RenderWithMultipleProposals = [&]() -> long long
+            {
+                auto& ctx = contexts[0];
+                const int N = numProposals_;
+                std::vector<MultiplexedDensity::State> ys(N + 1);
+                std::vector<boost::optional<MultiplexedDensity::CachedPath>> ps(N + 1);
+                std::vector<Float> ws(N + 1);
+
+                const auto MutateWithMultipleProposals = [&](MultiplexedDensity::State& curr, Float beta, bool splat, int k) -> void
+                {
+                    const bool largeStep = ctx.rng.Next() < largeStepProb_;
+                    const auto Step = [&](const MultiplexedDensity::State& s, Random* rng) { return largeStep ? s.LargeStep(rng) : s.SmallStep(rng); };
+                    const auto z = Step(curr, &ctx.rng);
+
+                    // Sample and evaluate the proposals in parallel. The index 0 is the current state.
+                    tbb::parallel_for(tbb::blocked_range<int>(0, N + 1, 1), [&](const tbb::blocked_range<int>& range) -> void
+                    {
+                        for (int i = range.begin(); i != range.end(); i++)
+                        {
+                            ys[i] = i == 0 ? curr : Step(z, &ctx.proposalRngs[i - 1]);
+                            ps[i] = MultiplexedDensity::InvCDF(ys[i], scene);
+                            const auto f = ps[i] ? InversemapUtils::ScalarContrb(ps[i]->Cstar * ps[i]->w) : 0_f;
+                            ws[i] = f > 0_f ? std::pow(f, beta) : 0_f;
+                        }
+                    });
+
+                    Float W = 0_f;
+                    for (const auto w : ws) { W += w; }
+                    if (W <= 0_f)
+                    {
+                        return;
+                    }
+
+                    if (splat)
+                    {
+                        for (int i = 0; i <= N; i++)
+                        {
+                            if (ws[i] <= 0_f) { continue; }
+                            const auto C = ps[i]->Cstar * ps[i]->w;
+                            const auto I = InversemapUtils::ScalarContrb(C);
+                            ctx.film->Splat(ps[i]->path.RasterPosition(), C * (b[k] / I) * (ws[i] / W) / pathLengthDist.EvaluatePDF(k));
+                        }
+                    }
+
+                    // Select the next state
+                    const auto u = ctx.rng.Next() * W;
+                    Float sum = 0_f;
+                    for (int i = 0; i <= N; i++)
+                    {
+                        sum += ws[i];
+                        if (u < sum)
+                        {
+                            if (i > 0) { curr.Swap(ys[i]); }
+                            break;
+                        }
+                    }
+                };
+
+                const auto start = std::chrono::high_resolution_clock::now();
+                long long numSteps = 0;
+                for (long long numMutations = 0; ; numMutations += N)
+                {
+                    if (renderTime_ < 0)
+                    {
+                        if (numMutations >= numMutations_) { break; }
+                    }
+                    else
+                    {
+                        if (std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() > renderTime_) { break; }
+                    }
+                    numSteps++;
+
+                    const auto k = pathLengthDist.Sample(ctx.rng.Next());
+                    if (pathLengthDist.EvaluatePDF(k) < Math::EpsLarge())
                     {
-                        //LM_LOG_INFO("Skipping");
                         continue;
                     }
+
+                    for (int r = 0; r < replicaExchange_.NumReplicas(); r++)
+                    {
+                        MutateWithMultipleProposals(ctx.replicas[r][k], replicaExchange_.Beta(r), r == 0, k);
+                    }
+
+                    replicaExchange_.Exchange(ctx.step++, ctx.rng, ctx.replicaStats,
+                        [&](int r) -> Float
+                        {
+                            const auto p = MultiplexedDensity::InvCDF(ctx.replicas[r][k], scene);
+                            return p ? InversemapUtils::ScalarContrb(p->Cstar * p->w) : 0_f;
+                        },
+                        [&](int r1, int r2) -> void { ctx.replicas[r1][k].Swap(ctx.replicas[r2][k]); });
                 }
-            }
+
+                return numSteps;
+            };
 
             // --------------------------------------------------------------------------------
 
-            const auto processed = Parallel::For({ renderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numMutations_, renderTime_ }, [&](long long index, int threadid, bool init) -> void
+            const auto processed = numProposals_ > 1 ? RenderWithMultipleProposals() : Parallel::For({ renderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numMutations_, renderTime_ }, [&](long long index, int threadid, bool init) -> void
             {
                 auto& ctx = contexts[threadid];
 
@@ -219,15 +403,15 @@ public:
                 // --------------------------------------------------------------------------------
 
                 #pragma region Mutation
-                const auto accept = [&]() -> bool
+                const auto Mutate = [&](MultiplexedDensity::State& curr, Float beta) -> bool
                 {
                     // Mutate
                     auto prop = ctx.rng.Next() < largeStepProb_
-                        ? ctx.curr[k].LargeStep(&ctx.rng)
-                        : ctx.curr[k].SmallStep(&ctx.rng);
+                        ? curr.LargeStep(&ctx.rng)
+                        : curr.SmallStep(&ctx.rng);
 
                     // Paths
-                    const auto currP = MultiplexedDensity::InvCDF(ctx.curr[k], scene);
+                    const auto currP = MultiplexedDensity::InvCDF(curr, scene);
                     const auto propP = MultiplexedDensity::InvCDF(prop, scene);
                     if (!propP)
                     {
@@ -238,24 +422,39 @@ public:
                     const auto currC = InversemapUtils::ScalarContrb(currP->Cstar * currP->w);
                     const auto propC = InversemapUtils::ScalarContrb(propP->Cstar * propP->w);
 
-                    // MH update
-                    const auto A = currC == 0_f ? 1_f : Math::Min(1_f, propC / currC);
+                    // MH update targeting the tempered distribution
+                    const auto A = currC == 0_f ? 1_f : Math::Min(1_f, MLTReplicaExchange::TemperedRatio(propC / currC, currC, propC, beta));
                     if (ctx.rng.Next() < A)
                     {
-                        ctx.curr[k].Swap(prop);
+                        curr.Swap(prop);
                         return true;
                     }
 
                     return false;
-                }();
-                LM_UNUSED(accept);
+                };
+                for (int r = 0; r < replicaExchange_.NumReplicas(); r++)
+                {
+                    Mutate(ctx.replicas[r][k], replicaExchange_.Beta(r));
+                }
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Replica exchange
+                replicaExchange_.Exchange(ctx.step++, ctx.rng, ctx.replicaStats,
+                    [&](int r) -> Float
+                    {
+                        const auto p = MultiplexedDensity::InvCDF(ctx.replicas[r][k], scene);
+                        return p ? InversemapUtils::ScalarContrb(p->Cstar * p->w) : 0_f;
+                    },
+                    [&](int r1, int r2) -> void { ctx.replicas[r1][k].Swap(ctx.replicas[r2][k]); });
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
                 #pragma region Accumulate contribution
                 {
-                    const auto p = MultiplexedDensity::InvCDF(ctx.curr[k], scene);
+                    const auto p = MultiplexedDensity::InvCDF(ctx.replicas[0][k], scene);
                     assert(p);
                     const auto C = p->Cstar * p->w;
                     const auto I = InversemapUtils::ScalarContrb(C);
@@ -266,6 +465,14 @@ public:
 
             // --------------------------------------------------------------------------------
 
+            {
+                std::vector<MLTReplicaExchange::Stats> replicaStats;
+                for (const auto& ctx : contexts) { replicaStats.push_back(ctx.replicaStats); }
+                replicaExchange_.PrintStats(replicaStats);
+            }
+
+            // --------------------------------------------------------------------------------
+
             // Gather & Rescale
             film->Clear();
             for (auto& ctx : contexts)
@@ -30,7 +30,6 @@
 #include <cereal/archives/json.hpp>
 #include <cereal/types/vector.hpp>
 
-#define INVERSEMAP_MMLTINVMAP_DEBUG_OUTPUT_AVE_ACC 1
 #define INVERSEMAP_MMLTINVMAP_MEASURE_TRANSITION_TIME 1
 
 #define INVERSEMAP_MMLTINVMAP_DEBUG_IO 0
@@ -73,6 +72,8 @@ public:
     std::vector<Float> initStrategyWeights_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
     std::vector<Float> invS1_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
     std::vector<Float> invS2_{ 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f, 0_f };
+    std::string mutationStatsPath_;
+    MLTAdaptiveMutationSelection adaptiveSelection_;
 
 public:
 
@@ -83,6 +84,8 @@ public:
         renderTime_ = prop->ChildAs<double>("render_time", -1);
         numSeedSamples_ = prop->ChildAs<long long>("num_seed_samples", 0);
         seedRenderTime_ = prop->ChildAs<double>("seed_render_time", -1);
+        mutationStatsPath_ = prop->ChildAs<std::string>("mutation_stats_path", "");
+        adaptiveSelection_.Load(prop);
         {
             LM_LOG_INFO("Loading mutation strategy weights");
             LM_LOG_INDENTER();
@@ -272,6 +275,10 @@ public:
             LM_LOG_INFO("Rendering");
             LM_LOG_INDENTER();
 
+            // Path space mutations followed by primary sample space mutations, in the order of MMLTInvmap_Strategy
+            auto mutationStrategyNames = MLTMutationStats::StrategyNames();
+            mutationStrategyNames.insert(mutationStrategyNames.end(), { "smallstep", "largestep", "changetechnique" });
+
             // Thread-specific context
             struct Context
             {
@@ -283,11 +290,10 @@ public:
                     MultiplexedDensity::CachedPath path;        // Cached path
                 };
                 std::vector<CachedState> curr;
-                #if INVERSEMAP_MMLTINVMAP_DEBUG_OUTPUT_AVE_ACC
-                long long acceptCount = 0;
-                std::vector<long long> acceptCountPerTech;
-                std::vector<long long> sampleCountPerTech;
-                #endif
+                MLTMutationStats mutationStats;
+                std::vector<Float> strategyWeights;     // Current mutation strategy weights
+                long long step = 0;
+                long long numBurnin = 0;                // Number of mutations in the burn-in of the adaptive mutation selection
                 #if INVERSEMAP_MMLTINVMAP_MEASURE_TRANSITION_TIME
                 double transitionTime = 0;
                 long long transitionCount = 0;
@@ -303,10 +309,8 @@ public:
                 ctx.rng.SetSeed(initRng->NextUInt());
                 ctx.film = ComponentFactory::Clone<Film>(film);
                 ctx.curr.assign(maxNumVertices_ - 1, Context::CachedState());
-                #if INVERSEMAP_MMLTINVMAP_DEBUG_OUTPUT_AVE_ACC
-                ctx.acceptCountPerTech.assign(initStrategyWeights_.size(), 0);
-                ctx.sampleCountPerTech.assign(initStrategyWeights_.size(), 0);
-                #endif
+                ctx.mutationStats.Init(mutationStrategyNames);
+                ctx.strategyWeights = initStrategyWeights_;
 
                 // Initial state
                 for (int k = 0; k < maxNumVertices_ - 1; k++)
@@ -372,6 +376,9 @@ public:
             const auto processed = Parallel::For({ renderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numMutations_, renderTime_ }, [&](long long index, int threadid, bool init) -> void
             {
                 auto& ctx = contexts[threadid];
+                const auto step = ctx.step++;
+                const bool burnin = adaptiveSelection_.BurnIn(step);
+                if (burnin) { ctx.numBurnin++; }
 
                 // --------------------------------------------------------------------------------
                 
@@ -390,7 +397,9 @@ public:
                 {
                     bool accept;
                     MMLTInvmap_Strategy strategy;
+                    Float A;
                 };
+                ctx.mutationStats.Begin(scene);
                 const auto mutationResult = [&]() -> MutationResult
                 {
                     #pragma region Select mutation strategy
@@ -400,7 +409,7 @@ public:
                         strategySelectionDist.Clear();
                         for (size_t i = 0; i < initStrategyWeights_.size(); i++)
                         {
-                            const auto w = initStrategyWeights_[i];
+                            const auto w = ctx.strategyWeights[i];
                             if (i <= (int)(MMLTInvmap_Strategy::Identity))
                             {
                                 // Path space mutations
@@ -463,7 +472,7 @@ public:
                             const auto  propP = MultiplexedDensity::InvCDF(prop, scene);
                             if (!propP)
                             {
-                                return{ false, strategy };
+                                return{ false, strategy, 0_f };
                             }
 
                             // Scalar contributions
@@ -476,10 +485,10 @@ public:
                             {
                                 ctx.curr[k].state = prop;
                                 ctx.curr[k].path = *propP;
-                                return{ true, strategy };
+                                return{ true, strategy, A };
                             }
 
-                            return{ false, strategy };
+                            return{ false, strategy, A };
                         }
                         #pragma endregion
                     }
@@ -497,7 +506,7 @@ public:
                             const auto propP = MLTMutationStrategy::Mutate((MLTStrategy)(strategy), scene, ctx.rng, currP.path, maxNumVertices_, 1_f / invS1_[(int)strategy], 1_f / invS2_[(int)strategy]);
                             if (!propP)
                             {
-                                return { false, strategy };
+                                return { false, strategy, 0_f };
                             }
                             #pragma endregion
 
@@ -519,7 +528,7 @@ public:
                                     // Reject if proposed path is not samplable by current technique
                                     if (propP->p.EvaluatePathPDF(scene, currP.s).v == 0_f)
                                     {
-                                        return { false, strategy };
+                                        return { false, strategy, 0_f };
                                     }
 
                                     const auto wx = currP.w;
@@ -548,7 +557,7 @@ public:
                                     #endif
                                     if (!propInvS)
                                     {
-                                        return{ false, strategy };
+                                        return{ false, strategy, A };
                                     }
 
                                     // Sanity check
@@ -597,7 +606,7 @@ public:
                                         ctx.sanitycheckFailureCount++;
                                         ctx.sanitycheckFailureCount1++;
                                         #endif
-                                        return { false, strategy };
+                                        return { false, strategy, A };
                                     }
                                     const auto C2 = (path_propInvS->Cstar * path_propInvS->w).Luminance();
                                     if (currP.s != path_propInvS->s || currP.t != path_propInvS->t || C2 == 0)
@@ -606,16 +615,16 @@ public:
                                         ctx.sanitycheckFailureCount++;
                                         ctx.sanitycheckFailureCount2++;
                                         #endif
-                                        return { false, strategy };
+                                        return { false, strategy, A };
                                     }
 
                                     // Update state
                                     ctx.curr[k].state = *propInvS;
                                     ctx.curr[k].path  = *path_propInvS;
-                                    return{ true, strategy };
+                                    return{ true, strategy, A };
                                 }
 
-                                return{ false, strategy };
+                                return{ false, strategy, A };
                             }
                             #pragma endregion
                         }
@@ -624,23 +633,19 @@ public:
 
                     // --------------------------------------------------------------------------------
                     LM_UNREACHABLE();
-                    return { false, strategy };
+                    return { false, strategy, 0_f };
                 }();
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #if INVERSEMAP_MMLTINVMAP_DEBUG_OUTPUT_AVE_ACC
-                if (mutationResult.accept) { ctx.acceptCount++; }
-                ctx.sampleCountPerTech[(int)(mutationResult.strategy)]++;
-                if (mutationResult.accept) { ctx.acceptCountPerTech[(int)(mutationResult.strategy)]++; }
-                #else
-                LM_UNUSED(mutationResult);
-                #endif
+                ctx.mutationStats.End(scene, (int)(mutationResult.strategy), mutationResult.A, mutationResult.accept);
+                adaptiveSelection_.Update(step, initStrategyWeights_, ctx.mutationStats, ctx.strategyWeights);
 
                 // --------------------------------------------------------------------------------
 
                 #pragma region Accumulate contribution
+                if (!burnin)
                 {
                     const auto& p = ctx.curr[k].path;
                     const auto  C = p.Cstar * p.w;
@@ -652,37 +657,18 @@ public:
 
             // --------------------------------------------------------------------------------
 
-            #if INVERSEMAP_MMLTINVMAP_DEBUG_OUTPUT_AVE_ACC
             {
-                long long sum = 0;
-                for (auto& ctx : contexts) { sum += ctx.acceptCount; }
-                const double ave = (double)sum / processed;
-                LM_LOG_INFO(boost::str(boost::format("Ave. acceptance ratio: %.5f (%d / %d)") % ave % sum % processed));
+                MLTMutationStats mutationStats;
+                mutationStats.Init(mutationStrategyNames);
+                for (const auto& ctx : contexts) { mutationStats.Merge(ctx.mutationStats); }
+                mutationStats.Print();
+                if (!mutationStatsPath_.empty()) { mutationStats.Save(mutationStatsPath_); }
             }
             {
-                LM_LOG_INFO("Ave. acceptance ratio per strategy");
-                LM_LOG_INDENTER();
-                for (size_t i = 0; i < initStrategyWeights_.size(); i++)
-                {
-                    long long acceptCount = 0;
-                    long long sampleCount = 0;
-                    for (const auto& ctx : contexts)
-                    {
-                        acceptCount += ctx.acceptCountPerTech[i];
-                        sampleCount += ctx.sampleCountPerTech[i];
-                    }
-                    if (sampleCount > 0)
-                    {
-                        const double ave = (double)acceptCount / sampleCount;
-                        LM_LOG_INFO(boost::str(boost::format("%02d: %.5f (%d / %d)") % i % ave % acceptCount % sampleCount));
-                    }
-                    else
-                    {
-                        LM_LOG_INFO(boost::str(boost::format("%02d: N/A") % i));
-                    }
-                }
+                std::vector<std::vector<Float>> strategyWeights;
+                for (const auto& ctx : contexts) { strategyWeights.push_back(ctx.strategyWeights); }
+                adaptiveSelection_.Print(mutationStrategyNames, strategyWeights);
             }
-            #endif
 
             // --------------------------------------------------------------------------------
 
@@ -741,7 +727,13 @@ public:
             {
                 film->Accumulate(ctx.film.get());
             }
-            film->Rescale((Float)(film->Width() * film->Height()) / processed);
+            long long numBurnin = 0;
+            for (const auto& ctx : contexts) { numBurnin += ctx.numBurnin; }
+            if (processed <= numBurnin)
+            {
+                LM_LOG_WARN("All mutations are in the burn-in of the adaptive mutation selection. Decrease 'adaptive_mutation_burnin'");
+            }
+            film->Rescale((Float)(film->Width() * film->Height()) / Math::Max(1ll, processed - numBurnin));
         }
         #pragma endregion
 
@@ -23,6 +23,7 @@
 */
 
 #include "inversemaputils.h"
+#include "mltutils.h"
 
 #define INVERSEMAP_PSSMLT_DEBUG_SIMPLIFY_BDPT 0
 
@@ -32,30 +33,39 @@ class PSSMLTState
 {
 private:
 
+    // Primary sample with the time stamp of the last modification.
+    // The mutations are applied lazily when the coordinate is requested [Kelemen et al. 2002].
+    struct PrimarySample
+    {
+        Float value = 0_f;
+        long long modify = -1;
+        Float valueBackup = 0_f;
+        long long modifyBackup = -1;
+    };
+
     int maxNumVertices_;
-    std::vector<Float> usL_;     // For light subpath
-    std::vector<Float> usE_;     // For eye subpath
+    std::vector<PrimarySample> usL_;        // For light subpath
+    std::vector<PrimarySample> usE_;        // For eye subpath
+    std::vector<std::pair<bool, int>> modified_;    // Coordinates modified in the current proposal (light subpath or not, index)
+
+    long long time_ = 0;                    // Number of accepted mutations including the current proposal
+    long long largeStepTime_ = 0;           // Time of the last accepted large step
+    bool largeStep_ = false;                // True if the current proposal is a large step
+    Random* rng_ = nullptr;                 // Random number generator used in the current proposal
 
 public:
 
     PSSMLTState() {}
 
-    PSSMLTState(Random* rng, int maxNumVertices)
+    PSSMLTState(int maxNumVertices)
         : maxNumVertices_(maxNumVertices)
     {
         const auto numStates = maxNumVertices * 3;
-        usL_.assign(numStates, 0_f);
-        usE_.assign(numStates, 0_f);
-        for (auto& u : usE_) u = rng->Next();
-        for (auto& u : usL_) u = rng->Next();
+        usL_.resize(numStates);
+        usE_.resize(numStates);
+        modified_.reserve(numStates * 2);
     }
 
-    PSSMLTState(const PSSMLTState& o)
-        : maxNumVertices_(o.maxNumVertices_)
-        , usL_(o.usL_)
-        , usE_(o.usE_)
-    {}
-
 public:
 
     auto Swap(PSSMLTState& o) -> void
@@ -63,52 +73,117 @@ public:
         assert(maxNumVertices_ == o.maxNumVertices_);
         usL_.swap(o.usL_);
         usE_.swap(o.usE_);
+        modified_.swap(o.modified_);
+        std::swap(time_, o.time_);
+        std::swap(largeStepTime_, o.largeStepTime_);
+        std::swap(largeStep_, o.largeStep_);
+        std::swap(rng_, o.rng_);
     }
 
 public:
 
-    // Large step mutation
-    auto LargeStep(Random* rng) const -> PSSMLTState
+    // Starts a new proposal. The coordinates are mutated when they are requested in InvCDF.
+    auto Propose(Random* rng, bool largeStep) -> void
     {
-        PSSMLTState next(*this);
-        for (auto& u : next.usE_) u = rng->Next();
-        for (auto& u : next.usL_) u = rng->Next();
-        return next;
+        time_++;
+        largeStep_ = largeStep;
+        rng_ = rng;
+        modified_.clear();
     }
 
-    // Small step mutation
-    auto SmallStep(Random* rng) const -> PSSMLTState
+    // Accepts the current proposal
+    auto Accept() -> void
     {
-        const auto Perturb = [](Random& rng, const Float u, const Float s1, const Float s2)
+        if (largeStep_)
         {
-            Float result;
-            Float r = rng.Next();
-            if (r < 0.5_f)
-            {
-                r = r * 2_f;
-                result = u + s2 * std::exp(-std::log(s2 / s1) * r);
-                if (result > 1_f) result -= 1_f;
-            }
-            else
+            largeStepTime_ = time_;
+        }
+        modified_.clear();
+    }
+
+    // Rejects the current proposal and restores the coordinates modified by the proposal
+    auto Reject() -> void
+    {
+        for (const auto& m : modified_)
+        {
+            auto& x = m.first ? usL_[m.second] : usE_[m.second];
+            x.value = x.valueBackup;
+            x.modify = x.modifyBackup;
+        }
+        modified_.clear();
+        time_--;
+    }
+
+private:
+
+    auto Get(std::vector<PrimarySample>& us, bool light, int i) -> Float
+    {
+        if (i >= (int)(us.size()))
+        {
+            us.resize(i + 1);
+        }
+
+        auto& x = us[i];
+        if (x.modify == time_)
+        {
+            return x.value;
+        }
+
+        // Backup
+        x.valueBackup = x.value;
+        x.modifyBackup = x.modify;
+        modified_.emplace_back(light, i);
+
+        // The coordinate has not been requested since the last accepted large step
+        if (x.modify < largeStepTime_)
+        {
+            x.value = rng_->Next();
+            x.modify = largeStepTime_;
+        }
+
+        if (largeStep_)
+        {
+            x.value = rng_->Next();
+        }
+        else
+        {
+            // Apply the small steps accepted since the last modification and the current one
+            for (auto t = x.modify; t < time_; t++)
             {
-                r = (r - 0.5_f) * 2_f;
-                result = u - s2 * std::exp(-std::log(s2 / s1) * r);
-                if (result < 0_f) result += 1_f;
+                x.value = SmallStep(*rng_, x.value);
             }
-            return result;
-        };
+        }
+
+        x.modify = time_;
+        return x.value;
+    }
 
+    static auto SmallStep(Random& rng, const Float u) -> Float
+    {
         const auto s1 = 1_f / 256_f;
         const auto s2 = 1_f / 16_f;
 
-        PSSMLTState next(*this);
-        for (size_t i = 0; i < usE_.size(); i++) next.usE_[i] = Perturb(*rng, usE_[i], s1, s2);
-        for (size_t i = 0; i < usL_.size(); i++) next.usL_[i] = Perturb(*rng, usL_[i], s1, s2);
-
-        return next;
+        Float result;
+        Float r = rng.Next();
+        if (r < 0.5_f)
+        {
+            r = r * 2_f;
+            result = u + s2 * std::exp(-std::log(s2 / s1) * r);
+            if (result > 1_f) result -= 1_f;
+        }
+        else
+        {
+            r = (r - 0.5_f) * 2_f;
+            result = u - s2 * std::exp(-std::log(s2 / s1) * r);
+            if (result < 0_f) result += 1_f;
+        }
+        return result;
     }
 
-    // Map a primary sample to a set of paths. Returns empty vector if failed.
+public:
+
+    // Set of paths mapped from a primary sample.
+    // The first `size` entries are valid; the rest are kept to reuse the storage of the paths.
     struct CachedPaths
     {
         struct CachedPath
@@ -119,21 +194,24 @@ public:
             Float w;        // Caches MIS weight
         };
         std::vector<CachedPath> ps;
+        int size = 0;
+        auto Empty() const -> bool { return size == 0; }
         auto ScalarContrb() const -> Float
         {
             SPD C;
-            for (const auto& p : ps) C += p.Cstar * p.w;
+            for (int i = 0; i < size; i++) C += ps[i].Cstar * ps[i].w;
             return InversemapUtils::ScalarContrb(C);
         }
     };
-    auto InvCDF(const Scene3* scene) const -> CachedPaths
+
+    // Map the primary sample to a set of paths. `paths` is empty if failed.
+    // The subpaths and the paths are written to the given buffers so that the proposals do not allocate once warmed up.
+    auto InvCDF(const Scene3* scene, Subpath& subpathE, Subpath& subpathL, CachedPaths& paths) -> void
     {
-        Subpath subpathE;
-        Subpath subpathL;
-        subpathE.SampleSubpathWithPrimarySamples(scene, usE_, TransportDirection::EL, maxNumVertices_);
-        subpathL.SampleSubpathWithPrimarySamples(scene, usL_, TransportDirection::LE, maxNumVertices_);
+        subpathE.SampleSubpathWithPrimarySampleFunc(scene, [&](int i) -> Float { return Get(usE_, false, i); }, TransportDirection::EL, maxNumVertices_);
+        subpathL.SampleSubpathWithPrimarySampleFunc(scene, [&](int i) -> Float { return Get(usL_, true, i); }, TransportDirection::LE, maxNumVertices_);
 
-        CachedPaths paths;
+        paths.size = 0;
         const int nL = (int)(subpathL.vertices.size());
         const int nE = (int)(subpathE.vertices.size());
         for (int n = 2; n <= nE + nL; n++)
@@ -145,7 +223,11 @@ public:
             {
                 const int t = n - s;
 
-                CachedPaths::CachedPath p;
+                if (paths.size == (int)(paths.ps.size()))
+                {
+                    paths.ps.emplace_back();
+                }
+                auto& p = paths.ps[paths.size];
                 p.s = s;
                 p.t = t;
                 if (!p.path.ConnectSubpaths(scene, subpathL, subpathE, s, t)) { continue; }
@@ -157,11 +239,9 @@ public:
                 }
 
                 p.w = p.path.EvaluateMISWeight(scene, s);
-                paths.ps.push_back(std::move(p));
+                paths.size++;
             }
         }
-
-        return paths;
     }
 
 };
@@ -187,6 +267,7 @@ public:
     
     Float s1_;
     Float s2_;
+    MLTReplicaExchange replicaExchange_;
     
 public:
 
@@ -198,6 +279,7 @@ public:
         numSeedSamples_ = prop->ChildAs<long long>("num_seed_samples", 0);
         seedRenderTime_ = prop->ChildAs<double>("seed_render_time", -1);
         largeStepProb_ = prop->ChildAs<Float>("large_step_prob", 0.5_f);
+        replicaExchange_.Load(prop);
         #if INVERSEMAP_OMIT_NORMALIZATION
         normalization_ = prop->ChildAs<Float>("normalization", 1_f);
         #endif
@@ -232,27 +314,39 @@ public:
             {
                 Random rng;
                 Film::UniquePtr film{ nullptr, nullptr };
-                PSSMLTState currState;
+                std::vector<PSSMLTState> states;        // States of the replicas, states[0] is the chain with beta = 1
+                std::vector<PSSMLTState::CachedPaths> paths;    // Paths mapped from the states
+                PSSMLTState::CachedPaths propPaths;     // Paths mapped from the proposed state, swapped with paths[r] on acceptance
+                Subpath subpathE;                       // Buffers for the subpaths
+                Subpath subpathL;
+                std::vector<Float> contrbs;             // Scalar contributions of the states
+                long long step = 0;
+                MLTReplicaExchange::Stats replicaStats;
             };
             std::vector<Context> contexts(Parallel::GetNumThreads());
             for (auto& ctx : contexts)
             {
                 ctx.rng.SetSeed(initRng->NextUInt());
                 ctx.film = ComponentFactory::Clone<Film>(film);
+                replicaExchange_.InitStats(ctx.replicaStats);
 
                 // Initial state
-                while (true)
+                while ((int)(ctx.states.size()) < replicaExchange_.NumReplicas())
                 {
                     // Generate initial path with bidirectional path tracing
-                    PSSMLTState state(initRng, maxNumVertices_);
-                    const auto paths = state.InvCDF(scene);
-                    if (paths.ps.empty())
+                    PSSMLTState state(maxNumVertices_);
+                    state.Propose(initRng, true);
+                    PSSMLTState::CachedPaths paths;
+                    state.InvCDF(scene, ctx.subpathE, ctx.subpathL, paths);
+                    if (paths.Empty())
                     {
                         continue;
                     }
 
-                    ctx.currState = std::move(state);
-                    break;
+                    state.Accept();
+                    ctx.states.push_back(std::move(state));
+                    ctx.contrbs.push_back(paths.ScalarContrb());
+                    ctx.paths.push_back(std::move(paths));
                 }
             }
 
@@ -265,42 +359,60 @@ public:
                 // --------------------------------------------------------------------------------
 
                 #pragma region Mutation in primary sample space
+                for (int r = 0; r < replicaExchange_.NumReplicas(); r++)
                 {
-                    // Mutate
-                    auto propState = ctx.rng.Next() < largeStepProb_
-                        ? ctx.currState.LargeStep(&ctx.rng)
-                        : ctx.currState.SmallStep(&ctx.rng);
+                    auto& state = ctx.states[r];
+
+                    // Mutate. Only the coordinates used by the proposed paths are perturbed.
+                    state.Propose(&ctx.rng, ctx.rng.Next() < largeStepProb_);
 
                     // Paths
-                    const auto currPs = ctx.currState.InvCDF(scene);
-                    const auto propPs = propState.InvCDF(scene);
+                    state.InvCDF(scene, ctx.subpathE, ctx.subpathL, ctx.propPaths);
+                    const auto propC = ctx.propPaths.ScalarContrb();
                         
                     #if INVERSEMAP_PSSMLT_DEBUG_SIMPLIFY_BDPT
                     // Always accept
-                    ctx.currState.Swap(propState);
+                    const auto A = 1_f;
                     #else
-                    // Scalar contributions
-                    const auto currC = currPs.ScalarContrb();
-                    const auto propC = propPs.ScalarContrb();
-
-                    // MH update
-                    const auto A = currC == 0_f ? 1_f : Math::Min(1_f, propC / currC);
+                    // MH update targeting the tempered distribution
+                    const auto currC = ctx.contrbs[r];
+                    const auto A = currC == 0_f ? 1_f : Math::Min(1_f, MLTReplicaExchange::TemperedRatio(propC / currC, currC, propC, replicaExchange_.Beta(r)));
+                    #endif
                     if (ctx.rng.Next() < A)
                     {
-                        ctx.currState.Swap(propState);
+                        state.Accept();
+                        std::swap(ctx.paths[r], ctx.propPaths);
+                        ctx.contrbs[r] = propC;
+                    }
+                    else
+                    {
+                        state.Reject();
                     }
-                    #endif
                 }
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
+                #pragma region Replica exchange
+                replicaExchange_.Exchange(ctx.step++, ctx.rng, ctx.replicaStats,
+                    [&](int r) -> Float { return ctx.contrbs[r]; },
+                    [&](int r1, int r2) -> void
+                    {
+                        ctx.states[r1].Swap(ctx.states[r2]);
+                        std::swap(ctx.paths[r1], ctx.paths[r2]);
+                        std::swap(ctx.contrbs[r1], ctx.contrbs[r2]);
+                    });
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
                 #pragma region Accumulate contribution
                 {
-                    const auto ps = ctx.currState.InvCDF(scene);
-                    const auto I  = ps.ScalarContrb();
-                    for (const auto& p : ps.ps)
+                    const auto& ps = ctx.paths[0];
+                    const auto I  = ctx.contrbs[0];
+                    for (int i = 0; i < ps.size; i++)
                     {
+                        const auto& p = ps.ps[i];
                         const auto C = p.Cstar * p.w;
                         #if INVERSEMAP_PSSMLT_DEBUG_SIMPLIFY_BDPT
                         ctx.film->Splat(p.path.RasterPosition(), C);
@@ -314,6 +426,14 @@ public:
 
             // --------------------------------------------------------------------------------
 
+            {
+                std::vector<MLTReplicaExchange::Stats> replicaStats;
+                for (const auto& ctx : contexts) { replicaStats.push_back(ctx.replicaStats); }
+                replicaExchange_.PrintStats(replicaStats);
+            }
+
+            // --------------------------------------------------------------------------------
+
             // Gather & Rescale
             film->Clear();
             for (auto& ctx : contexts)
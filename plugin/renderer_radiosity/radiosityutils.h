@@ -31,9 +31,12 @@
 #include <lightmetrica/light.h>
 #include <lightmetrica/bsdf.h>
 #include <lightmetrica/intersection.h>
+#include <lightmetrica/bound.h>
 #include <vector>
+#include <algorithm>
 #include <stack>
 #include <unordered_map>
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -79,6 +82,28 @@ public:
     ///! Get the size of the patches
     auto Size() const -> int { return (int)(patches_.size()); }
 
+    ///! Check if the primitive is supported by the radiosity renderers
+    static auto Supported(const Primitive* primitive) -> bool
+    {
+        if (primitive->light)
+        {
+            if (std::strcmp(primitive->light->implName, "Light_Area") != 0)
+            {
+                LM_LOG_WARN("Non area light is found; skipping.");
+                return false;
+            }
+        }
+        if (primitive->bsdf)
+        {
+            if (std::strcmp(primitive->bsdf->implName, "BSDF_Diffuse") != 0)
+            {
+                LM_LOG_WARN("Non diffuse BSDF is found; skipping.");
+                return false;
+            }
+        }
+        return true;
+    }
+
     ///! Create patches structure by subdividing the triangles meshes
     auto Create(const Scene3* scene, Float subdivLimitArea) -> void
     {
@@ -111,21 +136,9 @@ public:
 
             #pragma region Check validity of the primitive
 
-            if (primitive->light)
+            if (!Supported(primitive))
             {
-                if (std::strcmp(primitive->light->implName, "Light_Area") != 0)
-                {
-                    LM_LOG_WARN("Non area light is found; skipping.");
-                    continue;
-                }
-            }
-            if (primitive->bsdf)
-            {
-                if (std::strcmp(primitive->bsdf->implName, "BSDF_Diffuse") != 0)
-                {
-                    LM_LOG_WARN("Non diffuse BSDF is found; skipping.");
-                    continue;
-                }
+                continue;
             }
 
             #pragma endregion
@@ -188,7 +201,7 @@ public:
     }
 
     ///! Iterate patch structure
-    auto IteratePatches(const Intersection& isect, Float subdivLimitArea, const std::function<void(size_t patchindex, const Vec2& uv)>& iterateFunc) -> void
+    auto IteratePatches(const Intersection& isect, Float subdivLimitArea, const std::function<void(size_t patchindex, const Vec2& uv)>& iterateFunc) const -> void
     {
         // For this requirement, what we want to do here is to subdivide and
         // check if the query point is in the triangle.This actually increase the complexity
@@ -215,7 +228,7 @@ public:
             auto Area() const -> Float { return Math::Length(Math::Cross(p2 - p1, p3 - p1)) * 0.5_f; }
         };
 
-        size_t patchindex = patchIndexMap_[{ (int)(isect.primitive->index), isect.geom.faceindex }];
+        size_t patchindex = patchIndexMap_.at({ (int)(isect.primitive->index), isect.geom.faceindex });
         std::stack<Tri> stack;
         stack.push({ p1, p2, p3 });
         while (!stack.empty())
@@ -314,4 +327,470 @@ public:
     
 };
 
+/*!
+    \brief Hierarchical radiosity with clustering.
+
+    The input triangles are the roots of the adaptive quadtrees of elements,
+    each of which is subdivided into four children at the edge midpoints on demand, down to `minArea`.
+    The roots are grouped by a binary hierarchy of clusters built with the median split of the centroids.
+    The links between the nodes are created by recursively refining the self-link of the root cluster
+    with the oracle B_q max(F_pq, F_qp) > `epsBF`, subdividing the larger node [Hanrahan et al. 1991].
+    The clusters are treated as isotropic with the average cosine factor of 1/4 [Sillion 1994, Smits et al. 1994].
+    The visibility between elements is tested with the ray between the centroids,
+    and the visibility between the nodes involving a cluster is estimated as the fraction of
+    unoccluded rays between `numVisibilitySamples` pairs of the centroids of the descendant elements.
+    The system is solved by the Jacobi iteration with gathering over the links followed by push-pull.
+
+    References:
+      - [Hanrahan et al. 1991] A rapid hierarchical radiosity algorithm
+      - [Smits et al. 1994] A clustering algorithm for radiosity in complex environments
+      - [Sillion 1994] Clustering and volume scattering for hierarchical radiosity calculations
+*/
+class RadiosityHierarchy
+{
+public:
+
+    struct Link
+    {
+        int q;      // Source node
+        Float F;    // Form factor from the receiver to the source
+    };
+
+    struct Node
+    {
+        bool cluster;
+        Vec3 p1, p2, p3;                // Triangle (only for elements)
+        Vec3 gn;                        // Geometric normal (only for elements)
+        Vec3 c;                         // Centroid
+        Float radius;                   // Radius of the bounding sphere of the cluster (zero for elements)
+        Float area;                     // Total area of the surfaces
+        Vec3 R;                         // Reflectance (only for elements)
+        Vec3 E;                         // Emission (only for elements)
+        Vec3 B;                         // Radiosity
+        Vec3 H;                         // Irradiance gathered through the links
+        std::vector<int> children;
+        std::vector<Link> links;        // Links to the sources gathered by this node
+    };
+
+public:
+
+    auto Create(const Scene3* scene, Float minArea, Float epsBF, int clusterLeafSize, int numVisibilitySamples) -> void
+    {
+        LM_LOG_INFO("Creating hierarchy");
+
+        minArea_ = minArea;
+        epsBF_ = epsBF;
+        numVisibilitySamples_ = Math::Max(1, numVisibilitySamples);
+        nodes_.clear();
+
+        // Root elements
+        psum_.assign(scene->NumPrimitives() + 1, 0);
+        for (int i = 0; i < scene->NumPrimitives(); i++)
+        {
+            const auto* primitive = scene->PrimitiveAt(i);
+            psum_[i + 1] = psum_[i] + (primitive->mesh ? primitive->mesh->NumFaces() : 0);
+        }
+        rootElements_.assign(psum_.back(), -1);
+        std::vector<int> roots;
+        for (int i = 0; i < scene->NumPrimitives(); i++)
+        {
+            const auto* primitive = scene->PrimitiveAt(i);
+            const auto* mesh = primitive->mesh;
+            if (!mesh || !Patches::Supported(primitive))
+            {
+                continue;
+            }
+
+            const auto R = primitive->bsdf ? primitive->bsdf->Reflectance().ToRGB() : Vec3();
+            const auto E = primitive->light ? primitive->light->Emittance().ToRGB() : Vec3();
+            const auto* ps = mesh->Positions();
+            const auto* faces = mesh->Faces();
+            for (int fi = 0; fi < mesh->NumFaces(); fi++)
+            {
+                unsigned int vi1 = faces[3 * fi];
+                unsigned int vi2 = faces[3 * fi + 1];
+                unsigned int vi3 = faces[3 * fi + 2];
+                Vec3 p1(primitive->transform * Vec4(ps[3 * vi1], ps[3 * vi1 + 1], ps[3 * vi1 + 2], 1_f));
+                Vec3 p2(primitive->transform * Vec4(ps[3 * vi2], ps[3 * vi2 + 1], ps[3 * vi2 + 2], 1_f));
+                Vec3 p3(primitive->transform * Vec4(ps[3 * vi3], ps[3 * vi3 + 1], ps[3 * vi3 + 2], 1_f));
+                if (Math::Length(Math::Cross(p2 - p1, p3 - p1)) == 0_f)
+                {
+                    continue;
+                }
+                rootElements_[psum_[i] + fi] = (int)(nodes_.size());
+                roots.push_back((int)(nodes_.size()));
+                nodes_.push_back(CreateElement(p1, p2, p3, R, E));
+            }
+        }
+
+        // Clusters
+        root_ = roots.empty() ? -1 : BuildCluster(roots, 0, (int)(roots.size()), Math::Max(1, clusterLeafSize));
+
+        // Initial radiosity
+        if (root_ >= 0)
+        {
+            Float diff, norm;
+            PushPull(root_, Vec3(), diff, norm);
+        }
+    }
+
+    ///! Recreate the links with the oracle evaluated with the current radiosity
+    auto Refine(const Scene3* scene) -> void
+    {
+        for (auto& node : nodes_) { node.links.clear(); }
+        if (root_ >= 0)
+        {
+            Refine(scene, root_, root_);
+        }
+    }
+
+    ///! Solve the system with the current links. Returns the number of iterations.
+    auto Solve(int maxIterations, Float tolerance) -> int
+    {
+        if (root_ < 0)
+        {
+            return 0;
+        }
+
+        for (int iteration = 0; iteration < maxIterations; iteration++)
+        {
+            // Gather
+            tbb::parallel_for(tbb::blocked_range<int>(0, (int)(nodes_.size())), [&](const tbb::blocked_range<int>& range) -> void
+            {
+                for (int i = range.begin(); i != range.end(); i++)
+                {
+                    auto& node = nodes_[i];
+                    node.H = Vec3();
+                    for (const auto& link : node.links)
+                    {
+                        node.H += nodes_[link.q].B * link.F;
+                    }
+                }
+            });
+
+            // Push-pull
+            Float diff = 0_f;
+            Float norm = 0_f;
+            PushPull(root_, Vec3(), diff, norm);
+            if (diff <= tolerance * norm)
+            {
+                return iteration + 1;
+            }
+        }
+
+        return maxIterations;
+    }
+
+public:
+
+    auto NumNodes() const -> int { return (int)(nodes_.size()); }
+    auto NumLinks() const -> long long
+    {
+        long long n = 0;
+        for (const auto& node : nodes_) { n += (long long)(node.links.size()); }
+        return n;
+    }
+    auto At(int i) const -> const Node& { return nodes_[i]; }
+
+    ///! Find the leaf element containing the intersected point. Returns -1 if not found.
+    auto Lookup(const Intersection& isect, Vec2& uv) const -> int
+    {
+        if (!isect.primitive->mesh)
+        {
+            return -1;
+        }
+        int i = rootElements_[psum_[isect.primitive->index] + isect.geom.faceindex];
+        if (i < 0)
+        {
+            return -1;
+        }
+
+        while (true)
+        {
+            const auto& node = nodes_[i];
+            uv = Barycentric(node, isect.geom.p);
+            if (node.children.empty())
+            {
+                return i;
+            }
+
+            // Child containing the point, or the closest one for the points on the edges
+            int next = node.children[0];
+            Float minDist = Math::Inf();
+            for (const int child : node.children)
+            {
+                const auto uvc = Barycentric(nodes_[child], isect.geom.p);
+                const auto d = -Math::Min(uvc.x, Math::Min(uvc.y, 1_f - uvc.x - uvc.y));
+                if (d < minDist)
+                {
+                    minDist = d;
+                    next = child;
+                }
+            }
+            i = next;
+        }
+    }
+
+private:
+
+    auto CreateElement(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& R, const Vec3& E) const -> Node
+    {
+        Node node;
+        node.cluster = false;
+        node.p1 = p1;
+        node.p2 = p2;
+        node.p3 = p3;
+        node.gn = Math::Normalize(Math::Cross(p2 - p1, p3 - p1));
+        node.c = (p1 + p2 + p3) / 3_f;
+        node.radius = 0_f;
+        node.area = Math::Length(Math::Cross(p2 - p1, p3 - p1)) * 0.5_f;
+        node.R = R;
+        node.E = E;
+        node.B = E;
+        return node;
+    }
+
+    auto BuildCluster(std::vector<int>& elements, int begin, int end, int leafSize) -> int
+    {
+        if (end - begin == 1)
+        {
+            return elements[begin];
+        }
+
+        Bound bound;
+        Bound centroidBound;
+        for (int i = begin; i < end; i++)
+        {
+            const auto& e = nodes_[elements[i]];
+            bound = Math::Union(Math::Union(Math::Union(bound, e.p1), e.p2), e.p3);
+            centroidBound = Math::Union(centroidBound, e.c);
+        }
+
+        std::vector<int> children;
+        if (end - begin <= leafSize)
+        {
+            children.assign(elements.begin() + begin, elements.begin() + end);
+        }
+        else
+        {
+            const int axis = centroidBound.LongestAxis();
+            const int mid = (begin + end) / 2;
+            std::nth_element(elements.begin() + begin, elements.begin() + mid, elements.begin() + end, [&](int i1, int i2) -> bool
+            {
+                return nodes_[i1].c[axis] < nodes_[i2].c[axis];
+            });
+            children.push_back(BuildCluster(elements, begin, mid, leafSize));
+            children.push_back(BuildCluster(elements, mid, end, leafSize));
+        }
+
+        Node node;
+        node.cluster = true;
+        node.radius = Math::Length(bound.max - bound.min) * 0.5_f;
+        node.area = 0_f;
+        for (const int child : children)
+        {
+            node.area += nodes_[child].area;
+            node.c += nodes_[child].c * nodes_[child].area;
+        }
+        node.c = node.c / node.area;
+        node.children = std::move(children);
+        nodes_.push_back(std::move(node));
+        return (int)(nodes_.size()) - 1;
+    }
+
+    auto CanSubdivide(int i) const -> bool
+    {
+        const auto& node = nodes_[i];
+        return node.cluster || !node.children.empty() || node.area * 0.25_f >= minArea_;
+    }
+
+    auto Subdivide(int i) -> void
+    {
+        if (!nodes_[i].children.empty())
+        {
+            return;
+        }
+
+        const auto n = nodes_[i];
+        const auto c1 = (n.p1 + n.p2) * 0.5_f;
+        const auto c2 = (n.p2 + n.p3) * 0.5_f;
+        const auto c3 = (n.p3 + n.p1) * 0.5_f;
+        const Vec3 tris[4][3] = { { n.p1, c1, c3 }, { n.p2, c2, c1 }, { n.p3, c3, c2 }, { c1, c2, c3 } };
+        for (const auto& tri : tris)
+        {
+            nodes_[i].children.push_back((int)(nodes_.size()));
+            auto child = CreateElement(tri[0], tri[1], tri[2], n.R, n.E);
+            child.B = n.B;
+            nodes_.push_back(std::move(child));
+        }
+    }
+
+    // Form factor from the receiver p to the source q
+    auto FormFactor(const Scene3* scene, int p, int q) const -> Float
+    {
+        const auto& np = nodes_[p];
+        const auto& nq = nodes_[q];
+        const auto d = nq.c - np.c;
+        const auto r2 = Math::Length2(d);
+        if (r2 <= 0_f)
+        {
+            return 0_f;
+        }
+        const auto w = d / Math::Sqrt(r2);
+        const auto cp = np.cluster ? 0.25_f : Math::Dot(np.gn, w);
+        const auto cq = nq.cluster ? 0.25_f : Math::Dot(nq.gn, -w);
+        if (cp <= 0_f || cq <= 0_f)
+        {
+            return 0_f;
+        }
+        const auto V = Visibility(scene, p, q);
+        if (V <= 0_f)
+        {
+            return 0_f;
+        }
+        return V * nq.area * cp * cq / Math::Pi() / r2;
+    }
+
+    // Fraction of the unoccluded rays between the nodes
+    auto Visibility(const Scene3* scene, int p, int q) const -> Float
+    {
+        if (!nodes_[p].cluster && !nodes_[q].cluster)
+        {
+            return scene->Visible(nodes_[p].c, nodes_[q].c) ? 1_f : 0_f;
+        }
+
+        int visible = 0;
+        for (int k = 0; k < numVisibilitySamples_; k++)
+        {
+            if (scene->Visible(RepresentativePoint(p, 2 * k), RepresentativePoint(q, 2 * k + 1)))
+            {
+                visible++;
+            }
+        }
+        return (Float)(visible) / numVisibilitySamples_;
+    }
+
+    // Centroid of a descendant element chosen deterministically from the sample index
+    auto RepresentativePoint(int i, int k) const -> Vec3
+    {
+        unsigned int h = 2654435761u * (unsigned int)(k + 1);
+        while (nodes_[i].cluster)
+        {
+            const auto& children = nodes_[i].children;
+            h ^= h >> 15;
+            h *= 2246822519u;
+            h ^= h >> 13;
+            i = children[h % children.size()];
+        }
+        return nodes_[i].c;
+    }
+
+    auto Refine(const Scene3* scene, int p, int q) -> void
+    {
+        if (p == q)
+        {
+            // Planar elements have no interaction with themselves
+            if (!nodes_[p].cluster)
+            {
+                return;
+            }
+            const auto children = nodes_[p].children;
+            for (const int c1 : children)
+            {
+                for (const int c2 : children)
+                {
+                    Refine(scene, c1, c2);
+                }
+            }
+            return;
+        }
+
+        const auto F = FormFactor(scene, p, q);
+        if (F <= 0_f)
+        {
+            return;
+        }
+
+        // Oracle
+        const auto& np = nodes_[p];
+        const auto& nq = nodes_[q];
+        const auto Fqp = F * np.area / nq.area;
+        const bool near = Math::Length(np.c - nq.c) < np.radius + nq.radius;
+        const bool refine = near || Math::Max(F, Fqp) > 1_f || Math::Luminance(nq.B) * Math::Max(F, Fqp) > epsBF_;
+        if (refine)
+        {
+            const bool sp = CanSubdivide(p);
+            const bool sq = CanSubdivide(q);
+            if (sq && (!sp || nodes_[q].area >= nodes_[p].area))
+            {
+                Subdivide(q);
+                const auto children = nodes_[q].children;
+                for (const int child : children) { Refine(scene, p, child); }
+                return;
+            }
+            if (sp)
+            {
+                Subdivide(p);
+                const auto children = nodes_[p].children;
+                for (const int child : children) { Refine(scene, child, q); }
+                return;
+            }
+        }
+
+        nodes_[p].links.push_back({ q, Math::Min(F, 1_f) });
+    }
+
+    // Pushes the irradiance to the leaves and pulls the area-weighted radiosity up to the root
+    auto PushPull(int i, const Vec3& Hdown, Float& diff, Float& norm) -> Vec3
+    {
+        auto& node = nodes_[i];
+        const auto H = Hdown + node.H;
+        Vec3 B;
+        if (node.children.empty())
+        {
+            B = node.E + node.R * H;
+            const auto d = B - node.B;
+            diff = Math::Max(diff, Math::Max(Math::Abs(d.x), Math::Max(Math::Abs(d.y), Math::Abs(d.z))));
+            norm = Math::Max(norm, Math::Max(B.x, Math::Max(B.y, B.z)));
+        }
+        else
+        {
+            const auto children = node.children;
+            const auto area = node.area;
+            for (const int child : children)
+            {
+                B += PushPull(child, H, diff, norm) * nodes_[child].area;
+            }
+            B = B / area;
+        }
+        nodes_[i].B = B;
+        return B;
+    }
+
+    static auto Barycentric(const Node& node, const Vec3& p) -> Vec2
+    {
+        const auto e0 = node.p3 - node.p1;
+        const auto e1 = node.p2 - node.p1;
+        const auto e2 = p - node.p1;
+        const auto dot00 = Math::Dot(e0, e0);
+        const auto dot01 = Math::Dot(e0, e1);
+        const auto dot02 = Math::Dot(e0, e2);
+        const auto dot11 = Math::Dot(e1, e1);
+        const auto dot12 = Math::Dot(e1, e2);
+        const auto invDenom = 1_f / (dot00 * dot11 - dot01 * dot01);
+        return Vec2((dot11 * dot02 - dot01 * dot12) * invDenom, (dot00 * dot12 - dot01 * dot02) * invDenom);
+    }
+
+private:
+
+    Float minArea_;
+    Float epsBF_;
+    int numVisibilitySamples_;
+    std::vector<Node> nodes_;
+    std::vector<int> psum_;
+    std::vector<int> rootElements_;     // Root element for each face, -1 if not supported
+    int root_ = -1;
+
+};
+
 LM_NAMESPACE_END
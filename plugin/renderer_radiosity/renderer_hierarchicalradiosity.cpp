@@ -0,0 +1,185 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <lightmetrica/lightmetrica.h>
+#include "radiosityutils.h"
+#include <lightmetrica/detail/parallel.h>
+#include <boost/format.hpp>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Hierarchical radiosity renderer.
+
+    Implements hierarchical radiosity [Hanrahan et al. 1991] with clustering [Smits et al. 1994].
+    Unlike `renderer::radiosity` and `renderer::progressiveradiosity` working on the patches
+    uniformly subdivided down to `subdivlimitarea`, the triangles are adaptively subdivided
+    where the links between the nodes carry large energy, and the distant interactions are
+    represented by the links between the clusters of the triangles.
+    `subdivlimitarea` specifies the minimum area of the elements.
+    Similar to the other radiosity renderers, this implementation only supports
+    the diffues BSDF (`bsdf::diffuse`) and the area light (`light::area`).
+
+    References:
+      - [Hanrahan et al. 1991] A rapid hierarchical radiosity algorithm
+      - [Smits et al. 1994] A clustering algorithm for radiosity in complex environments
+*/
+class Renderer_HierarchicalRadiosity final : public Renderer
+{
+public:
+
+    LM_IMPL_CLASS(Renderer_HierarchicalRadiosity, Renderer);
+
+public:
+
+    LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
+    {
+        subdivLimitArea_ = prop->ChildAs<Float>("subdivlimitarea", 0.1_f);
+        wireframe_ = prop->ChildAs<int>("wireframe", 0);
+        epsBF_ = prop->ChildAs<Float>("bf_threshold", 0.01_f);
+        numRefinementPasses_ = Math::Max(1, prop->ChildAs<int>("num_refinement_passes", 2));
+        maxIterations_ = prop->ChildAs<int>("max_iterations", 100);
+        tolerance_ = prop->ChildAs<Float>("tolerance", 1e-4_f);
+        clusterLeafSize_ = prop->ChildAs<int>("cluster_leaf_size", 4);
+        numVisibilitySamples_ = prop->ChildAs<int>("num_visibility_samples", 4);
+        return true;
+    };
+
+    LM_IMPL_F(Render) = [this](const Scene* scene_, Random* initRng, const std::string& outputPath) -> void
+    {
+        const auto* scene = static_cast<const Scene3*>(scene_);
+        auto* film = static_cast<const Sensor*>(scene->GetSensor()->emitter)->GetFilm();
+
+        // --------------------------------------------------------------------------------
+
+        // Create hierarchy
+        RadiosityHierarchy hierarchy;
+        hierarchy.Create(scene, subdivLimitArea_, epsBF_, clusterLeafSize_, numVisibilitySamples_);
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Solve radiosity equation
+
+        LM_LOG_INFO("Solving radiosity equation");
+        {
+            LM_LOG_INDENTER();
+
+            // The links are refined with the oracle using the radiosity of the previous pass
+            for (int pass = 0; pass < numRefinementPasses_; pass++)
+            {
+                hierarchy.Refine(scene);
+                const int iterations = hierarchy.Solve(maxIterations_, tolerance_);
+                LM_LOG_INFO(boost::str(boost::format("Pass %d: %d nodes, %d links, %d iterations")
+                    % pass % hierarchy.NumNodes() % hierarchy.NumLinks() % iterations));
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Rendering (ray casting)
+
+        LM_LOG_INFO("Visualizing result");
+
+        const int width  = film->Width();
+        const int height = film->Height();
+        Parallel::For(width * height, [&](long long index, int threadid, bool init) -> void
+        {
+            const int x = (int)(index % width);
+            const int y = (int)(index / width);
+
+            // Raster position
+            Vec2 rasterPos((Float(x) + 0.5_f) / Float(width), (Float(y) + 0.5_f) / Float(height));
+
+            // Position and direction of a ray
+            SurfaceGeometry geomE;
+            Vec3 wo;
+            scene->GetSensor()->emitter->SamplePositionAndDirection(rasterPos, Vec2(), geomE, wo);
+
+            // Setup a ray
+            Ray ray = { geomE.p, wo };
+
+            // Intersection query
+            Intersection isect;
+            if (!scene->Intersect(ray, isect))
+            {
+                // No intersection -> black
+                film->SetPixel(x, y, SPD());
+                return;
+            }
+
+            // Find the leaf element & visualize the radiosity
+            Vec2 uv;
+            const int i = hierarchy.Lookup(isect, uv);
+            if (i < 0)
+            {
+                film->SetPixel(x, y, SPD());
+                return;
+            }
+            if (wireframe_)
+            {
+                // Visualize wire frame
+                // Compute minimum distance from each edges
+                const auto mind = Math::Min(uv.x, Math::Min(uv.y, 1_f - uv.x - uv.y));
+                if (mind < 0.05f)
+                {
+                    film->SetPixel(x, y, SPD(Math::Abs(Math::Dot(isect.geom.sn, -ray.d))));
+                }
+            }
+            else
+            {
+                film->SetPixel(x, y, SPD(hierarchy.At(i).B));
+            }
+        });
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save image
+        {
+            LM_LOG_INFO("Saving image");
+            LM_LOG_INDENTER();
+            film->Save(outputPath);
+        }
+        #pragma endregion
+    };
+
+private:
+
+    Float subdivLimitArea_;
+    int wireframe_;
+    Float epsBF_;
+    int numRefinementPasses_;
+    int maxIterations_;
+    Float tolerance_;
+    int clusterLeafSize_;
+    int numVisibilitySamples_;
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Renderer_HierarchicalRadiosity, "renderer::hierarchicalradiosity");
+
+LM_NAMESPACE_END
@@ -24,8 +24,11 @@
 
 #include <lightmetrica/lightmetrica.h>
 #include "radiosityutils.h"
+#include <lightmetrica/detail/parallel.h>
 #include <thread>
+#include <algorithm>
 #include <boost/format.hpp>
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -35,6 +38,8 @@ LM_NAMESPACE_BEGIN
     Implements progressive radiosity algorithm [Cohen et al. 1988].
     Similar to `renderer::radiosity`, this implementation only supports
     the diffues BSDF (`bsdf::diffuse`) and the area light (`light::area`).
+    Each iteration shoots the unshot radiosity of `num_shooters` patches with the largest power,
+    and the form factors from the shooters to the receivers are evaluated in parallel.
     
     References:
       - [Cohen et al. 1988] A progressive refinement approach to fast radiosity image generation
@@ -54,6 +59,7 @@ public:
         subdivLimitArea_ = prop->ChildAs<Float>("subdivlimitarea", 0.1_f);
         wireframe_ = prop->ChildAs<int>("wireframe", 0);
         numIterations_ = prop->ChildAs<long long>("num_iterations", 1000L);
+        numShooters_ = Math::Max(1, prop->ChildAs<int>("num_shooters", 1));
         return true;
     };
 
@@ -90,33 +96,48 @@ public:
             S[i] = B[i] = light->Emittance().ToRGB();
         }
 
+        const int numShooters = Math::Min(numShooters_, N);
+        std::vector<Float> power(N);
+        std::vector<int> shooters(N);
+        std::vector<Vec3> shotS(numShooters);
         for (long long iteration = 0; iteration < numIterations_; iteration++)
         {
-            // Pick the patch with maximum power
-            Float maxPower = 0;
-            int maxPowerIndex = 0;
-            for (int i = 0; i < N; i++)
+            // Pick the patches with maximum power
+            tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& range) -> void
             {
-                const auto& patch = patches.At(i);
-                const auto power = Math::Luminance(S[i]) * patch.Area();
-                if (power > maxPower)
+                for (int i = range.begin(); i != range.end(); i++)
                 {
-                    maxPower = power;
-                    maxPowerIndex = i;
+                    power[i] = Math::Luminance(S[i]) * patches.At(i).Area();
                 }
-            }
-            
-            // Shoot the radiosity from the patch
-            for (int i = 0; i < N; i++)
+            });
+            for (int i = 0; i < N; i++) { shooters[i] = i; }
+            std::nth_element(shooters.begin(), shooters.begin() + (numShooters - 1), shooters.end(), [&](int i1, int i2) -> bool
             {
-                if (i == maxPowerIndex) continue;
-                const auto ff = RadiosityUtils::EstimateFormFactor(scene, patches.At(i), patches.At(maxPowerIndex));
-                const auto R = patches.At(i).primitive->bsdf->Reflectance().ToRGB();
-                const auto deltaRad = S[maxPowerIndex] * ff * R;
-                B[i] += deltaRad;
-                S[i] += deltaRad;
-            }
-            S[maxPowerIndex] = Vec3();
+                return power[i1] > power[i2];
+            });
+            for (int j = 0; j < numShooters; j++) { shotS[j] = S[shooters[j]]; }
+
+            // Shoot the radiosity from the patches.
+            // The receivers are processed in parallel and the visibility from all shooters is evaluated in a batch,
+            // so that each receiver only updates its own radiosity.
+            tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& range) -> void
+            {
+                for (int i = range.begin(); i != range.end(); i++)
+                {
+                    Vec3 deltaRad;
+                    for (int j = 0; j < numShooters; j++)
+                    {
+                        const int shooter = shooters[j];
+                        if (i == shooter) continue;
+                        const auto ff = RadiosityUtils::EstimateFormFactor(scene, patches.At(i), patches.At(shooter));
+                        deltaRad += shotS[j] * ff;
+                    }
+                    deltaRad = deltaRad * patches.At(i).primitive->bsdf->Reflectance().ToRGB();
+                    B[i] += deltaRad;
+                    S[i] += deltaRad;
+                }
+            });
+            for (int j = 0; j < numShooters; j++) { S[shooters[j]] -= shotS[j]; }
 
             // Progress report
             if (iteration % 100 == 0)
@@ -138,58 +159,50 @@ public:
 
         const int width  = film->Width();
         const int height = film->Height();
-        for (int y = 0; y < height; y++)
+        Parallel::For(width * height, [&](long long index, int threadid, bool init) -> void
         {
-            for (int x = 0; x < width; x++)
-            {
-                // Raster position
-                Vec2 rasterPos((Float(x) + 0.5_f) / Float(width), (Float(y) + 0.5_f) / Float(height));
+            const int x = (int)(index % width);
+            const int y = (int)(index / width);
 
-                // Position and direction of a ray
-                SurfaceGeometry geomE;
-                Vec3 wo;
-                scene->GetSensor()->emitter->SamplePositionAndDirection(rasterPos, Vec2(), geomE, wo);
+            // Raster position
+            Vec2 rasterPos((Float(x) + 0.5_f) / Float(width), (Float(y) + 0.5_f) / Float(height));
 
-                // Setup a ray
-                Ray ray = { geomE.p, wo };
+            // Position and direction of a ray
+            SurfaceGeometry geomE;
+            Vec3 wo;
+            scene->GetSensor()->emitter->SamplePositionAndDirection(rasterPos, Vec2(), geomE, wo);
 
-                // Intersection query
-                Intersection isect;
-                if (!scene->Intersect(ray, isect))
-                {
-                    // No intersection -> black
-                    film->SetPixel(x, y, SPD());
-                    continue;
-                }
-                
-                // Compute patch index & visualize the radiosity
-                patches.IteratePatches(isect, subdivLimitArea_, [&](size_t patchindex, const Vec2& uv) -> void
-                {
-                    if (wireframe_)
-                    {
-                        // Visualize wire frame
-                        // Compute minimum distance from each edges
-                        const auto mind = Math::Min(uv.x, Math::Min(uv.y, 1_f - uv.x - uv.y));
-                        if (mind < 0.05f)
-                        {
-                            film->SetPixel(x, y, SPD(Math::Abs(Math::Dot(isect.geom.sn, -ray.d))));
-                        }
-                    }
-                    else
-                    {
-                        film->SetPixel(x, y, SPD(B[patchindex]));
-                    }
-                });
-            }
+            // Setup a ray
+            Ray ray = { geomE.p, wo };
 
-            if (y % 10 == 0)
+            // Intersection query
+            Intersection isect;
+            if (!scene->Intersect(ray, isect))
             {
-                const double progress = 100.0 * y / film->Height();
-                LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+                // No intersection -> black
+                film->SetPixel(x, y, SPD());
+                return;
             }
-        }
-
-        LM_LOG_INFO("Progress: 100.0%");
+            
+            // Compute patch index & visualize the radiosity
+            patches.IteratePatches(isect, subdivLimitArea_, [&](size_t patchindex, const Vec2& uv) -> void
+            {
+                if (wireframe_)
+                {
+                    // Visualize wire frame
+                    // Compute minimum distance from each edges
+                    const auto mind = Math::Min(uv.x, Math::Min(uv.y, 1_f - uv.x - uv.y));
+                    if (mind < 0.05f)
+                    {
+                        film->SetPixel(x, y, SPD(Math::Abs(Math::Dot(isect.geom.sn, -ray.d))));
+                    }
+                }
+                else
+                {
+                    film->SetPixel(x, y, SPD(B[patchindex]));
+                }
+            });
+        });
 
         #pragma endregion
 
@@ -209,6 +222,7 @@ private:
     Float subdivLimitArea_;
     int wireframe_;
     long long numIterations_;
+    int numShooters_;
 
 };
 
@@ -23,68 +23,16 @@
 */
 
 #include <lightmetrica/lightmetrica.h>
+#include <lightmetrica/detail/parallel.h>
 #include "radiosityutils.h"
 #include <sstream>
 #include <boost/format.hpp>
-#if LM_COMPILER_MSVC
-#pragma warning(disable:4714)
-#pragma warning(disable:4701)
-#pragma warning(disable:4456)
-#include <Eigen/Sparse>
-#else
-#include <eigen3/Eigen/Sparse>
-#endif
+#include <tbb/tbb.h>
 
 #define LM_RADIOSITY_DEBUG 0
 
-namespace Eigen
-{
-    template <>
-    struct NumTraits<lightmetrica_v2::Vec3>
-    {
-        using T          = lightmetrica_v2::Vec3;
-        using VT         = lightmetrica_v2::Float;
-        using Real       = T;
-        using NonInteger = T;
-        using Nested     = T;
-        using Literal    = T;
-        enum
-        {
-            IsComplex = 0,
-            IsInteger = 0,
-            IsSigned = 1,
-            RequireInitialization = 1,
-            ReadCost = 3,
-            AddCost = 3,
-            MulCost = 3
-        };
-        static inline T epsilon()         { return T(NumTraits<VT>::epsilon()); }
-        static inline T dummy_precision() { return T(NumTraits<VT>::dummy_precision()); }
-        static inline T highest()         { return T(std::numeric_limits<VT>::max()); }
-        static inline T lowest()          { return T(std::numeric_limits<VT>::min()); }
-    };
-
-    namespace internal
-    {
-        template<>
-        struct significant_decimals_impl<lightmetrica_v2::Vec3>
-        {
-            static inline int run()
-            {
-                return significant_decimals_impl<lightmetrica_v2::Float>::run();
-            }
-        };
-    }
-}
-
 LM_NAMESPACE_BEGIN
 
-// For Eigen
-// https://eigen.tuxfamily.org/dox/TopicCustomizingEigen.html
-auto abs(const Vec3& v) -> Vec3 { return Vec3(std::abs(v.x), std::abs(v.y), std::abs(v.z)); }
-auto sqrt(const Vec3& v) -> Vec3 { return Vec3(std::sqrt(v.x), std::sqrt(v.y), std::sqrt(v.z)); }
-auto log(const Vec3& v) -> Vec3 { return Vec3(std::log(v.x), std::log(v.y), std::log(v.z)); }
-auto ceil(const Vec3& v) -> Vec3 { return Vec3(std::ceil(v.x), std::ceil(v.y), std::ceil(v.z)); }
 auto operator<<(std::ostream& os, const Vec3& v) -> std::ostream&
 {
     os << "(" << v.x << "," << v.y << "," << v.z << ")";
@@ -98,6 +46,15 @@ auto operator<<(std::ostream& os, const Vec3& v) -> std::ostream&
     This implementation currently only supports the diffues BSDF (`bsdf::diffuse`)
     and the area light (`light::area`).
 
+    The system B = E + diag(rho) F B is solved with the Jacobi iteration
+    for all three colour channels at once.
+    Since the point-to-point estimate of the form factors is unbounded for the adjacent patches,
+    each row is normalized so that the sum of the form factors does not exceed one,
+    which makes the iteration a contraction for the reflectance below one.
+    The form factors F are either assembled in parallel into a sparse structure
+    dropping the entries not greater than `form_factor_threshold` (`matrix_free = 0`),
+    or evaluated on the fly in each iteration without storing (`matrix_free = 1`).
+
     References:
       - [Cohen & Wallace 1995] Radiosity and realistic image synthesis
       - [Willmott & Heckbert 1997] An empirical comparison of radiosity algorithms
@@ -115,6 +72,10 @@ public:
     {
         subdivLimitArea_ = prop->ChildAs<Float>("subdivlimitarea", 0.1_f);
         wireframe_ = prop->ChildAs<int>("wireframe", 0);
+        matrixFree_ = prop->ChildAs<int>("matrix_free", 0);
+        formFactorThreshold_ = prop->ChildAs<Float>("form_factor_threshold", 0_f);
+        maxIterations_ = prop->ChildAs<int>("max_iterations", 1000);
+        tolerance_ = prop->ChildAs<Float>("tolerance", 1e-6_f);
         return true;
     };
 
@@ -136,43 +97,57 @@ public:
         LM_LOG_INFO("Setup matrix");
 
         const int N = patches.Size();
-        //using Matrix = Eigen::SparseMatrix<Vec3>;
-        using Matrix = Eigen::Matrix<Vec3, Eigen::Dynamic, Eigen::Dynamic>;
-        using Vector = Eigen::Matrix<Vec3, Eigen::Dynamic, 1>;
 
-        // Setup emission term
-        Vector E(N);
+        // Setup emission term and reflectance
+        std::vector<Vec3> E(N);
+        std::vector<Vec3> R(N);
         for (int i = 0; i < N; i++)
         {
             const auto& patch = patches.At(i);
+            R[i] = patch.primitive->bsdf->Reflectance().ToRGB();
             const auto* light = patch.primitive->light;
             if (!light)
             {
                 continue;
             }
-            E(i) = light->Emittance().ToRGB();
+            E[i] = light->Emittance().ToRGB();
         }
 
-        // Setup matrix of interactions
-        Matrix K(N, N);
-        K.setIdentity();
-        for (int i = 0; i < N; i++)
+        // Setup sparse matrix of form factors, one row per receiver
+        struct Entry
+        {
+            int j;
+            Float Fij;
+        };
+        std::vector<std::vector<Entry>> F;
+        if (!matrixFree_)
         {
-            for (int j = 0; j < N; j++)
+            F.assign(N, std::vector<Entry>());
+            Parallel::For(N, [&](long long index, int threadid, bool init) -> void
             {
-                const auto Fij = RadiosityUtils::EstimateFormFactor(scene, patches.At(i), patches.At(j));
-                if (Fij > 0_f)
+                const int i = (int)(index);
+                Float sumF = 0_f;
+                for (int j = 0; j < N; j++)
+                {
+                    const auto Fij = RadiosityUtils::EstimateFormFactor(scene, patches.At(i), patches.At(j));
+                    if (Fij > formFactorThreshold_)
+                    {
+                        F[i].push_back({ j, Fij });
+                        sumF += Fij;
+                    }
+                }
+                if (sumF > 1_f)
                 {
-                    K.coeffRef(i, j) -= patches.At(i).primitive->bsdf->Reflectance().ToRGB() * Fij;
+                    for (auto& e : F[i]) { e.Fij /= sumF; }
                 }
-            }
+                F[i].shrink_to_fit();
+            });
 
-            const double progress = 100.0 * i / N;
-            LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+            size_t nnz = 0;
+            for (const auto& row : F) { nnz += row.size(); }
+            LM_LOG_INFO(boost::str(boost::format("Non-zero entries: %d (%.3f%%)") % nnz % (N > 0 ? 100.0 * nnz / ((double)N * N) : 0.0)));
         }
 
-        LM_LOG_INFO("Progress: 100.0%");
-
         #pragma endregion
 
         // --------------------------------------------------------------------------------
@@ -181,13 +156,76 @@ public:
 
         LM_LOG_INFO("Solving linear system");
 
-        Eigen::BiCGSTAB<Matrix> solver;
-        solver.compute(K);
-        Vector B = solver.solve(E);
+        std::vector<Vec3> B(E);
+        std::vector<Vec3> nextB(N);
+        Float prevDiff = Math::Inf();
+        for (int iteration = 0; iteration < maxIterations_; iteration++)
+        {
+            // B_{k+1} = E + diag(rho) F B_k
+            tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& range) -> void
+            {
+                for (int i = range.begin(); i != range.end(); i++)
+                {
+                    Vec3 FB;
+                    if (matrixFree_)
+                    {
+                        Float sumF = 0_f;
+                        for (int j = 0; j < N; j++)
+                        {
+                            const auto Fij = RadiosityUtils::EstimateFormFactor(scene, patches.At(i), patches.At(j));
+                            if (Fij > formFactorThreshold_)
+                            {
+                                FB += B[j] * Fij;
+                                sumF += Fij;
+                            }
+                        }
+                        if (sumF > 1_f)
+                        {
+                            FB = FB / sumF;
+                        }
+                    }
+                    else
+                    {
+                        for (const auto& e : F[i])
+                        {
+                            FB += B[e.j] * e.Fij;
+                        }
+                    }
+                    nextB[i] = E[i] + R[i] * FB;
+                }
+            });
+
+            // Relative change in the maximum norm
+            Float diff = 0_f;
+            Float norm = 0_f;
+            for (int i = 0; i < N; i++)
+            {
+                const auto d = nextB[i] - B[i];
+                diff = Math::Max(diff, Math::Max(Math::Abs(d.x), Math::Max(Math::Abs(d.y), Math::Abs(d.z))));
+                norm = Math::Max(norm, Math::Max(nextB[i].x, Math::Max(nextB[i].y, nextB[i].z)));
+            }
+
+            // Divergence guard; keeps the last iterate
+            if (!std::isfinite(diff) || diff > prevDiff)
+            {
+                LM_LOG_WARN(boost::str(boost::format("Iteration diverged at %d; stopping") % iteration));
+                break;
+            }
+            prevDiff = diff;
+            B.swap(nextB);
+
+            LM_LOG_INPLACE(boost::str(boost::format("Iteration %d: relative change %.3e") % iteration % (norm > 0_f ? diff / norm : 0_f)));
+            if (diff <= tolerance_ * norm)
+            {
+                break;
+            }
+        }
+
+        LM_LOG_INFO("Solved");
 
         #if LM_RADIOSITY_DEBUG
         std::stringstream ss;
-        ss << B << std::endl;
+        for (const auto& b : B) { ss << b << std::endl; }
         LM_LOG_INFO(ss.str());
         #endif
 
@@ -240,7 +278,7 @@ public:
                     }
                     else
                     {
-                        film->SetPixel(x, y, SPD(B(patchindex)));
+                        film->SetPixel(x, y, SPD(B[patchindex]));
                     }
                 });
             }
@@ -271,6 +309,10 @@ private:
 
     Float subdivLimitArea_;
     int wireframe_;
+    int matrixFree_;
+    Float formFactorThreshold_;
+    int maxIterations_;
+    Float tolerance_;
 
 };
 
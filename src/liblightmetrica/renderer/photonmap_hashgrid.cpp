@@ -0,0 +1,130 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/detail/photonmap.h>
+#include <lightmetrica/detail/hashgrid.h>
+#include <lightmetrica/detail/photongather.h>
+
+LM_NAMESPACE_BEGIN
+
+/*
+    Hashed uniform grid for the fixed-radius photon queries.
+    The cell size is set to the twice of the maximum query radius
+    and the photons are stored contiguously per cell.
+    The grid is meant to be rebuilt every pass in progressive photon mapping,
+    where the maximum radius shrinks over the passes.
+*/
+class PhotonMap_HashGrid : public PhotonMap
+{
+public:
+
+    LM_IMPL_CLASS(PhotonMap_HashGrid, PhotonMap);
+
+public:
+
+    virtual auto SetMaxQueryRadius(Float radius) -> void
+    {
+        maxRadius_ = radius;
+    }
+
+    virtual auto Build(std::vector<CompactPhoton>&& photons) -> void
+    {
+        const int numPhotons = (int)(photons.size());
+        grid_.Build(numPhotons, maxRadius_ > 0_f ? maxRadius_ * 2_f : -1_f, [&](int i) -> Vec3 { return photons[i].Position(); });
+
+        // Reorder the photons so that the photons in a cell are contiguous
+        const auto& sortedIndices = grid_.SortedIndices();
+        photons_.resize(numPhotons);
+        tbb::parallel_for(tbb::blocked_range<int>(0, numPhotons), [&](const tbb::blocked_range<int>& range) -> void
+        {
+            for (int i = range.begin(); i != range.end(); i++)
+            {
+                photons_[i] = std::move(photons[sortedIndices[i]]);
+            }
+        });
+        photons.clear();
+    }
+
+    virtual auto CollectPhotons(const Vec3& p, Float radius, const std::function<void(const Photon&)>& collectFunc) const -> void
+    {
+        const Float radius2 = radius * radius;
+        grid_.Query(p, radius, [&](int begin, int end) -> void
+        {
+            PhotonGatherUtils::TestRange(photons_.data(), begin, end, p, radius2, [&](int i) -> void
+            {
+                collectFunc(photons_[i].Unpack());
+            });
+        });
+    }
+
+    virtual auto CollectPhotonsBatch(const Vec3& p, Float radius, const CollectBatchFunc& collectFunc) const -> void
+    {
+        const Float radius2 = radius * radius;
+        PhotonGatherBuffer buffer(collectFunc);
+        grid_.Query(p, radius, [&](int begin, int end) -> void
+        {
+            PhotonGatherUtils::TestRange(photons_.data(), begin, end, p, radius2, [&](int i) -> void
+            {
+                buffer.Add(photons_[i]);
+            });
+        });
+    }
+
+    virtual auto CollectKNearestPhotons(const Vec3& p, int k, Float maxRadius, std::vector<Photon>& collected) const -> Float
+    {
+        collected.clear();
+        if (k <= 0)
+        {
+            return maxRadius;
+        }
+
+        // Visit the cells from the nearest ones, pruned by the current k-th nearest distance
+        PhotonKNNHeap heap(k, maxRadius);
+        grid_.QueryNearest(p, maxRadius, [&]() -> Float { return heap.Radius2(); }, [&](int begin, int end) -> void
+        {
+            PhotonGatherUtils::TestRange(photons_.data(), begin, end, p, heap.Radius2(), [&](int i) -> void
+            {
+                heap.Add(Math::Length2(photons_[i].Position() - p), i);
+            });
+        });
+
+        for (const auto& entry : heap.Entries())
+        {
+            collected.push_back(photons_[entry.second].Unpack());
+        }
+        return heap.Full() ? Math::Sqrt(heap.Radius2()) : maxRadius;
+    }
+
+private:
+
+    Float maxRadius_ = -1_f;                // Maximum query radius given by SetMaxQueryRadius
+    HashGrid grid_;
+    std::vector<CompactPhoton> photons_;    // Photons sorted by cell
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(PhotonMap_HashGrid, "photonmap::hashgrid");
+
+LM_NAMESPACE_END
@@ -24,151 +24,204 @@
 
 #include <pch.h>
 #include <lightmetrica/detail/photonmap.h>
+#include <lightmetrica/detail/photongather.h>
 #include <lightmetrica/bound.h>
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
-struct PhotonKdTreeNode
-{
-    bool isleaf;
-    Bound bound;
-    
-    union
-    {
-        struct
-        {
-            int begin;
-            int end;
-        } leaf;
-
-        struct
-        {
-            int child1;
-            int child2;
-        } internal;
-    };
-};
-
+/*
+    Implicit balanced kd-tree.
+    The photons are reordered in a single contiguous array so that
+    the photon at the middle of a range [begin, end) is the splitting photon of the node
+    and the sub-ranges [begin, mid) and [mid+1, end) are the children.
+    Only the split axis is stored per node, thus no pointers or node allocations are needed.
+*/
 class PhotonMap_KdTree : public PhotonMap
 {
 public:
 
     LM_IMPL_CLASS(PhotonMap_KdTree, PhotonMap);
 
+private:
+
+    // Ranges smaller than this are not split further and are tested with SIMD
+    static constexpr int LeafNumPhotons = 16;
+
+    // Ranges smaller than this are built serially
+    static constexpr int ParallelBuildThreshold = 1 << 14;
+
+    // Maximum depth of the traversal stack
+    static constexpr int MaxStackSize = 64;
+
 public:
 
-    virtual auto Build(std::vector<Photon>&& photons) -> void
+    virtual auto Build(std::vector<CompactPhoton>&& photons) -> void
     {
-        // Build function
-        int processedPhotons = 0;
-        const std::function<int(int, int)> Build_ = [&](int begin, int end) -> int
+        photons_ = std::move(photons);
+        axes_.assign(photons_.size(), 0);
+        BuildNode(0, (int)(photons_.size()));
+    }
+
+    virtual auto CollectPhotons(const Vec3& p, Float radius, const std::function<void(const Photon&)>& collectFunc) const -> void
+    {
+        Traverse(p, radius, [&](int i) -> void
+        {
+            collectFunc(photons_[i].Unpack());
+        });
+    }
+
+    virtual auto CollectPhotonsBatch(const Vec3& p, Float radius, const CollectBatchFunc& collectFunc) const -> void
+    {
+        PhotonGatherBuffer buffer(collectFunc);
+        Traverse(p, radius, [&](int i) -> void
         {
-            int idx = (int)(nodes_.size());
-            nodes_.emplace_back(new PhotonKdTreeNode);
-            auto* node = nodes_[idx].get();
+            buffer.Add(photons_[i]);
+        });
+    }
 
-            // Current bound
-            node->bound = Bound();
-            for (int i = begin; i < end; i++)
+    virtual auto CollectKNearestPhotons(const Vec3& p, int k, Float maxRadius, std::vector<Photon>& collected) const -> Float
+    {
+        collected.clear();
+        if (k <= 0)
+        {
+            return maxRadius;
+        }
+
+        // Traverse the tree from the near side with shrinking search radius.
+        // Each range holds the squared distance to the splitting plane separating it from the query point.
+        PhotonKNNHeap heap(k, maxRadius);
+        struct Range { int begin; int end; Float dist2; };
+        Range stack[MaxStackSize];
+        int stackSize = 0;
+        stack[stackSize++] = { 0, (int)(photons_.size()), 0_f };
+
+        while (stackSize > 0)
+        {
+            const auto range = stack[--stackSize];
+            if (range.dist2 >= heap.Radius2())
             {
-                node->bound = Math::Union(node->bound, photons_[indices_[i]].p);
+                continue;
             }
 
-            // Create leaf node
-            const int LeafNumNodes = 10;
-            if (end - begin < LeafNumNodes)
+            // Leaf range
+            if (range.end - range.begin <= LeafNumPhotons)
             {
-                node->isleaf = true;
-                node->leaf.begin = begin;
-                node->leaf.end = end;
-
-                // Progress update
-                processedPhotons += end - begin;
-                const double progress = (double)(processedPhotons) / photons_.size() * 100.0;
-                LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
-                
-                return idx;
+                PhotonGatherUtils::TestRange(photons_.data(), range.begin, range.end, p, heap.Radius2(), [&](int i) -> void
+                {
+                    heap.Add(Math::Length2(photons_[i].Position() - p), i);
+                });
+                continue;
             }
 
-            // Select longest axis as split axis
-            const int axis = node->bound.LongestAxis();
-
-            // Select split position
-            const Float split = node->bound.Centroid()[axis];
+            // Splitting photon
+            const int mid = (range.begin + range.end) / 2;
+            const auto& photon = photons_[mid];
+            heap.Add(Math::Length2(photon.Position() - p), mid);
+
+            // Push the far child first so that the near child is visited first
+            const int axis = axes_[mid];
+            const Float d = p[axis] - photon.p[axis];
+            const Float farDist2 = Math::Max(range.dist2, d * d);
+            const Range left  = { range.begin, mid, d < 0_f ? range.dist2 : farDist2 };
+            const Range right = { mid + 1, range.end, d < 0_f ? farDist2 : range.dist2 };
+            stack[stackSize++] = d < 0_f ? right : left;
+            stack[stackSize++] = d < 0_f ? left : right;
+        }
+
+        for (const auto& entry : heap.Entries())
+        {
+            collected.push_back(photons_[entry.second].Unpack());
+        }
+        return heap.Full() ? Math::Sqrt(heap.Radius2()) : maxRadius;
+    }
 
-            // Partition into two sets according to split position
-            const auto it = std::partition(indices_.begin() + begin, indices_.begin() + end, [&](int i) -> bool
-            {
-                return photons_[i].p[axis] < split;
-            });
+private:
 
-            // Create intermediate node
-            const int mid = (int)(std::distance(indices_.begin(), it));
-            node->isleaf = false;
-            node->internal.child1 = Build_(begin, mid);
-            node->internal.child2 = Build_(mid, end);
+    template <typename AcceptFunc>
+    auto Traverse(const Vec3& p, Float radius, const AcceptFunc& acceptFunc) const -> void
+    {
+        const Float radius2 = radius * radius;
 
-            return idx;
-        };
+        struct Range { int begin; int end; };
+        Range stack[MaxStackSize];
+        int stackSize = 0;
+        stack[stackSize++] = { 0, (int)(photons_.size()) };
 
-        photons_ = photons;
-        nodes_.clear();
-        indices_.assign(photons_.size(), 0);
-        std::iota(indices_.begin(), indices_.end(), 0);
-        Build_(0, (int)(photons_.size()));
+        while (stackSize > 0)
+        {
+            const auto range = stack[--stackSize];
 
-        LM_LOG_INFO("Progress: 100.0%");
-    }
+            // Leaf range
+            if (range.end - range.begin <= LeafNumPhotons)
+            {
+                PhotonGatherUtils::TestRange(photons_.data(), range.begin, range.end, p, radius2, acceptFunc);
+                continue;
+            }
 
-    virtual auto CollectPhotons(const Vec3& p, Float radius, const std::function<void(const Photon&)>& collectFunc) const -> void
-    {
-        const Float radius2 = radius * radius;
-        const std::function<void(int)> Collect = [&](int idx) -> void
-        {
-            const auto* node = nodes_.at(idx).get();
-            
-            if (node->isleaf)
+            // Splitting photon
+            const int mid = (range.begin + range.end) / 2;
+            const auto& photon = photons_[mid];
+            if (Math::Length2(photon.Position() - p) < radius2)
             {
-                for (int i = node->leaf.begin; i < node->leaf.end; i++)
-                {
-                    const auto& photon = photons_[indices_[i]];
-                    if (Math::Length2(photon.p - p) < radius2)
-                    {
-                        collectFunc(photon);
-                    }
-                }
-                return;
+                acceptFunc(mid);
             }
 
-            const int axis = node->bound.LongestAxis();
-            const Float split = node->bound.Centroid()[axis];
-            const auto dist2 = (p[axis] - split) * (p[axis] - split);
-            if (p[axis] < split)
+            // Traverse the children overlapping with the query sphere
+            const int axis = axes_[mid];
+            const Float d = p[axis] - photon.p[axis];
+            if (d < 0_f || d * d < radius2)
             {
-                Collect(node->internal.child1);
-                if (dist2 < radius2)
-                {
-                    Collect(node->internal.child2);
-                }
+                stack[stackSize++] = { range.begin, mid };
             }
-            else
+            if (d >= 0_f || d * d < radius2)
             {
-                Collect(node->internal.child2);
-                if (dist2 < radius2)
-                {
-                    Collect(node->internal.child1);
-                }
+                stack[stackSize++] = { mid + 1, range.end };
             }
-        };
+        }
+    }
+
+    auto BuildNode(int begin, int end) -> void
+    {
+        if (end - begin <= LeafNumPhotons)
+        {
+            return;
+        }
 
-        Collect(0);
+        // Select longest axis of the current bound as split axis
+        Bound bound;
+        for (int i = begin; i < end; i++)
+        {
+            bound = Math::Union(bound, photons_[i].Position());
+        }
+        const int axis = bound.LongestAxis();
+
+        // Partition by the median along the split axis
+        const int mid = (begin + end) / 2;
+        std::nth_element(photons_.begin() + begin, photons_.begin() + mid, photons_.begin() + end, [axis](const CompactPhoton& p1, const CompactPhoton& p2) -> bool
+        {
+            return p1.p[axis] < p2.p[axis];
+        });
+        axes_[mid] = (unsigned char)(axis);
+
+        // Build children, in parallel for large ranges
+        if (end - begin < ParallelBuildThreshold)
+        {
+            BuildNode(begin, mid);
+            BuildNode(mid + 1, end);
+        }
+        else
+        {
+            tbb::parallel_invoke(
+                [&]() { BuildNode(begin, mid); },
+                [&]() { BuildNode(mid + 1, end); });
+        }
     }
 
 private:
 
-    std::vector<std::unique_ptr<PhotonKdTreeNode>> nodes_;
-    std::vector<int> indices_;
-    std::vector<Photon> photons_;
+    std::vector<CompactPhoton> photons_;    // Photons ordered as an implicit kd-tree
+    std::vector<unsigned char> axes_;       // Split axis of the node whose splitting photon is at the index
 
 };
 
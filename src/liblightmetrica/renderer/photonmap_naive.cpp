@@ -35,9 +35,9 @@ public:
 
 public:
 
-    virtual auto Build(std::vector<Photon>&& photons) -> void
+    virtual auto Build(std::vector<CompactPhoton>&& photons) -> void
     {
-        photons_ = photons;
+        photons_ = std::move(photons);
     }
 
     virtual auto CollectPhotons(const Vec3& p, Float radius, const std::function<void(const Photon&)>& collectFunc) const -> void
@@ -45,16 +45,16 @@ public:
         const Float radius2 = radius * radius;
         for (const auto& photon : photons_)
         {
-            if (Math::Length2(photon.p - p) < radius2)
+            if (Math::Length2(photon.Position() - p) < radius2)
             {
-                collectFunc(photon);
+                collectFunc(photon.Unpack());
             }
         }
     }
 
 private:
 
-    std::vector<Photon> photons_;
+    std::vector<CompactPhoton> photons_;
 
 };
 
@@ -37,6 +37,7 @@
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/scheduler.h>
 #include <lightmetrica/renderutils.h>
+#include <lightmetrica/detail/parallel.h>
 #include <tbb/tbb.h>
 
 #define LM_BDPT_DEBUG 0
@@ -221,10 +222,58 @@ public:
 
 };
 
+/*!
+    Full path.
+    A lightweight view of the full path connecting a light subpath and an eye subpath.
+    The path is evaluated directly against the vertices of the subpaths,
+    so that the connection does not require to copy the path vertices.
+*/
 struct Path
 {
 
-    std::vector<PathVertex> vertices;
+    const Subpath* subpathL = nullptr;
+    const Subpath* subpathE = nullptr;
+    int sC = 0;                 // Number of vertices taken from the light subpath
+    int tC = 0;                 // Number of vertices taken from the eye subpath
+    bool directC = false;       // True if the endpoint is sampled with direct emitter sampling
+
+public:
+
+    #pragma region Vertex access
+
+    auto NumVertices() const -> int
+    {
+        return sC + tC;
+    }
+
+    auto Vertex(int i) const -> const PathVertex&
+    {
+        assert(0 <= i && i < sC + tC);
+        if (i < sC)
+        {
+            const auto& v = subpathL->vertices[i];
+            return tC == 0 && directC && i == sC - 1 ? *v.direct : *v.sv;
+        }
+        const int j = sC + tC - 1 - i;
+        const auto& v = subpathE->vertices[j];
+        return sC == 0 && directC && j == tC - 1 ? *v.direct : *v.sv;
+    }
+
+    auto Type(int i) const -> int
+    {
+        // Endpoints of the path are always treated as emitters
+        if (sC == 0 && i == 0)
+        {
+            return SurfaceInteractionType::L;
+        }
+        if (tC == 0 && i == sC - 1)
+        {
+            return SurfaceInteractionType::E;
+        }
+        return Vertex(i).type;
+    }
+
+    #pragma endregion
 
 public:
 
@@ -233,7 +282,6 @@ public:
     auto Connect(const Scene3* scene, int s, int t, bool direct, const Subpath& subpathL, const Subpath& subpathE) -> bool
     {
         assert(s > 0 || t > 0);
-        vertices.clear();
         if (s == 0 && t > 0)
         {
             if (!direct)
@@ -246,11 +294,6 @@ public:
                 {
                     return false;
                 }
-                for (int i = t - 1; i >= 0; i--)
-                {
-                    assert(subpathE.vertices[i].sv);
-                    vertices.push_back(*subpathE.vertices[i].sv);
-                }
             }
             else
             {
@@ -258,15 +301,7 @@ public:
                 {
                     return false;
                 }
-                vertices.push_back(*subpathE.vertices[t - 1].direct);
-                for (int i = t - 2; i >= 0; i--)
-                {
-                    assert(subpathE.vertices[i].sv);
-                    vertices.push_back(*subpathE.vertices[i].sv);
-                }
             }
-
-            vertices.front().type = SurfaceInteractionType::L;
         }
         else if (s > 0 && t == 0)
         {
@@ -280,11 +315,6 @@ public:
                 {
                     return false;
                 }
-                for (int i = 0; i < s; i++)
-                {
-                    assert(subpathL.vertices[i].sv);
-                    vertices.push_back(*subpathL.vertices[i].sv);
-                }
             }
             else
             {
@@ -292,15 +322,7 @@ public:
                 {
                     return false;
                 }
-                for (int i = 0; i < s - 1; i++)
-                {
-                    assert(subpathL.vertices[i].sv);
-                    vertices.push_back(*subpathL.vertices[i].sv);
-                }
-                vertices.push_back(*subpathL.vertices[s - 1].direct);
             }
-
-            vertices.back().type = SurfaceInteractionType::E;
         }
         else
         {
@@ -318,17 +340,13 @@ public:
             {
                 return false;
             }
-            for (int i = 0; i < s; i++)
-            {
-                assert(subpathL.vertices[i].sv);
-                vertices.push_back(*subpathL.vertices[i].sv);
-            }
-            for (int i = t - 1; i >= 0; i--)
-            {
-                assert(subpathE.vertices[i].sv);
-                vertices.push_back(*subpathE.vertices[i].sv);
-            }
         }
+
+        this->subpathL = &subpathL;
+        this->subpathE = &subpathE;
+        sC = s;
+        tC = t;
+        directC = direct;
         return true;
     }
 
@@ -348,7 +366,7 @@ public:
     auto SelectionPDF(int s, bool direct) const -> Float
     {
         const Float rrProb = 0.5_f;
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
         Float selectionProb = 1;
 
@@ -369,8 +387,9 @@ public:
 
     auto RasterPosition() const -> Vec2
     {
-        const auto& v = vertices[vertices.size() - 1];
-        const auto& vPrev = vertices[vertices.size() - 2];
+        const int n = NumVertices();
+        const auto& v = Vertex(n - 1);
+        const auto& vPrev = Vertex(n - 2);
         Vec2 rasterPos;
         v.primitive->RasterPosition(Math::Normalize(vPrev.geom.p - v.geom.p), v.geom, rasterPos);
         return rasterPos;
@@ -378,30 +397,30 @@ public:
 
     auto EvaluateCst(int s) const -> SPD
     {
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
         SPD cst;
 
         if (s == 0 && t > 0)
         {
-            const auto& v = vertices[0];
-            const auto& vNext = vertices[1];
-            cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, v.type, Vec3(), Math::Normalize(vNext.geom.p - v.geom.p), TransportDirection::EL, false);
+            const auto& v = Vertex(0);
+            const auto& vNext = Vertex(1);
+            cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, Type(0), Vec3(), Math::Normalize(vNext.geom.p - v.geom.p), TransportDirection::EL, false);
         }
         else if (s > 0 && t == 0)
         {
-            const auto& v = vertices[n - 1];
-            const auto& vPrev = vertices[n - 2];
-            cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, v.type, Vec3(), Math::Normalize(vPrev.geom.p - v.geom.p), TransportDirection::LE, false);
+            const auto& v = Vertex(n - 1);
+            const auto& vPrev = Vertex(n - 2);
+            cst = v.primitive->EvaluatePosition(v.geom, true) * v.primitive->EvaluateDirection(v.geom, Type(n - 1), Vec3(), Math::Normalize(vPrev.geom.p - v.geom.p), TransportDirection::LE, false);
         }
         else if (s > 0 && t > 0)
         {
-            const auto* vL = &vertices[s - 1];
-            const auto* vE = &vertices[s];
-            const auto* vLPrev = s - 2 >= 0 ? &vertices[s - 2] : nullptr;
-            const auto* vENext = s + 1 < n ? &vertices[s + 1] : nullptr;
-            const auto fsL = vL->primitive->EvaluateDirection(vL->geom, vL->type, vLPrev ? Math::Normalize(vLPrev->geom.p - vL->geom.p) : Vec3(), Math::Normalize(vE->geom.p - vL->geom.p), TransportDirection::LE, true);
-            const auto fsE = vE->primitive->EvaluateDirection(vE->geom, vE->type, vENext ? Math::Normalize(vENext->geom.p - vE->geom.p) : Vec3(), Math::Normalize(vL->geom.p - vE->geom.p), TransportDirection::EL, true);
+            const auto* vL = &Vertex(s - 1);
+            const auto* vE = &Vertex(s);
+            const auto* vLPrev = s - 2 >= 0 ? &Vertex(s - 2) : nullptr;
+            const auto* vENext = s + 1 < n ? &Vertex(s + 1) : nullptr;
+            const auto fsL = vL->primitive->EvaluateDirection(vL->geom, Type(s - 1), vLPrev ? Math::Normalize(vLPrev->geom.p - vL->geom.p) : Vec3(), Math::Normalize(vE->geom.p - vL->geom.p), TransportDirection::LE, true);
+            const auto fsE = vE->primitive->EvaluateDirection(vE->geom, Type(s), vENext ? Math::Normalize(vENext->geom.p - vE->geom.p) : Vec3(), Math::Normalize(vL->geom.p - vE->geom.p), TransportDirection::EL, true);
             const Float G = RenderUtils::GeometryTerm(vL->geom, vE->geom);
             cst = fsL * G * fsE;
         }
@@ -411,7 +430,7 @@ public:
 
     auto EvaluateF(int s, bool direct) const -> SPD
     {
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
         assert(n >= 2);
 
@@ -425,17 +444,17 @@ public:
         else
         {
             {
-                const auto* vL  = &vertices[0];
+                const auto* vL  = &Vertex(0);
                 fL = vL->primitive->EvaluatePosition(vL->geom, false);
             }
             for (int i = 0; i < s - 1; i++)
             {
-                const auto* v     = &vertices[i];
-                const auto* vPrev = i >= 1 ? &vertices[i - 1] : nullptr;
-                const auto* vNext = &vertices[i + 1];
+                const auto* v     = &Vertex(i);
+                const auto* vPrev = i >= 1 ? &Vertex(i - 1) : nullptr;
+                const auto* vNext = &Vertex(i + 1);
                 const auto wi = vPrev ? Math::Normalize(vPrev->geom.p - v->geom.p) : Vec3();
                 const auto wo = Math::Normalize(vNext->geom.p - v->geom.p);
-                fL *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::LE, t == 0 && i == s - 2 && direct);
+                fL *= v->primitive->EvaluateDirection(v->geom, Type(i), wi, wo, TransportDirection::LE, t == 0 && i == s - 2 && direct);
                 fL *= RenderUtils::GeometryTerm(v->geom, vNext->geom);
             }
         }
@@ -454,17 +473,17 @@ public:
         else
         {
             {
-                const auto* vE = &vertices[n - 1];
+                const auto* vE = &Vertex(n - 1);
                 fE = vE->primitive->EvaluatePosition(vE->geom, false);
             }
             for (int i = n - 1; i > s; i--)
             {
-                const auto* v     = &vertices[i];
-                const auto* vPrev = &vertices[i - 1];
-                const auto* vNext = i < n - 1 ? &vertices[i + 1] : nullptr;
+                const auto* v     = &Vertex(i);
+                const auto* vPrev = &Vertex(i - 1);
+                const auto* vNext = i < n - 1 ? &Vertex(i + 1) : nullptr;
                 const auto wi = vNext ? Math::Normalize(vNext->geom.p - v->geom.p) : Vec3();
                 const auto wo = Math::Normalize(vPrev->geom.p - v->geom.p);
-                fE *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, s == 0 && i == 1 && direct);
+                fE *= v->primitive->EvaluateDirection(v->geom, Type(i), wi, wo, TransportDirection::EL, s == 0 && i == 1 && direct);
                 fE *= RenderUtils::GeometryTerm(v->geom, vPrev->geom);
             }
         }
@@ -488,7 +507,7 @@ public:
 
     auto EvaluateUnweightContribution(const Scene3* scene, int s, bool direct) const -> SPD
     {
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
 
         // --------------------------------------------------------------------------------
@@ -503,26 +522,26 @@ public:
         else
         {
             {
-                const auto* v = &vertices[0];
-                const auto* vNext = &vertices[1];
+                const auto* v = &Vertex(0);
+                const auto* vNext = &Vertex(1);
                 alphaL =
                     v->primitive->EvaluatePosition(v->geom, false) /
                     v->primitive->EvaluatePositionGivenDirectionPDF(v->geom, Math::Normalize(vNext->geom.p - v->geom.p), false) / scene->EvaluateEmitterPDF(v->primitive).v;
             }
             for (int i = 0; i < s - 1; i++)
             {
-                const auto* v     = &vertices[i];
-                const auto* vPrev = i >= 1 ? &vertices[i - 1] : nullptr;
-                const auto* vNext = &vertices[i + 1];
+                const auto* v     = &Vertex(i);
+                const auto* vPrev = i >= 1 ? &Vertex(i - 1) : nullptr;
+                const auto* vNext = &Vertex(i + 1);
                 const auto wi = vPrev ? Math::Normalize(vPrev->geom.p - v->geom.p) : Vec3();
                 const auto wo = Math::Normalize(vNext->geom.p - v->geom.p);
-                const auto fs = v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::LE, t == 0 && i == s - 2 && direct);
+                const auto fs = v->primitive->EvaluateDirection(v->geom, Type(i), wi, wo, TransportDirection::LE, t == 0 && i == s - 2 && direct);
                 if (fs.Black()) return SPD();
                 alphaL *= 
                     fs /
                     (t == 0 && i == s - 2 && direct
                         ? vNext->primitive->EvaluatePositionGivenPreviousPositionPDF(vNext->geom, v->geom, false).ConvertToProjSA(vNext->geom, v->geom) * scene->EvaluateEmitterPDF(vNext->primitive).v
-                        : v->primitive->EvaluateDirectionPDF(v->geom, v->type, wi, wo, false));
+                        : v->primitive->EvaluateDirectionPDF(v->geom, Type(i), wi, wo, false));
             }
         }
         if (alphaL.Black())
@@ -544,26 +563,26 @@ public:
         else
         {
             {
-                const auto* v = &vertices[n - 1];
-                const auto* vPrev = &vertices[n - 2];
+                const auto* v = &Vertex(n - 1);
+                const auto* vPrev = &Vertex(n - 2);
                 alphaE =
                     v->primitive->EvaluatePosition(v->geom, false) /
                     v->primitive->EvaluatePositionGivenDirectionPDF(v->geom, Math::Normalize(vPrev->geom.p - v->geom.p), false) / scene->EvaluateEmitterPDF(v->primitive).v;
             }
             for (int i = n - 1; i > s; i--)
             {
-                const auto* v = &vertices[i];
-                const auto* vPrev = &vertices[i - 1];
-                const auto* vNext = i < n - 1 ? &vertices[i + 1] : nullptr;
+                const auto* v = &Vertex(i);
+                const auto* vPrev = &Vertex(i - 1);
+                const auto* vNext = i < n - 1 ? &Vertex(i + 1) : nullptr;
                 const auto wi = vNext ? Math::Normalize(vNext->geom.p - v->geom.p) : Vec3();
                 const auto wo = Math::Normalize(vPrev->geom.p - v->geom.p);
-                const auto fs = v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, s == 0 && i == 1 && direct);
+                const auto fs = v->primitive->EvaluateDirection(v->geom, Type(i), wi, wo, TransportDirection::EL, s == 0 && i == 1 && direct);
                 if (fs.Black()) return SPD();
                 alphaE *= 
                     fs /
                     (s == 0 && i == 1 && direct
                         ? vPrev->primitive->EvaluatePositionGivenPreviousPositionPDF(vPrev->geom, v->geom, false).ConvertToProjSA(vPrev->geom, v->geom) * scene->EvaluateEmitterPDF(vPrev->primitive).v
-                        : v->primitive->EvaluateDirectionPDF(v->geom, v->type, wi, wo, false));
+                        : v->primitive->EvaluateDirectionPDF(v->geom, Type(i), wi, wo, false));
             }
         }
         if (alphaE.Black())
@@ -593,7 +612,7 @@ public:
     auto Samplable(int s, bool direct) const -> bool
     {
         // There is no connection with some cases
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
         if (s > 0 && t > 0 && direct)
         {
@@ -603,14 +622,14 @@ public:
         // Delta connection with direct light sampling
         if (t == 0 && s > 0 && direct)
         {
-            if (vertices[n - 2].primitive->IsDeltaDirection(vertices[n - 2].type))
+            if (Vertex(n - 2).primitive->IsDeltaDirection(Type(n - 2)))
             {
                 return false;
             }
         }
         if (s == 0 && t > 0 && direct)
         {
-            if (vertices[1].primitive->IsDeltaDirection(vertices[1].type))
+            if (Vertex(1).primitive->IsDeltaDirection(Type(1)))
             {
                 return false;
             }
@@ -619,25 +638,21 @@ public:
         // Delta connection of endpoints
         if (s == 0 && t > 0)
         {
-            const auto& v = vertices[0];
-            if (v.primitive->IsDeltaPosition(v.type))
+            if (Vertex(0).primitive->IsDeltaPosition(Type(0)))
             {
                 return false;
             }
         }
         else if (s > 0 && t == 0)
         {
-            const auto& v = vertices[n - 1];
-            if (v.primitive->IsDeltaPosition(v.type))
+            if (Vertex(n - 1).primitive->IsDeltaPosition(Type(n - 1)))
             {
                 return false;
             }
         }
         else if (s > 0 && t > 0)
         {
-            const auto* vL = &vertices[s - 1];
-            const auto* vE = &vertices[s];
-            if (vL->primitive->IsDeltaDirection(vL->type) || vE->primitive->IsDeltaDirection(vE->type))
+            if (Vertex(s - 1).primitive->IsDeltaDirection(Type(s - 1)) || Vertex(s).primitive->IsDeltaDirection(Type(s)))
             {
                 return false;
             }
@@ -656,41 +671,43 @@ public:
         // Otherwise the path can be generated with the given strategy (s,t)
         // so p_{s,t} can be safely evaluated.
         PDFVal pdf(PDFMeasure::ProdArea, 1_f);
-        const int n = (int)(vertices.size());
+        const int n = NumVertices();
         const int t = n - s;
         if (s > 0)
         {
-            pdf *= vertices[0].primitive->EvaluatePositionGivenDirectionPDF(vertices[0].geom, Math::Normalize(vertices[1].geom.p - vertices[0].geom.p), false) * scene->EvaluateEmitterPDF(vertices[0].primitive).v;
+            const auto& v0 = Vertex(0);
+            pdf *= v0.primitive->EvaluatePositionGivenDirectionPDF(v0.geom, Math::Normalize(Vertex(1).geom.p - v0.geom.p), false) * scene->EvaluateEmitterPDF(v0.primitive).v;
             for (int i = 0; i < s - 1; i++)
             {
-                const auto* vi = &vertices[i];
-                const auto* vip = i - 1 >= 0 ? &vertices[i - 1] : nullptr;
-                const auto* vin = &vertices[i + 1];
+                const auto* vi = &Vertex(i);
+                const auto* vip = i - 1 >= 0 ? &Vertex(i - 1) : nullptr;
+                const auto* vin = &Vertex(i + 1);
                 if (t == 0 && i == s - 2 && direct)
                 {
                     pdf *= vin->primitive->EvaluatePositionGivenPreviousPositionPDF(vin->geom, vi->geom, false) * scene->EvaluateEmitterPDF(vin->primitive).v;
                 }
                 else
                 {
-                    pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vip ? Math::Normalize(vip->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vin->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vin->geom);
+                    pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, Type(i), vip ? Math::Normalize(vip->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vin->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vin->geom);
                 }
             }
         }
         if (t > 0)
         {
-            pdf *= vertices[n - 1].primitive->EvaluatePositionGivenDirectionPDF(vertices[n - 1].geom, Math::Normalize(vertices[n - 2].geom.p - vertices[n - 1].geom.p), false) * scene->EvaluateEmitterPDF(vertices[n - 1].primitive).v;
+            const auto& vn = Vertex(n - 1);
+            pdf *= vn.primitive->EvaluatePositionGivenDirectionPDF(vn.geom, Math::Normalize(Vertex(n - 2).geom.p - vn.geom.p), false) * scene->EvaluateEmitterPDF(vn.primitive).v;
             for (int i = n - 1; i >= s + 1; i--)
             {
-                const auto* vi = &vertices[i];
-                const auto* vip = &vertices[i - 1];
-                const auto* vin = i + 1 < n ? &vertices[i + 1] : nullptr;
+                const auto* vi = &Vertex(i);
+                const auto* vip = &Vertex(i - 1);
+                const auto* vin = i + 1 < n ? &Vertex(i + 1) : nullptr;
                 if (s == 0 && i == s + 1 && direct)
                 {
                     pdf *= vip->primitive->EvaluatePositionGivenPreviousPositionPDF(vip->geom, vi->geom, false) * scene->EvaluateEmitterPDF(vip->primitive).v;
                 }
                 else
                 {
-                    pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vin ? Math::Normalize(vin->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vip->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vip->geom);
+                    pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, Type(i), vin ? Math::Normalize(vin->geom.p - vi->geom.p) : Vec3(), Math::Normalize(vip->geom.p - vi->geom.p), false).ConvertToArea(vi->geom, vip->geom);
                 }
             }
         }
@@ -718,7 +735,7 @@ public:
 
     LM_IMPL_F(Evaluate) = [this](const Path& path, const Scene3* scene, int s_, bool direct_) -> Float
     {
-        const int n = (int)(path.vertices.size());
+        const int n = path.NumVertices();
         int nonzero = 0;
 
         for (int s = 0; s <= n; s++)
@@ -754,7 +771,7 @@ public:
 
     LM_IMPL_F(Evaluate) = [this](const Path& path, const Scene3* scene, int s_, bool direct_) -> Float
     {
-        const int n = static_cast<int>(path.vertices.size());
+        const int n = path.NumVertices();
         const auto ps = path.EvaluatePDF(scene, s_, direct_);
         assert(ps > 0_f);
 
@@ -813,6 +830,13 @@ struct StrategyHash
 /*!
     \brief BDPT renderer.
     Implements bidirectional path tracing.
+
+    If `num_learning_samples` is specified, the renderer runs a learning phase
+    recording the contribution and the cost of each strategy (s,t,d).
+    In the main phase, the strategies with low efficiency are stochastically evaluated
+    with the probability proportional to the relative efficiency (clamped by `min_strategy_selection_prob`)
+    and the contributions are divided by the probability. The MIS weights are kept unchanged
+    so that the estimate remains unbiased.
 */
 class Renderer_BDPT final : public Renderer
 {
@@ -824,6 +848,8 @@ private:
 
     int maxNumVertices_;
     int minNumVertices_;
+    long long numLearningSamples_;
+    Float minStrategySelectionProb_;
     Scheduler::UniquePtr sched_ = ComponentFactory::Create<Scheduler>();
     MISWeight::UniquePtr mis_{ nullptr, nullptr };
 
@@ -834,6 +860,8 @@ public:
         sched_->Load(prop);
         maxNumVertices_ = prop->ChildAs("max_num_vertices", -1);
         minNumVertices_ = prop->ChildAs("min_num_vertices", 0);
+        numLearningSamples_ = prop->ChildAs<long long>("num_learning_samples", 0);
+        minStrategySelectionProb_ = prop->ChildAs<Float>("min_strategy_selection_prob", 0.1_f);
         mis_ = ComponentFactory::Create<MISWeight>("misweight::" + prop->ChildAs<std::string>("mis", "powerheuristics"));
         return true;
     };
@@ -844,12 +872,146 @@ public:
 
         // --------------------------------------------------------------------------------
 
+        #pragma region Helper functions
+
+        // Enumerate strategies (s,t,d) for given pair of subpaths
+        const auto ForEachStrategy = [&](const Subpath& subpathL, const Subpath& subpathE, const auto& func) -> void
+        {
+            const int nL = static_cast<int>(subpathL.vertices.size());
+            const int nE = static_cast<int>(subpathE.vertices.size());
+            for (int n = 2; n <= nE + nL; n++)
+            {
+                if (maxNumVertices_ != -1 && (n > maxNumVertices_ || n < minNumVertices_))
+                {
+                    continue;
+                }
+
+                // --------------------------------------------------------------------------------
+
+                const int minS = Math::Max(0, n - nE);
+                const int maxS = Math::Min(nL, n);
+                for (int s = minS; s <= maxS; s++)
+                {
+                    for (int d = 0; d < 2; d++)
+                    {
+                        // Only direct connection with the cases with s=0 and t=0
+                        const int t = n - s;
+                        if (s > 0 && t > 0 && d == 1)
+                        {
+                            continue;
+                        }
+                        func(s, t, d);
+                    }
+                }
+            }
+        };
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Learning phase
+
+        // Selection probabilities of the strategies. Strategies not in the map are always evaluated.
+        std::unordered_map<Strategy, Float, StrategyHash> strategySelectionProb;
+        if (numLearningSamples_ > 0)
+        {
+            LM_LOG_INFO("Learning efficiency of strategies");
+            LM_LOG_INDENTER();
+
+            struct StrategyStat
+            {
+                double contrb = 0;      // Sum of contributions (luminance)
+                double cost = 0;        // Sum of evaluation time in seconds
+            };
+
+            struct Context
+            {
+                Random rng;
+                Subpath subpathL;
+                Subpath subpathE;
+                std::unordered_map<Strategy, StrategyStat, StrategyHash> stats;
+            };
+
+            std::vector<Context> contexts(Parallel::GetNumThreads());
+            for (auto& ctx : contexts)
+            {
+                ctx.rng.SetSeed(initRng->NextUInt());
+            }
+
+            Parallel::For(numLearningSamples_, [&](long long index, int threadid, bool init)
+            {
+                auto& ctx = contexts[threadid];
+                ctx.subpathL.Sample(scene, &ctx.rng, TransportDirection::LE, maxNumVertices_);
+                ctx.subpathE.Sample(scene, &ctx.rng, TransportDirection::EL, maxNumVertices_);
+                ForEachStrategy(ctx.subpathL, ctx.subpathE, [&](int s, int t, int d) -> void
+                {
+                    const bool direct = d == 1;
+                    const auto start = std::chrono::high_resolution_clock::now();
+                    const auto C = [&]() -> SPD
+                    {
+                        Path path;
+                        if (!path.Connect(scene, s, t, direct, ctx.subpathL, ctx.subpathE))
+                        {
+                            return SPD();
+                        }
+                        return path.EvaluateContribution(mis_.get(), scene, s, direct) / path.SelectionPDF(s, direct);
+                    }();
+                    const auto end = std::chrono::high_resolution_clock::now();
+
+                    auto& stat = ctx.stats[Strategy{ s, t, d }];
+                    stat.contrb += C.Luminance();
+                    stat.cost += std::chrono::duration<double>(end - start).count();
+                });
+            });
+
+            // --------------------------------------------------------------------------------
+
+            // Gather statistics
+            std::unordered_map<Strategy, StrategyStat, StrategyHash> stats;
+            StrategyStat total;
+            for (const auto& ctx : contexts)
+            {
+                for (const auto& kv : ctx.stats)
+                {
+                    auto& stat = stats[kv.first];
+                    stat.contrb += kv.second.contrb;
+                    stat.cost += kv.second.cost;
+                    total.contrb += kv.second.contrb;
+                    total.cost += kv.second.cost;
+                }
+            }
+
+            // Selection probabilities proportional to the efficiency relative to the overall efficiency
+            if (total.contrb > 0 && total.cost > 0)
+            {
+                const double overallEfficiency = total.contrb / total.cost;
+                for (const auto& kv : stats)
+                {
+                    const double efficiency = kv.second.cost > 0 ? kv.second.contrb / kv.second.cost : 0;
+                    const auto prob = Math::Clamp((Float)(efficiency / overallEfficiency), minStrategySelectionProb_, 1_f);
+                    strategySelectionProb[kv.first] = prob;
+                }
+            }
+
+            {
+                LM_LOG_INFO("Strategy selection probabilities");
+                LM_LOG_INDENTER();
+                for (const auto& kv : strategySelectionProb)
+                {
+                    LM_LOG_INFO(boost::str(boost::format("s = %d, t = %d, d = %d: %.5f") % kv.first.s % kv.first.t % kv.first.d % kv.second));
+                }
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
         #if LM_COMPILER_CLANG
         tbb::enumerable_thread_specific<Subpath> subpathL_, subpathE_;
-        tbb::enumerable_thread_specific<Path> path_;
         #else
         static thread_local Subpath subpathL, subpathE;
-        static thread_local Path path;
         #endif
 
         // --------------------------------------------------------------------------------
@@ -869,7 +1031,6 @@ public:
             #if LM_COMPILER_CLANG
             auto& subpathL = subpathL_.local();
             auto& subpathE = subpathE_.local();
-            auto& path     = path_.local();
             #endif
 
             // --------------------------------------------------------------------------------
@@ -885,87 +1046,80 @@ public:
 
             #pragma region Evaluate path combinations
 
-            const int nL = static_cast<int>(subpathL.vertices.size());
-            const int nE = static_cast<int>(subpathE.vertices.size());
-            for (int n = 2; n <= nE + nL; n++)
+            ForEachStrategy(subpathL, subpathE, [&](int s, int t, int d) -> void
             {
-                if (maxNumVertices_ != -1 && (n > maxNumVertices_ || n < minNumVertices_))
-                {
-                    continue;
-                }
+                const bool direct = d == 1;
 
                 // --------------------------------------------------------------------------------
 
-                const int minS = Math::Max(0, n - nE);
-                const int maxS = Math::Min(nL, n);
-                for (int s = minS; s <= maxS; s++)
+                #pragma region Stochastic selection of the strategy
+
+                Float selectionProb = 1_f;
+                if (!strategySelectionProb.empty())
                 {
-                    for (int d = 0; d < 2; d++)
+                    const auto it = strategySelectionProb.find(Strategy{ s, t, d });
+                    if (it != strategySelectionProb.end())
                     {
-                        #pragma region Exclude some combination of paths to control number of strategies
-
-                        const bool direct = d == 1;
-                        const int t = n - s;
-
-                        // Only direct connection with the cases with s=0 and t=0
-                        if (s > 0 && t > 0 && direct)
-                        {
-                            continue;
-                        }
+                        selectionProb = it->second;
+                    }
+                    if (selectionProb < 1_f && rng->Next() >= selectionProb)
+                    {
+                        return;
+                    }
+                }
 
-                        #pragma endregion
+                #pragma endregion
 
-                        // --------------------------------------------------------------------------------
+                // --------------------------------------------------------------------------------
 
-                        #pragma region Connect subpaths & create fullpath
+                #pragma region Connect subpaths & create fullpath
 
-                        if (!path.Connect(scene, s, t, direct, subpathL, subpathE))
-                        {
-                            continue;
-                        }
-
-                        #pragma endregion
+                Path path;
+                if (!path.Connect(scene, s, t, direct, subpathL, subpathE))
+                {
+                    return;
+                }
 
-                        // --------------------------------------------------------------------------------
+                #pragma endregion
 
-                        #pragma region Evaluate contribution
+                // --------------------------------------------------------------------------------
 
-                        const auto C = path.EvaluateContribution(mis_.get(), scene, s, direct) / path.SelectionPDF(s, direct);
-                        if (C.Black())
-                        {
-                            continue;
-                        }
+                #pragma region Evaluate contribution
 
-                        #pragma endregion
+                const auto C = path.EvaluateContribution(mis_.get(), scene, s, direct) / path.SelectionPDF(s, direct) / selectionProb;
+                if (C.Black())
+                {
+                    return;
+                }
 
-                        // --------------------------------------------------------------------------------
+                #pragma endregion
 
-                        #pragma region Accumulate to film
+                // --------------------------------------------------------------------------------
 
-                        film->Splat(path.RasterPosition(), C);
+                #pragma region Accumulate to film
 
-                        #if LM_BDPT_DEBUG
-                        {
-                            const auto Cstar = path.EvaluateUnweightContribution(scene, s, direct) / path.SelectionPDF(s, direct);
-                            std::unique_lock<std::mutex> lock(strategyFilmMutex);
-                            Strategy strategy{ s, t, d };
-                            if (strategyFilmMap.find(strategy) == strategyFilmMap.end())
-                            {
-                                strategyFilms1.push_back(ComponentFactory::Clone<Film>(film));
-                                strategyFilms2.push_back(ComponentFactory::Clone<Film>(film));
-                                strategyFilms1.back()->Clear();
-                                strategyFilms2.back()->Clear();
-                                strategyFilmMap[strategy] = strategyFilms1.size()-1;
-                            }
-                            strategyFilms1[strategyFilmMap[strategy]]->Splat(path.RasterPosition(), C);
-                            strategyFilms2[strategyFilmMap[strategy]]->Splat(path.RasterPosition(), Cstar);
-                        }
-                        #endif
+                film->Splat(path.RasterPosition(), C);
 
-                        #pragma endregion
+                #if LM_BDPT_DEBUG
+                {
+                    const auto Cstar = path.EvaluateUnweightContribution(scene, s, direct) / path.SelectionPDF(s, direct) / selectionProb;
+                    std::unique_lock<std::mutex> lock(strategyFilmMutex);
+                    Strategy strategy{ s, t, d };
+                    if (strategyFilmMap.find(strategy) == strategyFilmMap.end())
+                    {
+                        strategyFilms1.push_back(ComponentFactory::Clone<Film>(film));
+                        strategyFilms2.push_back(ComponentFactory::Clone<Film>(film));
+                        strategyFilms1.back()->Clear();
+                        strategyFilms2.back()->Clear();
+                        strategyFilmMap[strategy] = strategyFilms1.size()-1;
                     }
+                    strategyFilms1[strategyFilmMap[strategy]]->Splat(path.RasterPosition(), C);
+                    strategyFilms2[strategyFilmMap[strategy]]->Splat(path.RasterPosition(), Cstar);
                 }
-            }
+                #endif
+
+                #pragma endregion
+            });
 
             #pragma endregion
         });
@@ -0,0 +1,391 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/renderer.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/scene3.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/renderutils.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/sensor.h>
+#include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/subpathsampler.h>
+#include <lightmetrica/detail/vcmpath.h>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    Effective number of samples per eye subpath for each type of strategies.
+    Used to compute the MIS weights and to normalize the contributions.
+*/
+struct LVCSampleCounts
+{
+    Float lightTrace;       // Strategies with t=1 (connections to the sensor in light tracing phase)
+    Float connection;       // Strategies with s>0 and t>1 (connections to the cached light vertices)
+};
+
+namespace
+{
+    // Russian roulette probability for the unbounded path length (max_num_vertices = -1)
+    const Float RRProb = 0.5_f;
+
+    /*!
+        Sample a subpath. If the number of vertices is unbounded, the subpath is
+        terminated with Russian roulette from the third vertex, as in `renderer::bdpt`.
+    */
+    auto SampleSubpath(VCMSubpath& subpath, const Scene3* scene, Random* rng, TransportDirection transDir, int maxNumVertices) -> void
+    {
+        if (maxNumVertices != -1)
+        {
+            subpath.SampleSubpath(scene, rng, transDir, maxNumVertices);
+            return;
+        }
+
+        subpath.vertices.clear();
+        SubpathSampler::TraceSubpath(scene, rng, -1, transDir, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+        {
+            VCMPathVertex v_;
+            v_.type = v.type;
+            v_.geom = v.geom;
+            v_.primitive = v.primitive;
+            subpath.vertices.emplace_back(v_);
+            return numVertices < 2 || rng->Next() <= RRProb;
+        });
+    }
+
+    // Probability that the subpaths with s and t vertices survive the Russian roulette
+    auto SelectionProb(int s, int t, int maxNumVertices) -> Float
+    {
+        if (maxNumVertices != -1)
+        {
+            return 1_f;
+        }
+        Float prob = 1_f;
+        for (int i = 1; i < s - 1; i++) { prob *= RRProb; }
+        for (int i = 1; i < t - 1; i++) { prob *= RRProb; }
+        return prob;
+    }
+
+    auto SampleCount(int s, int t, const LVCSampleCounts& counts) -> Float
+    {
+        if (t == 0) { return 0_f; }
+        if (s == 0) { return 1_f; }
+        if (t == 1) { return counts.lightTrace; }
+        return counts.connection;
+    }
+
+    /*!
+        Power heuristic taking into account the effective number of samples of the strategies.
+        The returned weight is divided by the number of samples for the strategy s_,
+        so that the contribution can be directly accumulated.
+    */
+    auto EvaluateMISWeight_LVC(const VCMPath& path, const Scene3* scene, int s_, const LVCSampleCounts& counts) -> Float
+    {
+        const int n = static_cast<int>(path.vertices.size());
+        const auto ns = SampleCount(s_, n - s_, counts);
+        const auto ps = path.EvaluatePathPDF(scene, s_, false, 0_f);
+        assert(ps > 0_f);
+
+        Float invw = 0_f;
+        for (int s = 0; s <= n; s++)
+        {
+            const auto ns_ = SampleCount(s, n - s, counts);
+            if (ns_ == 0_f)
+            {
+                continue;
+            }
+            const auto pi = path.EvaluatePathPDF(scene, s, false, 0_f);
+            if (pi > 0_f)
+            {
+                const auto r = ns_ * pi.v / (ns * ps.v);
+                invw += r*r;
+            }
+        }
+
+        return 1_f / (invw * ns);
+    }
+}
+
+// --------------------------------------------------------------------------------
+
+/*!
+    \brief Bidirectional path tracing with light vertex cache.
+
+    Implements light vertex cache bidirectional path tracing [Davidovic et al. 2014].
+    In each iteration, the renderer first traces a pool of light subpaths in parallel
+    and connects them to the sensor (strategies with t=1).
+    The vertices of the light subpaths are stored in a shared vertex cache.
+    Then each vertex of eye subpaths is connected to `num_connections` vertices
+    randomly selected from the cache.
+    The MIS weights are computed with the effective number of samples for each strategy.
+    Similar to `renderer::bdpt`, `max_num_vertices = -1` means the unbounded path length,
+    where the subpaths are terminated with Russian roulette.
+
+    References:
+      - [Davidovic et al. 2014] Progressive light transport simulation on the GPU: Survey and improvements
+*/
+class Renderer_BDPT_LVC final : public Renderer
+{
+public:
+
+    LM_IMPL_CLASS(Renderer_BDPT_LVC, Renderer);
+
+private:
+
+    int maxNumVertices_;
+    int minNumVertices_;
+    long long numIterationPass_;
+    long long numLightTraceSamples_;
+    long long numEyeTraceSamples_;
+    int numConnections_;
+
+public:
+
+    LM_IMPL_F(Initialize) = [this](const PropertyNode* p) -> bool
+    {
+        maxNumVertices_       = p->ChildAs<int>("max_num_vertices", 10);
+        minNumVertices_       = p->ChildAs<int>("min_num_vertices", 0);
+        numIterationPass_     = p->ChildAs<long long>("num_iteration_pass", 100L);
+        numLightTraceSamples_ = p->ChildAs<long long>("num_light_trace_samples", 10000L);
+        numEyeTraceSamples_   = p->ChildAs<long long>("num_eye_trace_samples", 10000L);
+        numConnections_       = p->ChildAs<int>("num_connections", 3);
+        return true;
+    };
+
+    LM_IMPL_F(Render) = [this](const Scene* scene_, Random* initRng, const std::string& outputPath) -> void
+    {
+        const auto* scene = static_cast<const Scene3*>(scene_);
+        auto* film = static_cast<const Sensor*>(scene->GetSensor()->emitter)->GetFilm();
+
+        // --------------------------------------------------------------------------------
+
+        struct Context
+        {
+            Random rng;
+            Film::UniquePtr film{ nullptr, nullptr };
+            std::vector<VCMSubpath> subpathLs;
+        };
+        std::vector<Context> contexts(Parallel::GetNumThreads());
+        for (auto& ctx : contexts)
+        {
+            ctx.rng.SetSeed(initRng->NextUInt());
+            ctx.film = ComponentFactory::Clone<Film>(film);
+        }
+
+        // Index of a vertex in the light vertex cache
+        struct CacheIndex
+        {
+            int subpathIndex;
+            int vertexIndex;
+        };
+
+        // --------------------------------------------------------------------------------
+
+        for (long long pass = 0; pass < numIterationPass_; pass++)
+        {
+            LM_LOG_INFO("Pass " + std::to_string(pass));
+            LM_LOG_INDENTER();
+
+            for (auto& ctx : contexts)
+            {
+                ctx.film->Clear();
+                ctx.subpathLs.clear();
+            }
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Sample light subpaths
+            {
+                LM_LOG_INFO("Sampling light subpaths");
+                LM_LOG_INDENTER();
+                Parallel::For(numLightTraceSamples_, [&](long long index, int threadid, bool init)
+                {
+                    auto& ctx = contexts[threadid];
+                    ctx.subpathLs.emplace_back();
+                    SampleSubpath(ctx.subpathLs.back(), scene, &ctx.rng, TransportDirection::LE, maxNumVertices_);
+                });
+            }
+
+            std::vector<VCMSubpath> subpathLs;
+            for (auto& ctx : contexts)
+            {
+                std::move(ctx.subpathLs.begin(), ctx.subpathLs.end(), std::back_inserter(subpathLs));
+                ctx.subpathLs.clear();
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Construct light vertex cache
+            std::vector<CacheIndex> cache;
+            for (int i = 0; i < (int)(subpathLs.size()); i++)
+            {
+                const auto& subpathL = subpathLs[i];
+                for (int j = 0; j < (int)(subpathL.vertices.size()); j++)
+                {
+                    const auto& v = subpathL.vertices[j];
+                    if (!v.geom.infinite && !v.primitive->IsDeltaDirection(v.type))
+                    {
+                        cache.push_back({ i, j });
+                    }
+                }
+            }
+
+            LVCSampleCounts counts;
+            counts.lightTrace = (Float)(numLightTraceSamples_) / (Float)(numEyeTraceSamples_);
+            counts.connection = cache.empty() ? 0_f : (Float)(numConnections_) * (Float)(numLightTraceSamples_) / (Float)(cache.size());
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            const auto Splat = [&](Context& ctx, const VCMPath& fullpath, int s, const SPD& C) -> void
+            {
+                Vec2 rasterPos;
+                if (!fullpath.RasterPosition(rasterPos)) { return; }
+                const auto selectionProb = SelectionProb(s, (int)(fullpath.vertices.size()) - s, maxNumVertices_);
+                ctx.film->Splat(rasterPos, C * (Float)(film->Width() * film->Height()) / (Float)numEyeTraceSamples_ / selectionProb);
+            };
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Connect light subpaths to the sensor
+            {
+                LM_LOG_INFO("Connecting light subpaths to the sensor");
+                LM_LOG_INDENTER();
+                Parallel::For(subpathLs.size(), [&](long long index, int threadid, bool init)
+                {
+                    auto& ctx = contexts[threadid];
+                    const auto& subpathL = subpathLs[index];
+
+                    // Sample an endpoint on the sensor
+                    static thread_local VCMSubpath subpathE;
+                    subpathE.SampleSubpath(scene, &ctx.rng, TransportDirection::EL, 1);
+                    if (subpathE.vertices.empty()) { return; }
+
+                    const int nL = (int)(subpathL.vertices.size());
+                    const int minS = Math::Max(1, minNumVertices_ - 1);
+                    const int maxS = maxNumVertices_ == -1 ? nL : Math::Min(nL, maxNumVertices_ - 1);
+                    for (int s = minS; s <= maxS; s++)
+                    {
+                        static thread_local VCMPath fullpath;
+                        if (!fullpath.ConnectSubpaths(scene, subpathL, subpathE, s, 1)) { continue; }
+                        const auto f = fullpath.EvaluateF(s, false);
+                        if (f.Black()) { continue; }
+                        const auto p = fullpath.EvaluatePathPDF(scene, s, false, 0_f);
+                        if (p.v == 0) { continue; }
+                        const auto w = EvaluateMISWeight_LVC(fullpath, scene, s, counts);
+                        Splat(ctx, fullpath, s, f * w / p);
+                    }
+                });
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Trace eye subpaths and connect to cached light vertices
+            {
+                LM_LOG_INFO("Connecting eye subpaths to light vertex cache");
+                LM_LOG_INDENTER();
+                Parallel::For(numEyeTraceSamples_, [&](long long index, int threadid, bool init)
+                {
+                    auto& ctx = contexts[threadid];
+
+                    static thread_local VCMSubpath subpathE;
+                    static const VCMSubpath emptySubpath;
+                    SampleSubpath(subpathE, scene, &ctx.rng, TransportDirection::EL, maxNumVertices_);
+
+                    const int nE = (int)(subpathE.vertices.size());
+                    for (int t = 2; t <= nE; t++)
+                    {
+                        static thread_local VCMPath fullpath;
+
+                        #pragma region Hitting an emitter (s=0)
+                        if (minNumVertices_ <= t && (maxNumVertices_ == -1 || t <= maxNumVertices_))
+                        {
+                            if (fullpath.ConnectSubpaths(scene, emptySubpath, subpathE, 0, t))
+                            {
+                                const auto f = fullpath.EvaluateF(0, false);
+                                const auto p = f.Black() ? PDFVal(PDFMeasure::ProdArea, 0_f) : fullpath.EvaluatePathPDF(scene, 0, false, 0_f);
+                                if (p.v > 0)
+                                {
+                                    const auto w = EvaluateMISWeight_LVC(fullpath, scene, 0, counts);
+                                    Splat(ctx, fullpath, 0, f * w / p);
+                                }
+                            }
+                        }
+                        #pragma endregion
+
+                        // --------------------------------------------------------------------------------
+
+                        #pragma region Connections to randomly selected vertices in the cache
+                        if (cache.empty()) { continue; }
+                        for (int m = 0; m < numConnections_; m++)
+                        {
+                            const auto& ci = cache[Math::Min((size_t)(ctx.rng.Next() * cache.size()), cache.size() - 1)];
+                            const int s = ci.vertexIndex + 1;
+                            if (s + t < minNumVertices_ || (maxNumVertices_ != -1 && maxNumVertices_ < s + t)) { continue; }
+                            if (!fullpath.ConnectSubpaths(scene, subpathLs[ci.subpathIndex], subpathE, s, t)) { continue; }
+                            const auto f = fullpath.EvaluateF(s, false);
+                            if (f.Black()) { continue; }
+                            const auto p = fullpath.EvaluatePathPDF(scene, s, false, 0_f);
+                            if (p.v == 0) { continue; }
+                            const auto w = EvaluateMISWeight_LVC(fullpath, scene, s, counts);
+                            Splat(ctx, fullpath, s, f * w / p);
+                        }
+                        #pragma endregion
+                    }
+                });
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Accumulate to the film
+            film->Rescale((Float)(pass) / (1_f + pass));
+            for (auto& ctx : contexts)
+            {
+                ctx.film->Rescale(1_f / (1_f + pass));
+                film->Accumulate(ctx.film.get());
+            }
+            #pragma endregion
+        }
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save image
+        {
+            LM_LOG_INFO("Saving image");
+            LM_LOG_INDENTER();
+            film->Save(outputPath);
+        }
+        #pragma endregion
+    };
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Renderer_BDPT_LVC, "renderer::bdpt_lvc");
+
+LM_NAMESPACE_END
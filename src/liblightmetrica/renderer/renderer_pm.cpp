@@ -38,17 +38,27 @@
 #include <lightmetrica/detail/photonmap.h>
 #include <lightmetrica/detail/subpathsampler.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/hashgrid.h>
 
 LM_NAMESPACE_BEGIN
 
 /*!
     \brief Photon mapping renderer.
     Implements photon mapping.
+    With `num_nearest_photons` > 0, the density estimation adapts the radius
+    to the distance to the k-nearest photons, where `radius` is used as the maximum radius.
+    With `precompute_irradiance`, the irradiance is precomputed in parallel
+    at a subset of the photon positions (every `precompute_irradiance_interval`-th photon) [Christensen 1999]
+    and the final gather rays look up the nearest precomputed estimate on diffuse surfaces
+    instead of the full density estimation.
+    The precomputed estimates are shared by all the final gather rays of the render.
     References:
       - H. W. Jensen, Global illumination using photon maps,
         Procs. of the Eurographics Workshop on Rendering Techniques 96, pp.21-30, 1996.
       - H. W. Jensen, Realistic image synthesis using photon mapping,
         AK Peters, 2001
+      - P. H. Christensen, Faster photon map global illumination,
+        Journal of Graphics Tools, 4(3), pp.1-10, 1999.
 */
 class Renderer_PM final : public Renderer
 {
@@ -65,6 +75,9 @@ public:
         numPhotonTraceSamples_ = prop->ChildAs<long long>("num_photon_trace_samples", 100000L);
         finalgather_ = prop->ChildAs<int>("finalgather", 1);
         radius_ = prop->ChildAs<Float>("radius", 0.01_f);
+        numNearestPhotons_ = prop->ChildAs<int>("num_nearest_photons", 0);
+        precomputeIrradiance_ = prop->ChildAs<int>("precompute_irradiance", 0);
+        precomputeIrradianceInterval_ = Math::Max(1, prop->ChildAs<int>("precompute_irradiance_interval", 4));
         pm_ = ComponentFactory::Create<PhotonMap>("photonmap::" + prop->ChildAs<std::string>("photonmap", "kdtree"));
         return true;
     };
@@ -75,8 +88,19 @@ public:
 
         // --------------------------------------------------------------------------------
 
+        // Point for the precomputed irradiance
+        struct IrradiancePoint
+        {
+            Vec3 p;     // Position
+            Vec3 n;     // Normal oriented to the side of the incident photon
+            SPD E;      // Precomputed irradiance
+        };
+
+        // --------------------------------------------------------------------------------
+
         #pragma region Trace photons
-        std::vector<Photon> photons;
+        std::vector<CompactPhoton> photons;
+        std::vector<IrradiancePoint> irrPoints;
         {
             LM_LOG_INFO("Tracing photons");
             LM_LOG_INDENTER();
@@ -84,7 +108,8 @@ public:
             struct Context
             {
                 Random rng;
-                std::vector<Photon> photons;
+                std::vector<CompactPhoton> photons;
+                std::vector<IrradiancePoint> irrPoints;
             };
             std::vector<Context> contexts(Parallel::GetNumThreads());
             for (auto& ctx : contexts)
@@ -105,7 +130,11 @@ public:
                         photon.throughput = throughput;
                         photon.wi = Math::Normalize(pv.geom.p - v.geom.p);
                         photon.numVertices = numVertices;
-                        ctx.photons.push_back(photon);
+                        if (precomputeIrradiance_ && ctx.photons.size() % precomputeIrradianceInterval_ == 0)
+                        {
+                            ctx.irrPoints.push_back({ v.geom.p, Math::Dot(v.geom.gn, photon.wi) < 0_f ? -v.geom.gn : v.geom.gn, SPD() });
+                        }
+                        ctx.photons.push_back(CompactPhoton::Pack(photon));
                     }
 
                     // Path termination
@@ -126,6 +155,7 @@ public:
             for (auto& ctx : contexts)
             {
                 photons.insert(photons.end(), ctx.photons.begin(), ctx.photons.end());
+                irrPoints.insert(irrPoints.end(), ctx.irrPoints.begin(), ctx.irrPoints.end());
             }
         }
         #pragma endregion
@@ -136,12 +166,48 @@ public:
         {
             LM_LOG_INFO("Building photon map");
             LM_LOG_INDENTER();
+            pm_->SetMaxQueryRadius(radius_);
             pm_->Build(std::move(photons));
         }
         #pragma endregion
 
         // --------------------------------------------------------------------------------
 
+        #pragma region Precompute irradiance
+        HashGrid irrGrid;
+        if (precomputeIrradiance_)
+        {
+            LM_LOG_INFO("Precomputing irradiance");
+            LM_LOG_INDENTER();
+            LM_LOG_INFO("Number of points: " + std::to_string(irrPoints.size()));
+
+            // Irradiance estimate from the photons incident to the same side of the surface
+            Parallel::For(irrPoints.size(), [&](long long index, int threadid, bool init)
+            {
+                auto& ip = irrPoints[index];
+                pm_->CollectPhotons(ip.p, radius_, [&](const Photon& photon) -> void
+                {
+                    if (Math::Dot(photon.wi, ip.n) > 0_f)
+                    {
+                        ip.E += photon.throughput;
+                    }
+                });
+                ip.E /= Math::Pi() * radius_ * radius_ * numPhotonTraceSamples_;
+            });
+
+            // Sort the points by the grid cells for the nearest point queries
+            irrGrid.Build((int)(irrPoints.size()), radius_ * 2_f, [&](int i) -> const Vec3& { return irrPoints[i].p; });
+            std::vector<IrradiancePoint> sortedIrrPoints(irrPoints.size());
+            for (size_t i = 0; i < irrPoints.size(); i++)
+            {
+                sortedIrrPoints[i] = irrPoints[irrGrid.SortedIndices()[i]];
+            }
+            irrPoints.swap(sortedIrrPoints);
+        }
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
         #pragma region Trace eye rays
         auto* film_ = static_cast<const Sensor*>(scene->GetSensor()->emitter)->GetFilm();
         sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
@@ -171,24 +237,70 @@ public:
                 {
                     if (gatherNext)
                     {
+                        // Lookup of the nearest precomputed irradiance facing to the same direction.
+                        // Only for diffuse surfaces; glossy ones fall through to the BSDF-weighted gather.
+                        if (precomputeIrradiance_ && v.type == SurfaceInteractionType::D && v.primitive->bsdf && v.primitive->bsdf->Reflectance2.Implemented())
+                        {
+                            const auto wo = Math::Normalize(pv.geom.p - v.geom.p);
+                            const auto n = Math::Dot(v.geom.gn, wo) < 0_f ? -v.geom.gn : v.geom.gn;
+                            const IrradiancePoint* nearest = nullptr;
+                            Float minDist2 = radius_ * radius_;
+                            irrGrid.Query(v.geom.p, radius_, [&](int begin, int end) -> void
+                            {
+                                for (int i = begin; i < end; i++)
+                                {
+                                    const auto& ip = irrPoints[i];
+                                    const auto dist2 = Math::Length2(ip.p - v.geom.p);
+                                    if (dist2 < minDist2 && Math::Dot(ip.n, n) > 0.9_f)
+                                    {
+                                        minDist2 = dist2;
+                                        nearest = &ip;
+                                    }
+                                }
+                            });
+                            if (nearest)
+                            {
+                                const auto C = throughput * v.primitive->bsdf->Reflectance2(v.geom) * Math::InvPi() * nearest->E;
+                                film->Splat(rasterPos, C);
+                                return false;
+                            }
+                        }
+
                         // Density estimation
                         const auto Kernel = [](const Vec3& p, const Photon& photon, Float radius)
                         {
                             auto s = 1_f - Math::Length2(photon.p - p) / radius / radius;
                             return 3_f * Math::InvPi() * s * s;
                         };
-                        pm_->CollectPhotons(v.geom.p, radius_, [&](const Photon& photon) -> void
+                        const auto Accumulate = [&](const Photon& photon, Float radius) -> void
                         {
                             if (numVertices + photon.numVertices - 1 > maxNumVertices_)
                             {
                                 return;
                             }
-                            auto k = Kernel(v.geom.p, photon, radius_);
-                            auto p = k / (radius_ * radius_ * numPhotonTraceSamples_);
+                            auto k = Kernel(v.geom.p, photon, radius);
+                            auto p = k / (radius * radius * numPhotonTraceSamples_);
                             const auto f = v.primitive->EvaluateDirection(v.geom, SurfaceInteractionType::BSDF, Math::Normalize(pv.geom.p - v.geom.p), photon.wi, TransportDirection::EL, true);
                             const auto C = throughput * p * f * photon.throughput;
                             film->Splat(rasterPos, C);
-                        });
+                        };
+                        if (numNearestPhotons_ > 0)
+                        {
+                            // Adaptive radius from the k-nearest photons within the maximum radius
+                            static thread_local std::vector<Photon> collected;
+                            const auto radius = pm_->CollectKNearestPhotons(v.geom.p, numNearestPhotons_, radius_, collected);
+                            for (const auto& photon : collected)
+                            {
+                                Accumulate(photon, radius);
+                            }
+                        }
+                        else
+                        {
+                            pm_->CollectPhotons(v.geom.p, radius_, [&](const Photon& photon) -> void
+                            {
+                                Accumulate(photon, radius_);
+                            });
+                        }
 
                         #pragma endregion
 
@@ -222,6 +334,9 @@ private:
     long long numPhotonTraceSamples_;
     int finalgather_;
     Float radius_;
+    int numNearestPhotons_;
+    int precomputeIrradiance_;
+    int precomputeIrradianceInterval_;
     Scheduler::UniquePtr sched_ = ComponentFactory::Create<Scheduler>();
     PhotonMap::UniquePtr pm_{ nullptr, nullptr };
 
@@ -40,18 +40,22 @@
 #include <lightmetrica/detail/photonmap.h>
 #include <lightmetrica/detail/subpathsampler.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/passscheduler.h>
+#include <lightmetrica/detail/hashgrid.h>
+#include <lightmetrica/detail/emissionguide.h>
 #include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
-#define LM_PPM_DEBUG 1
-
 /*!
     \brief Progressive photon mapping renderer.
 
     Implements progressive photon mapping [Hachisuka et al. 2008]
+    With `emission_guide = 1`, the photon emission is guided toward the measurement points
+    with `EmissionGuide` in the spirit of [Hachisuka & Jensen 2011].
     References:
       - [Hachisuka et al. 2008] Progressive photon mapping
+      - [Hachisuka & Jensen 2011] Robust adaptive photon tracing using photon path visibility
 */
 class Renderer_PPM final : public Renderer
 {
@@ -63,14 +67,11 @@ private:
 
     int maxNumVertices_;
     long long numSamples_;                                // Number of measurement points
-    long long numIterationPass_;                          // Number of photon scattering passes
-    long long numPhotonTraceSamples_;                     // Number of photon trace samples for each pass
+    PassScheduler passSched_;                             // Controls photon scattering passes
+    EmissionGuide emissionGuide_;                         // Adaptive importance for the photon emission
     Float initialRadius_;                                 // Initial photon gather radius
     Float alpha_;                                         // Fraction to control photons (see paper)
     PhotonMap::UniquePtr photonmap_{ nullptr, nullptr };  // Underlying photon map implementation
-    #if LM_PPM_DEBUG
-    std::string debugOutputPath_;
-    #endif
 
 public:
 
@@ -78,14 +79,11 @@ public:
     {
         maxNumVertices_        = prop->Child("max_num_vertices")->As<int>();
         numSamples_            = prop->ChildAs<long long>("num_samples", 100000L);
-        numIterationPass_         = prop->ChildAs<long long>("num_iteration_pass", 1000L);
-        numPhotonTraceSamples_ = prop->ChildAs<long long>("num_photon_trace_samples", 100L);
+        passSched_.Load(prop, 1000L, 100L);
+        emissionGuide_.Load(prop);
         initialRadius_         = prop->ChildAs<Float>("initial_radius", 0.1_f);
         alpha_                 = prop->ChildAs<Float>("alpha", 0.7_f);
         photonmap_             = ComponentFactory::Create<PhotonMap>("photonmap::" + prop->ChildAs<std::string>("photonmap", "kdtree"));
-        #if LM_PPM_DEBUG
-        debugOutputPath_       = prop->ChildAs<std::string>("debug_output_path", "ppm_%05d");
-        #endif
         return true;
     };
 
@@ -178,15 +176,62 @@ public:
 
         #pragma region Photon scattering pass
         long long totalPhotonTraceSamples = 0;
-        for (long long pass = 0; pass < numIterationPass_; pass++)
+        passSched_.Start();
+        if (emissionGuide_.Enabled())
+        {
+            emissionGuide_.Start();
+        }
+        while (passSched_.BeginPass())
         {
+            const auto pass = passSched_.Pass();
+            const auto numPhotonTraceSamples = passSched_.NumPhotonTraceSamples();
             LM_LOG_INFO("Pass " + std::to_string(pass));
             LM_LOG_INDENTER();
 
             // --------------------------------------------------------------------------------
 
+            #pragma region Build grid of measurement points
+            // The grid is utilized for the visibility test of the emission guide
+            HashGrid grid;
+            std::vector<int> sortedMps;
+            Float maxRadius = 0_f;
+            for (const auto& mp : mps)
+            {
+                maxRadius = Math::Max(maxRadius, mp.radius);
+            }
+            if (emissionGuide_.Enabled())
+            {
+                LM_LOG_INFO("Building grid of measurement points");
+                LM_LOG_INDENTER();
+                grid.Build((int)(mps.size()), maxRadius * 2_f, [&](int i) -> const Vec3& { return mps[i].v.geom.p; });
+                sortedMps.assign(grid.SortedIndices().begin(), grid.SortedIndices().end());
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Visibility to measurement points for emission guide
+            // True if the photon at the vertex contributes to any measurement point
+            const auto VisibleToMeasurementPoints = [&](const Vec3& p, int numVertices) -> bool
+            {
+                bool visible = false;
+                grid.Query(p, maxRadius, [&](int begin, int end) -> void
+                {
+                    for (int i = begin; i < end && !visible; i++)
+                    {
+                        const auto& mp = mps[sortedMps[i]];
+                        visible = Math::Length2(mp.v.geom.p - p) < mp.radius * mp.radius && mp.numVertices + numVertices - 1 <= maxNumVertices_;
+                    }
+                });
+                return visible;
+            };
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
             #pragma region Trace photons
-            std::vector<Photon> photons;
+            const auto photonStartTime = std::chrono::high_resolution_clock::now();
+            std::vector<CompactPhoton> photons;
             {
                 LM_LOG_INFO("Tracing photons");
                 LM_LOG_INDENTER();
@@ -194,7 +239,7 @@ public:
                 struct Context
                 {
                     Random rng;
-                    std::vector<Photon> photons;
+                    std::vector<CompactPhoton> photons;
                 };
                 std::vector<Context> contexts(Parallel::GetNumThreads());
                 for (auto& ctx : contexts)
@@ -202,10 +247,10 @@ public:
                     ctx.rng.SetSeed(initRng->NextUInt());
                 }
 
-                Parallel::For(numPhotonTraceSamples_, [&](long long index, int threadid, bool init)
+                Parallel::For(numPhotonTraceSamples, [&](long long index, int threadid, bool init)
                 {
                     auto& ctx = contexts[threadid];
-                    SubpathSampler::TraceSubpath(scene, &ctx.rng, maxNumVertices_, TransportDirection::LE, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+                    emissionGuide_.TracePhoton(scene, &ctx.rng, threadid, maxNumVertices_, VisibleToMeasurementPoints, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
                     {
                         // Skip initial vertex
                         if (numVertices == 1)
@@ -221,7 +266,7 @@ public:
                             photon.throughput = throughput;
                             photon.wi = Math::Normalize(pv.geom.p - v.geom.p);
                             photon.numVertices = numVertices;
-                            ctx.photons.push_back(photon);
+                            ctx.photons.push_back(CompactPhoton::Pack(photon));
                         }
 
                         // Path termination
@@ -244,7 +289,7 @@ public:
                     photons.insert(photons.end(), ctx.photons.begin(), ctx.photons.end());
                 }
 
-                totalPhotonTraceSamples += numPhotonTraceSamples_;
+                totalPhotonTraceSamples += numPhotonTraceSamples;
             }
             #pragma endregion
 
@@ -254,8 +299,12 @@ public:
             {
                 LM_LOG_INFO("Building photon map");
                 LM_LOG_INDENTER();
+
+                photonmap_->SetMaxQueryRadius(maxRadius);
+
                 photonmap_->Build(std::move(photons));
             }
+            const auto photonTime = PassScheduler::Elapsed(photonStartTime);
             #pragma endregion
             
             // --------------------------------------------------------------------------------
@@ -274,15 +323,19 @@ public:
                     // Accumulate tau 
                     SPD deltaTau;
                     Float M = 0_f;
-                    photonmap_->CollectPhotons(mp.v.geom.p, mp.radius, [&](const Photon& photon) -> void
+                    photonmap_->CollectPhotonsBatch(mp.v.geom.p, mp.radius, [&](const Photon* photons, int numPhotons) -> void
                     {
-                        if (mp.numVertices + photon.numVertices - 1 > maxNumVertices_)
+                        for (int i = 0; i < numPhotons; i++)
                         {
-                            return;
+                            const auto& photon = photons[i];
+                            if (mp.numVertices + photon.numVertices - 1 > maxNumVertices_)
+                            {
+                                continue;
+                            }
+                            const auto f = mp.v.primitive->EvaluateDirection(mp.v.geom, SurfaceInteractionType::BSDF, mp.wi, photon.wi, TransportDirection::EL, true);
+                            deltaTau += f * photon.throughput;
+                            M += 1_f;
                         }
-                        const auto f = mp.v.primitive->EvaluateDirection(mp.v.geom, SurfaceInteractionType::BSDF, mp.wi, photon.wi, TransportDirection::EL, true);
-                        deltaTau += f * photon.throughput;
-                        M += 1_f;
                     });
 
                     // Update information in the measreument point
@@ -307,15 +360,22 @@ public:
                     film->Splat(mp.rasterPos, C);
                 }
                 film->Rescale((Float)(film->Width() * film->Height()) / numSamples_);
-                #if LM_PPM_DEBUG
-                {
-                    boost::format f(debugOutputPath_);
-                    f.exceptions(boost::io::all_error_bits ^ (boost::io::too_many_args_bit | boost::io::too_few_args_bit));
-                    film->Save(boost::str(f % pass));
-                }
-                #endif
             }
             #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Update emission guide
+            if (emissionGuide_.Enabled())
+            {
+                emissionGuide_.Update();
+            }
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            passSched_.EndPass(photonTime);
+            passSched_.SaveProgress(film);
         }
         #pragma endregion
 
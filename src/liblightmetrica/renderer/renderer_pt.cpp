@@ -36,6 +36,7 @@
 #include <lightmetrica/surfacegeometry.h>
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/scheduler.h>
+#include <lightmetrica/detail/irradiancecache.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -50,12 +51,14 @@ private:
     int maxNumVertices_;
     int minNumVertices_;
     Scheduler::UniquePtr sched_ = ComponentFactory::Create<Scheduler>();
+    IrradianceCache irrCache_;
 
 public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
         sched_->Load(prop);
+        irrCache_.Load(prop);
         maxNumVertices_ = prop->ChildAs("max_num_vertices", -1);
         minNumVertices_ = prop->ChildAs("min_num_vertices", 0);
         return true;
@@ -65,6 +68,10 @@ public:
     {
         const auto* scene = static_cast<const Scene3*>(scene_);
         auto* film_ = static_cast<const Sensor*>(scene->GetSensor()->emitter)->GetFilm();
+        if (irrCache_.Enabled())
+        {
+            irrCache_.Start(scene->GetBound(), true);
+        }
         sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
         {
             #pragma region Sample a sensor
@@ -124,6 +131,21 @@ public:
 
                 // --------------------------------------------------------------------------------
 
+                #pragma region Irradiance cache
+
+                // The outgoing radiance from the second diffuse bounce is approximated with the cached irradiance
+                if (irrCache_.Enabled() && numVertices == 3 && type == SurfaceInteractionType::D && primitive->bsdf->Reflectance2.Implemented())
+                {
+                    const auto n = Math::Dot(geom.sn, wi) < 0_f ? -geom.sn : geom.sn;
+                    const auto E = irrCache_.Irradiance(scene, rng, geom.p, n, maxNumVertices_ == -1 ? -1 : maxNumVertices_ - 2);
+                    film->Splat(rasterPos, throughput * primitive->bsdf->Reflectance2(geom) * Math::InvPi() * E);
+                    break;
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
                 #pragma region Sample direction
 
                 Vec3 wo;
@@ -232,6 +254,13 @@ public:
 
         // --------------------------------------------------------------------------------
 
+        if (irrCache_.Enabled())
+        {
+            irrCache_.Finish();
+        }
+
+        // --------------------------------------------------------------------------------
+
         #pragma region Save image
         {
             LM_LOG_INFO("Saving image");
@@ -0,0 +1,894 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/renderer.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/scene3.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/bsdf.h>
+#include <lightmetrica/ray.h>
+#include <lightmetrica/intersection.h>
+#include <lightmetrica/emitter.h>
+#include <lightmetrica/sensor.h>
+#include <lightmetrica/surfacegeometry.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/passscheduler.h>
+#include <atomic>
+#include <array>
+
+LM_NAMESPACE_BEGIN
+
+namespace
+{
+    auto AtomicAdd(std::atomic<Float>& dest, Float v) -> void
+    {
+        auto current = dest.load(std::memory_order_relaxed);
+        while (!dest.compare_exchange_weak(current, current + v, std::memory_order_relaxed)) {}
+    }
+
+    //! Maps a direction to the canonical coordinates ((cos(theta)+1)/2, phi/2pi) in [0,1]^2.
+    auto DirectionToCanonical(const Vec3& d) -> Vec2
+    {
+        const auto cosTheta = Math::Clamp(d.z, -1_f, 1_f);
+        auto phi = std::atan2(d.y, d.x);
+        if (phi < 0_f) phi += 2_f * Math::Pi();
+        return Vec2(
+            Math::Clamp((cosTheta + 1_f) * 0.5_f, 0_f, 1_f),
+            Math::Clamp(phi / (2_f * Math::Pi()), 0_f, 1_f));
+    }
+
+    auto CanonicalToDirection(const Vec2& u) -> Vec3
+    {
+        const auto cosTheta = 2_f * u.x - 1_f;
+        const auto sinTheta = Math::Sqrt(Math::Max(0_f, 1_f - cosTheta * cosTheta));
+        const auto phi = 2_f * Math::Pi() * u.y;
+        return Vec3(sinTheta * Math::Cos(phi), sinTheta * Math::Sin(phi), cosTheta);
+    }
+}
+
+// --------------------------------------------------------------------------------
+
+#pragma region Directional tree
+
+/*!
+    \brief Directional quadtree.
+
+    Piecewise-constant distribution of the incident radiance
+    over the canonical coordinates of the sphere of directions.
+    Each node keeps the sums of the recorded values of its four children.
+    The structure of the tree is fixed during a training iteration,
+    so that the values can be recorded concurrently with atomic operations.
+*/
+class GuidingDTree
+{
+private:
+
+    struct Node
+    {
+        std::array<std::atomic<Float>, 4> sums;
+        std::array<int, 4> children;                    // 0 for leaf
+
+        Node()
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                sums[i].store(0_f, std::memory_order_relaxed);
+                children[i] = 0;
+            }
+        }
+
+        Node(const Node& o)
+        {
+            *this = o;
+        }
+
+        auto operator=(const Node& o) -> Node&
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                sums[i].store(o.Sum(i), std::memory_order_relaxed);
+                children[i] = o.children[i];
+            }
+            return *this;
+        }
+
+        auto Sum(int i) const -> Float { return sums[i].load(std::memory_order_relaxed); }
+        auto Total() const -> Float { return Sum(0) + Sum(1) + Sum(2) + Sum(3); }
+        auto IsLeaf(int i) const -> bool { return children[i] == 0; }
+    };
+
+public:
+
+    GuidingDTree()
+    {
+        nodes_.emplace_back();
+        sum_.store(0_f, std::memory_order_relaxed);
+        statisticalWeight_.store(0_f, std::memory_order_relaxed);
+    }
+
+    GuidingDTree(const GuidingDTree& o)
+        : nodes_(o.nodes_)
+    {
+        sum_.store(o.Sum(), std::memory_order_relaxed);
+        statisticalWeight_.store(o.StatisticalWeight(), std::memory_order_relaxed);
+    }
+
+    auto operator=(const GuidingDTree& o) -> GuidingDTree&
+    {
+        nodes_ = o.nodes_;
+        sum_.store(o.Sum(), std::memory_order_relaxed);
+        statisticalWeight_.store(o.StatisticalWeight(), std::memory_order_relaxed);
+        return *this;
+    }
+
+public:
+
+    auto Sum() const -> Float { return sum_.load(std::memory_order_relaxed); }
+    auto StatisticalWeight() const -> Float { return statisticalWeight_.load(std::memory_order_relaxed); }
+    auto SetStatisticalWeight(Float w) -> void { statisticalWeight_.store(w, std::memory_order_relaxed); }
+    auto NumNodes() const -> size_t { return nodes_.size(); }
+
+public:
+
+    //! Record a value to the leaf containing the canonical coordinates `u`.
+    auto Record(Vec2 u, Float value) -> void
+    {
+        AtomicAdd(statisticalWeight_, 1_f);
+        if (!(value > 0_f) || !std::isfinite(value))
+        {
+            return;
+        }
+        AtomicAdd(sum_, value);
+        int index = 0;
+        while (true)
+        {
+            auto& node = nodes_[index];
+            const int i = ChildIndex(u);
+            AtomicAdd(node.sums[i], value);
+            if (node.IsLeaf(i))
+            {
+                break;
+            }
+            index = node.children[i];
+        }
+    }
+
+    //! Sample canonical coordinates proportional to the recorded values.
+    auto Sample(Vec2 u) const -> Vec2
+    {
+        Vec2 origin(0_f);
+        Float scale = 1_f;
+        int index = 0;
+        while (true)
+        {
+            const auto& node = nodes_[index];
+            const auto total = node.Total();
+            if (total <= 0_f)
+            {
+                return origin + u * scale;
+            }
+
+            // Select the column and then the row of the quadrant
+            int i = 0;
+            const auto left = node.Sum(0) + node.Sum(2);
+            const auto probLeft = left / total;
+            if (u.x < probLeft)
+            {
+                u.x = Math::Min(u.x / probLeft, 1_f - Math::Eps());
+            }
+            else
+            {
+                u.x = Math::Min((u.x - probLeft) / (1_f - probLeft), 1_f - Math::Eps());
+                i |= 1;
+            }
+            const auto columnSum = node.Sum(i) + node.Sum(i | 2);
+            const auto probBottom = node.Sum(i) / columnSum;
+            if (u.y < probBottom)
+            {
+                u.y = Math::Min(u.y / probBottom, 1_f - Math::Eps());
+            }
+            else
+            {
+                u.y = Math::Min((u.y - probBottom) / (1_f - probBottom), 1_f - Math::Eps());
+                i |= 2;
+            }
+
+            scale *= 0.5_f;
+            origin = origin + Vec2((Float)(i & 1), (Float)(i >> 1)) * scale;
+            if (node.IsLeaf(i))
+            {
+                return origin + u * scale;
+            }
+            index = node.children[i];
+        }
+    }
+
+    //! Evaluate PDF of the canonical coordinates.
+    auto Pdf(Vec2 u) const -> Float
+    {
+        Float pdf = 1_f;
+        int index = 0;
+        while (true)
+        {
+            const auto& node = nodes_[index];
+            const auto total = node.Total();
+            if (total <= 0_f)
+            {
+                return pdf;
+            }
+            const int i = ChildIndex(u);
+            pdf *= 4_f * node.Sum(i) / total;
+            if (pdf <= 0_f || node.IsLeaf(i))
+            {
+                return pdf;
+            }
+            index = node.children[i];
+        }
+    }
+
+    /*!
+        \brief Rebuild the structure from the recorded values of `prev`.
+        Nodes holding more than `threshold` of the total energy are subdivided.
+        The recorded values and the statistical weight are reset.
+    */
+    auto Refine(const GuidingDTree& prev, Float threshold, int maxDepth) -> void
+    {
+        nodes_.clear();
+        nodes_.emplace_back();
+        sum_.store(0_f, std::memory_order_relaxed);
+        statisticalWeight_.store(0_f, std::memory_order_relaxed);
+
+        const auto total = prev.Sum();
+        if (total <= 0_f)
+        {
+            return;
+        }
+
+        struct Entry
+        {
+            int index;              // Index of the node in this tree
+            int prevIndex;          // Index of the corresponding node in `prev`, -1 if the node was a leaf
+            Float sum;              // Energy of the node
+            int depth;
+        };
+        std::vector<Entry> stack;
+        stack.push_back({ 0, 0, total, 1 });
+        while (!stack.empty())
+        {
+            const auto e = stack.back();
+            stack.pop_back();
+            for (int i = 0; i < 4; i++)
+            {
+                // Energy of the subdivided leaf is assumed to be uniformly distributed
+                const auto childSum = e.prevIndex >= 0 ? prev.nodes_[e.prevIndex].Sum(i) : e.sum * 0.25_f;
+                if (e.depth >= maxDepth || childSum / total <= threshold)
+                {
+                    continue;
+                }
+                const int childIndex = (int)(nodes_.size());
+                nodes_.emplace_back();
+                nodes_[e.index].children[i] = childIndex;
+                const int prevChildIndex = e.prevIndex >= 0 && !prev.nodes_[e.prevIndex].IsLeaf(i) ? prev.nodes_[e.prevIndex].children[i] : -1;
+                stack.push_back({ childIndex, prevChildIndex, childSum, e.depth + 1 });
+            }
+        }
+    }
+
+private:
+
+    //! Index of the child containing `u`, and maps `u` to the local coordinates of the child.
+    static auto ChildIndex(Vec2& u) -> int
+    {
+        int i = 0;
+        for (int axis = 0; axis < 2; axis++)
+        {
+            if (u[axis] < 0.5_f)
+            {
+                u[axis] *= 2_f;
+            }
+            else
+            {
+                u[axis] = (u[axis] - 0.5_f) * 2_f;
+                i |= 1 << axis;
+            }
+        }
+        return i;
+    }
+
+private:
+
+    std::vector<Node> nodes_;
+    std::atomic<Float> sum_;
+    std::atomic<Float> statisticalWeight_;
+
+};
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region Spatial tree
+
+/*!
+    \brief Spatial binary tree.
+
+    Subdivides the cubified scene bound with alternating axes.
+    Each leaf keeps a directional tree used for sampling (learned in the previous iteration)
+    and one for recording (being learned in the current iteration).
+*/
+class GuidingSTree
+{
+public:
+
+    struct DTreePair
+    {
+        GuidingDTree sampling;
+        GuidingDTree building;
+    };
+
+private:
+
+    struct Node
+    {
+        int axis;
+        std::array<int, 2> children;                    // 0 for leaf
+        int dtree;                                      // Index of the directional trees for leaf
+        auto IsLeaf() const -> bool { return children[0] == 0; }
+    };
+
+public:
+
+    auto Initialize(const Bound& bound) -> void
+    {
+        // Cubify the bound
+        const auto center = (bound.min + bound.max) * 0.5_f;
+        const auto size = bound.max - bound.min;
+        const auto halfExtent = Math::Max(Math::Max(size.x, size.y), size.z) * 0.5_f * (1_f + Math::EpsLarge()) + Math::Eps();
+        min_ = center - Vec3(halfExtent);
+        extent_ = 2_f * halfExtent;
+
+        nodes_.clear();
+        dtrees_.clear();
+        nodes_.push_back({ 0, {{ 0, 0 }}, 0 });
+        dtrees_.emplace_back();
+    }
+
+    //! Find the directional trees containing the point `p`. Read-only during an iteration.
+    auto Find(const Vec3& p) -> DTreePair*
+    {
+        auto u = (p - min_) / extent_;
+        int index = 0;
+        while (!nodes_[index].IsLeaf())
+        {
+            const auto& node = nodes_[index];
+            const int axis = node.axis;
+            if (u[axis] < 0.5_f)
+            {
+                u[axis] *= 2_f;
+                index = node.children[0];
+            }
+            else
+            {
+                u[axis] = (u[axis] - 0.5_f) * 2_f;
+                index = node.children[1];
+            }
+        }
+        return &dtrees_[nodes_[index].dtree];
+    }
+
+    /*!
+        \brief Update the trees after a training iteration.
+        The distributions recorded in the iteration become the sampling distributions.
+        The leaves with the statistical weight larger than `spatialThreshold`
+        are subdivided and the directional trees are refined for the next iteration.
+    */
+    auto Refine(Float spatialThreshold, Float directionalThreshold, int maxDTreeDepth) -> void
+    {
+        for (auto& dtree : dtrees_)
+        {
+            dtree.sampling = dtree.building;
+        }
+
+        #pragma region Spatial subdivision
+        std::vector<int> stack;
+        stack.push_back(0);
+        while (!stack.empty())
+        {
+            const int index = stack.back();
+            stack.pop_back();
+            if (!nodes_[index].IsLeaf())
+            {
+                stack.push_back(nodes_[index].children[0]);
+                stack.push_back(nodes_[index].children[1]);
+                continue;
+            }
+
+            const auto weight = dtrees_[nodes_[index].dtree].sampling.StatisticalWeight();
+            if (weight <= spatialThreshold)
+            {
+                continue;
+            }
+
+            // Split the leaf, both children inherit the directional trees with the half of the weight
+            const int dtreeIndex = nodes_[index].dtree;
+            dtrees_[dtreeIndex].sampling.SetStatisticalWeight(weight * 0.5_f);
+            dtrees_.push_back(dtrees_[dtreeIndex]);
+            const int childAxis = (nodes_[index].axis + 1) % 3;
+            const int child1 = (int)(nodes_.size());
+            const int child2 = child1 + 1;
+            nodes_.push_back({ childAxis, {{ 0, 0 }}, dtreeIndex });
+            nodes_.push_back({ childAxis, {{ 0, 0 }}, (int)(dtrees_.size()) - 1 });
+            nodes_[index].children = {{ child1, child2 }};
+            stack.push_back(child1);
+            stack.push_back(child2);
+        }
+        #pragma endregion
+
+        #pragma region Directional refinement
+        Parallel::For(dtrees_.size(), [&](long long index, int threadid, bool init)
+        {
+            auto& dtree = dtrees_[index];
+            dtree.building.Refine(dtree.sampling, directionalThreshold, maxDTreeDepth);
+        });
+        #pragma endregion
+    }
+
+    auto NumLeaves() const -> size_t { return dtrees_.size(); }
+
+    auto AverageNumDTreeNodes() const -> double
+    {
+        size_t sum = 0;
+        for (const auto& dtree : dtrees_) sum += dtree.building.NumNodes();
+        return (double)(sum) / dtrees_.size();
+    }
+
+private:
+
+    Vec3 min_;
+    Float extent_;
+    std::vector<Node> nodes_;
+    std::vector<DTreePair> dtrees_;
+
+};
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+/*!
+    \brief Path tracing with path guiding.
+
+    Path tracer sampling the directions from a mixture of the BSDF
+    and the incident radiance distribution learned in the previous iterations.
+    The distribution is represented by the spatial-directional tree (SD-tree)
+    of Müller et al. [2017] "Practical path guiding for efficient light-transport simulation".
+    The number of samples is doubled in each training iteration,
+    and only the last iteration contributes to the final image.
+*/
+class Renderer_PT_Guided final : public Renderer
+{
+public:
+
+    LM_IMPL_CLASS(Renderer_PT_Guided, Renderer);
+
+private:
+
+    int maxNumVertices_;
+    int minNumVertices_;
+    long long numSamples_;                      // Number of samples in the final iteration
+    double renderTime_;                         // Total render time including training
+    int numTrainingIterations_;                 // Maximum number of training iterations
+    long long numTrainingSamples_;              // Number of samples in the first training iteration
+    double trainingTimeFraction_;               // Maximum fraction of the render time used for training
+    Float bsdfSamplingFraction_;                // Probability of sampling the BSDF
+    Float spatialThreshold_;                    // Spatial subdivision threshold
+    Float directionalThreshold_;                // Directional subdivision threshold (fraction of energy)
+    int maxDTreeDepth_;                         // Maximum depth of the directional trees
+
+public:
+
+    LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
+    {
+        maxNumVertices_ = prop->ChildAs("max_num_vertices", -1);
+        minNumVertices_ = prop->ChildAs("min_num_vertices", 0);
+        numSamples_ = prop->ChildAs<long long>("num_samples", 10000000L);
+        renderTime_ = prop->ChildAs<double>("render_time", -1);
+        numTrainingIterations_ = prop->ChildAs("num_training_iterations", 6);
+        numTrainingSamples_ = prop->ChildAs<long long>("num_training_samples", -1);
+        trainingTimeFraction_ = prop->ChildAs<double>("training_time_fraction", 0.25);
+        bsdfSamplingFraction_ = prop->ChildAs<Float>("bsdf_sampling_fraction", 0.5_f);
+        spatialThreshold_ = prop->ChildAs<Float>("spatial_threshold", 12000_f);
+        directionalThreshold_ = prop->ChildAs<Float>("directional_threshold", 0.01_f);
+        maxDTreeDepth_ = prop->ChildAs("max_dtree_depth", 20);
+        return true;
+    };
+
+    LM_IMPL_F(Render) = [this](const Scene* scene_, Random* initRng, const std::string& outputPath) -> void
+    {
+        const auto* scene = static_cast<const Scene3*>(scene_);
+        auto* film = static_cast<const Sensor*>(scene->GetSensor()->emitter)->GetFilm();
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Context
+
+        // Vertex of a path recording the incident radiance
+        struct GuidingVertex
+        {
+            GuidingDTree* dtree;
+            Vec2 u;                                 // Sampled direction in the canonical coordinates
+            SPD throughput;                         // Throughput including the sampled direction
+            Float pdf;                              // Solid angle PDF of the sampled direction
+            Float radiance;                         // Luminance of the incident radiance
+        };
+
+        struct Context
+        {
+            Random rng;
+            Film::UniquePtr film{ nullptr, nullptr };
+            std::vector<GuidingVertex> vertices;
+        };
+        std::vector<Context> contexts(Parallel::GetNumThreads());
+        for (auto& ctx : contexts)
+        {
+            ctx.rng.SetSeed(initRng->NextUInt());
+            ctx.film = ComponentFactory::Clone<Film>(film);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region SD-tree
+
+        GuidingSTree stree;
+        stree.Initialize(scene->GetBound());
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Sample a path
+
+        const auto SamplePath = [&](Context& ctx, bool training) -> void
+        {
+            auto* rng = &ctx.rng;
+            ctx.vertices.clear();
+
+            #pragma region Sample a sensor
+
+            const auto* E = scene->SampleEmitter(SurfaceInteractionType::E, rng->Next());
+            const auto pdfE = scene->EvaluateEmitterPDF(E);
+            assert(pdfE.v > 0);
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Sample a position on the sensor and initial ray direction
+
+            SurfaceGeometry geomE;
+            Vec3 initWo;
+            E->SamplePositionAndDirection(rng->Next2D(), rng->Next2D(), geomE, initWo);
+            const auto pdfPE = E->EvaluatePositionGivenDirectionPDF(geomE, initWo, false);
+            assert(pdfPE.v > 0);
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Calculate raster position for initial vertex
+
+            Vec2 rasterPos;
+            if (!E->RasterPosition(initWo, geomE, rasterPos))
+            {
+                // This can happen due to numerical errors
+                return;
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Temporary variables
+
+            auto throughput = E->EvaluatePosition(geomE, false) / pdfPE / pdfE;
+            const auto* primitive = E;
+            int type = SurfaceInteractionType::E;
+            auto geom = geomE;
+            Vec3 wi;
+            int numVertices = 1;
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            while (true)
+            {
+                if (maxNumVertices_ != -1 && numVertices >= maxNumVertices_)
+                {
+                    break;
+                }
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Sample direction
+
+                Vec3 wo;
+                PDFVal pdfD;
+                GuidingDTree* building = nullptr;
+                if (type == SurfaceInteractionType::E)
+                {
+                    wo = initWo;
+                    pdfD = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
+                }
+                else if (primitive->IsDeltaDirection(type))
+                {
+                    primitive->SampleDirection(rng->Next2D(), rng->Next(), type, geom, wi, wo);
+                    pdfD = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
+                }
+                else
+                {
+                    auto* dtrees = stree.Find(geom.p);
+                    building = training ? &dtrees->building : nullptr;
+                    const auto& sampling = dtrees->sampling;
+                    if (sampling.Sum() <= 0_f)
+                    {
+                        // No distribution is learned yet
+                        primitive->SampleDirection(rng->Next2D(), rng->Next(), type, geom, wi, wo);
+                        pdfD = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
+                    }
+                    else
+                    {
+                        // One-sample MIS of the BSDF and the guiding distribution
+                        if (rng->Next() < bsdfSamplingFraction_)
+                        {
+                            primitive->SampleDirection(rng->Next2D(), rng->Next(), type, geom, wi, wo);
+                        }
+                        else
+                        {
+                            wo = CanonicalToDirection(sampling.Sample(rng->Next2D()));
+                        }
+                        const auto cosO = Math::Abs(Math::Dot(geom.sn, wo));
+                        if (cosO <= 0_f)
+                        {
+                            break;
+                        }
+                        const auto pdfBSDF = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
+                        const auto pdfGuide = sampling.Pdf(DirectionToCanonical(wo)) / (4_f * Math::Pi()) / cosO;
+                        pdfD = PDFVal(PDFMeasure::ProjectedSolidAngle, bsdfSamplingFraction_ * pdfBSDF.v + (1_f - bsdfSamplingFraction_) * pdfGuide);
+                    }
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Evaluate direction
+
+                const auto fs = primitive->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false);
+                if (fs.Black() || pdfD.v <= 0_f)
+                {
+                    break;
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Update throughput
+
+                throughput *= fs / pdfD;
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Record guiding vertex
+
+                if (building)
+                {
+                    ctx.vertices.push_back({ building, DirectionToCanonical(wo), throughput, pdfD.v * Math::Abs(Math::Dot(geom.sn, wo)), 0_f });
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Intersection
+
+                // Setup next ray
+                Ray ray = { geom.p, wo };
+
+                // Intersection query
+                Intersection isect;
+                if (!scene->Intersect(ray, isect))
+                {
+                    break;
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Handle hit with light source
+
+                if ((isect.primitive->Type() & SurfaceInteractionType::L) > 0)
+                {
+                    // Accumulate to film
+                    if (numVertices + 1 >= minNumVertices_)
+                    {
+                        const auto C =
+                            throughput
+                            * isect.primitive->EvaluateDirection(isect.geom, SurfaceInteractionType::L, Vec3(), -ray.d, TransportDirection::EL, false)
+                            * isect.primitive->EvaluatePosition(isect.geom, false);
+                        ctx.film->Splat(rasterPos, C);
+
+                        // Incident radiance to the previous vertices
+                        for (auto& v : ctx.vertices)
+                        {
+                            SPD L;
+                            for (int i = 0; i < 3; i++)
+                            {
+                                L.v[i] = v.throughput.v[i] > 0_f ? C.v[i] / v.throughput.v[i] : 0_f;
+                            }
+                            v.radiance += L.Luminance();
+                        }
+                    }
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Path termination
+
+                if (isect.geom.infinite)
+                {
+                    break;
+                }
+
+                const Float rrProb = 0.5_f;
+                if (rng->Next() > rrProb)
+                {
+                    break;
+                }
+                else
+                {
+                    throughput /= rrProb;
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Update information
+
+                geom = isect.geom;
+                primitive = isect.primitive;
+                type = isect.primitive->Type() & ~SurfaceInteractionType::Emitter;
+                wi = -ray.d;
+                numVertices++;
+
+                #pragma endregion
+            }
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Record incident radiance to SD-tree
+
+            for (const auto& v : ctx.vertices)
+            {
+                v.dtree->Record(v.u, v.radiance / v.pdf);
+            }
+
+            #pragma endregion
+        };
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Iterations
+
+        const auto renderStartTime = std::chrono::high_resolution_clock::now();
+        const long long numTrainingSamples = numTrainingSamples_ > 0 ? numTrainingSamples_ : (long long)(film->Width()) * film->Height();
+        for (int iteration = 0; ; iteration++)
+        {
+            const double elapsed = PassScheduler::Elapsed(renderStartTime);
+            const bool training = iteration < numTrainingIterations_ && (renderTime_ < 0 || elapsed < renderTime_ * trainingTimeFraction_);
+            const ParallelForParams params = training
+                ? ParallelForParams{ ParallelMode::Samples, numTrainingSamples << iteration, 0 }
+                : ParallelForParams{ renderTime_ < 0 ? ParallelMode::Samples : ParallelMode::Time, numSamples_, Math::Max(0.0, renderTime_ - elapsed) };
+
+            LM_LOG_INFO(training ? boost::str(boost::format("Training iteration %d") % iteration) : std::string("Final iteration"));
+            LM_LOG_INDENTER();
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Sample paths
+
+            for (auto& ctx : contexts)
+            {
+                ctx.film->Clear();
+            }
+            const auto processed = Parallel::For(params, [&](long long index, int threadid, bool init)
+            {
+                SamplePath(contexts[threadid], training);
+            });
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Record to film
+
+            if (!training)
+            {
+                film->Clear();
+                for (auto& ctx : contexts)
+                {
+                    film->Accumulate(ctx.film.get());
+                }
+                film->Rescale((Float)(film->Width() * film->Height()) / processed);
+                break;
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Refine SD-tree
+
+            {
+                const auto refineStartTime = std::chrono::high_resolution_clock::now();
+                stree.Refine(spatialThreshold_ * Math::Sqrt((Float)(1LL << iteration)), directionalThreshold_, maxDTreeDepth_);
+                LM_LOG_INFO(boost::str(boost::format("Refine time: %.3f s") % PassScheduler::Elapsed(refineStartTime)));
+                LM_LOG_INFO(boost::str(boost::format("# of spatial leaves: %d, average # of directional nodes: %.1f") % stree.NumLeaves() % stree.AverageNumDTreeNodes()));
+            }
+
+            #pragma endregion
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save image
+        {
+            LM_LOG_INFO("Saving image");
+            LM_LOG_INDENTER();
+            film->Save(outputPath);
+        }
+        #pragma endregion
+    };
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Renderer_PT_Guided, "renderer::pt_guided");
+
+LM_NAMESPACE_END
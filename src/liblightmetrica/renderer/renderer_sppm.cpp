@@ -40,18 +40,20 @@
 #include <lightmetrica/detail/photonmap.h>
 #include <lightmetrica/detail/subpathsampler.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/passscheduler.h>
+#include <lightmetrica/detail/hashgrid.h>
+#include <lightmetrica/detail/emissionguide.h>
 #include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
-#define LM_SPPM_DEBUG 0
-#define LM_SPPM_DEBUG_OUTPUT_PER_30_SEC 0
-#define LM_SPPM_RENDER_WITH_TIME 0
-
 /*!
     \brief Stochastic progressive photon mapping renderer.
 
     Implements stochastic progressive photon mapping [Hachisuka & Jensen 2009]
+    With `mode` set to `splat`, the photons are not stored; instead each photon is
+    accumulated into the measurement points within their radii during tracing
+    utilizing a hash grid over the measurement points, which keeps the memory O(#pixels).
     References:
       - [Hachisuka & Jensen 2009] Stochastic progressive photon mapping
 */
@@ -64,34 +66,41 @@ public:
 private:
 
     int maxNumVertices_;
-    long long numIterationPass_;                          // Number of photon scattering passes
-    long long numPhotonTraceSamples_;                     // Number of photon trace samples for each pass
+    PassScheduler passSched_;                             // Controls photon scattering passes
+    EmissionGuide emissionGuide_;                         // Adaptive importance for the photon emission
     Float initialRadius_;                                 // Initial photon gather radius
     Float alpha_;                                         // Fraction to control photons (see paper)
     PhotonMap::UniquePtr photonmap_{ nullptr, nullptr };  // Underlying photon map implementation
-    #if LM_SPPM_DEBUG
-    std::string debugOutputPath_;
-    #endif
-    #if LM_SPPM_RENDER_WITH_TIME
-    double renderTime_;
-    #endif
+
+    // Photon gathering mode
+    enum class Mode
+    {
+        PhotonMap,      // Store photons and query the photon map per measurement point
+        Splat,          // Splat photons into the grid of measurement points without storing photons
+    };
+    Mode mode_;
 
 public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
         maxNumVertices_        = prop->Child("max_num_vertices")->As<int>();
-        numIterationPass_      = prop->ChildAs<long long>("num_iteration_pass", 1000L);
-        numPhotonTraceSamples_ = prop->ChildAs<long long>("num_photon_trace_samples", 100L);
+        passSched_.Load(prop, 1000L, 100L);
+        emissionGuide_.Load(prop);
         initialRadius_         = prop->ChildAs<Float>("initial_radius", 0.1_f);
         alpha_                 = prop->ChildAs<Float>("alpha", 0.7_f);
         photonmap_             = ComponentFactory::Create<PhotonMap>("photonmap::" + prop->ChildAs<std::string>("photonmap", "kdtree"));
-        #if LM_SPPM_DEBUG
-        debugOutputPath_       = prop->ChildAs<std::string>("debug_output_path", "sppm_%05d");
-        #endif
-        #if LM_SPPM_RENDER_WITH_TIME
-        renderTime_            = prop->ChildAs("render_time", 10.0);
-        #endif
+        {
+            const auto modestr = prop->ChildAs<std::string>("mode", "photonmap");
+            if (modestr == "photonmap") { mode_ = Mode::PhotonMap; }
+            else if (modestr == "splat") { mode_ = Mode::Splat; }
+            else
+            {
+                LM_LOG_ERROR("Invalid mode: '" + modestr + "'");
+                return false;
+            }
+            LM_LOG_INFO("Selected mode: '" + modestr + "'");
+        }
         return true;
     };
 
@@ -127,15 +136,39 @@ public:
             mp.N = 0_f;
         }
 
+        // Progressive update of a measurement point with the photons accumulated in a pass
+        const auto UpdateMeasurementPoint = [this](MeasurementPoint& mp, const SPD& deltaTau, Float M) -> void
+        {
+            if (mp.N + M == 0_f)
+            {
+                return;
+            }
+            const Float ratio = (mp.N + alpha_ * M) / (mp.N + M);
+            mp.tau = (mp.tau + mp.throughputE * deltaTau) * ratio;
+            mp.radius = mp.radius * Math::Sqrt(ratio);
+            mp.N = mp.N + alpha_ * M;
+        };
+
+        // Photon statistics accumulated into the measurement points in the splat mode
+        struct SplatStat
+        {
+            tbb::spin_mutex mutex;
+            SPD deltaTau;
+            Float M = 0_f;
+        };
+        std::vector<SplatStat> splatStats(mode_ == Mode::Splat ? mps.size() : 0);
+
         long long totalPhotonTraceSamples = 0;
 
-        #if LM_SPPM_RENDER_WITH_TIME
-        const auto renderStartTime = std::chrono::high_resolution_clock::now();
-        for (long long pass = 0; ; pass++)
-        #else
-        for (long long pass = 0; pass < numIterationPass_; pass++)
-        #endif
+        passSched_.Start();
+        if (emissionGuide_.Enabled())
+        {
+            emissionGuide_.Start();
+        }
+        while (passSched_.BeginPass())
         {
+            const auto pass = passSched_.Pass();
+            const auto numPhotonTraceSamples = passSched_.NumPhotonTraceSamples();
             LM_LOG_INFO("Pass " + std::to_string(pass));
             LM_LOG_INDENTER();
             
@@ -200,169 +233,301 @@ public:
 
             // --------------------------------------------------------------------------------
 
-            #pragma region Trace photons
-            std::vector<Photon> photons;
+            #pragma region Build grid of measurement points
+            // The grid is utilized for the splatting and for the visibility test of the emission guide
+            HashGrid grid;
+            std::vector<int> sortedMps;
+            Float maxRadius = 0_f;
             {
-                LM_LOG_INFO("Tracing photons");
-                LM_LOG_INDENTER();
-                
-                struct Context
-                {
-                    Random rng;
-                    std::vector<Photon> photons;
-                };
-                std::vector<Context> contexts(Parallel::GetNumThreads());
-                for (auto& ctx : contexts)
+                std::vector<int> validMps;
+                for (int i = 0; i < (int)mps.size(); i++)
                 {
-                    ctx.rng.SetSeed(initRng->NextUInt());
+                    if (mps[i].valid)
+                    {
+                        validMps.push_back(i);
+                        maxRadius = Math::Max(maxRadius, mps[i].radius);
+                    }
                 }
 
-                Parallel::For(numPhotonTraceSamples_, [&](long long index, int threadid, bool init)
+                if (mode_ == Mode::Splat || emissionGuide_.Enabled())
                 {
-                    auto& ctx = contexts[threadid];
-                    SubpathSampler::TraceSubpath(scene, &ctx.rng, maxNumVertices_, TransportDirection::LE, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+                    LM_LOG_INFO("Building grid of measurement points");
+                    LM_LOG_INDENTER();
+                    grid.Build((int)(validMps.size()), maxRadius * 2_f, [&](int i) -> const Vec3& { return mps[validMps[i]].v.geom.p; });
+                    sortedMps.resize(validMps.size());
+                    for (int i = 0; i < (int)validMps.size(); i++)
                     {
-                        // Skip initial vertex
-                        if (numVertices == 1)
-                        {
-                            return true;
-                        }
-
-                        // Record photon
-                        if ((v.type & SurfaceInteractionType::D) > 0 || (v.type & SurfaceInteractionType::G) > 0)
-                        {
-                            Photon photon;
-                            photon.p = v.geom.p;
-                            photon.throughput = throughput;
-                            photon.wi = Math::Normalize(pv.geom.p - v.geom.p);
-                            photon.numVertices = numVertices;
-                            ctx.photons.push_back(photon);
-                        }
-
-                        // Path termination
-                        const Float rrProb = 0.5_f;
-                        if (ctx.rng.Next() > rrProb)
-                        {
-                            return false;
-                        }
-                        else
-                        {
-                            throughput /= rrProb;
-                        }
-
-                        return true;
-                    });
-                });
-
-                for (auto& ctx : contexts)
-                {
-                    photons.insert(photons.end(), ctx.photons.begin(), ctx.photons.end());
+                        sortedMps[i] = validMps[grid.SortedIndices()[i]];
+                    }
                 }
-
-                totalPhotonTraceSamples += numPhotonTraceSamples_;
             }
             #pragma endregion
 
             // --------------------------------------------------------------------------------
 
-            #pragma region Build photon map
+            #pragma region Visibility to measurement points for emission guide
+            // True if the photon at the vertex contributes to any measurement point
+            const auto VisibleToMeasurementPoints = [&](const Vec3& p, int numVertices) -> bool
             {
-                LM_LOG_INFO("Building photon map");
-                LM_LOG_INDENTER();
-                photonmap_->Build(std::move(photons));
-            }
+                bool visible = false;
+                grid.Query(p, maxRadius, [&](int begin, int end) -> void
+                {
+                    for (int i = begin; i < end && !visible; i++)
+                    {
+                        const auto& mp = mps[sortedMps[i]];
+                        visible = Math::Length2(mp.v.geom.p - p) < mp.radius * mp.radius && mp.numVertices + numVertices - 1 <= maxNumVertices_;
+                    }
+                });
+                return visible;
+            };
             #pragma endregion
-            
+
             // --------------------------------------------------------------------------------
 
-            #pragma region Progressive density estimation
+            double photonTime = 0;
+            if (mode_ == Mode::PhotonMap)
             {
-                LM_LOG_INFO("Density estimation");
-                LM_LOG_INDENTER();
-
-                // --------------------------------------------------------------------------------
-
-                Parallel::For(mps.size(), [&](long long index, int threadid, bool init)
+                #pragma region Trace photons
+                const auto photonStartTime = std::chrono::high_resolution_clock::now();
+                std::vector<CompactPhoton> photons;
                 {
-                    auto& mp = mps[index];
-                    if (!mp.valid)
+                    LM_LOG_INFO("Tracing photons");
+                    LM_LOG_INDENTER();
+                
+                    struct Context
                     {
-                        return;
+                        Random rng;
+                        std::vector<CompactPhoton> photons;
+                    };
+                    std::vector<Context> contexts(Parallel::GetNumThreads());
+                    for (auto& ctx : contexts)
+                    {
+                        ctx.rng.SetSeed(initRng->NextUInt());
                     }
 
-                    // Accumulate tau 
-                    SPD deltaTau;
-                    Float M = 0_f;
-                    photonmap_->CollectPhotons(mp.v.geom.p, mp.radius, [&](const Photon& photon) -> void
+                    Parallel::For(numPhotonTraceSamples, [&](long long index, int threadid, bool init)
                     {
-                        if (mp.numVertices + photon.numVertices - 1 > maxNumVertices_)
+                        auto& ctx = contexts[threadid];
+                        emissionGuide_.TracePhoton(scene, &ctx.rng, threadid, maxNumVertices_, VisibleToMeasurementPoints, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
                         {
-                            return;
-                        }
-                        const auto f = mp.v.primitive->EvaluateDirection(mp.v.geom, SurfaceInteractionType::BSDF, mp.wi, photon.wi, TransportDirection::EL, true);
-                        deltaTau += f * photon.throughput;
-                        M += 1_f;
+                            // Skip initial vertex
+                            if (numVertices == 1)
+                            {
+                                return true;
+                            }
+
+                            // Record photon
+                            if ((v.type & SurfaceInteractionType::D) > 0 || (v.type & SurfaceInteractionType::G) > 0)
+                            {
+                                Photon photon;
+                                photon.p = v.geom.p;
+                                photon.throughput = throughput;
+                                photon.wi = Math::Normalize(pv.geom.p - v.geom.p);
+                                photon.numVertices = numVertices;
+                                ctx.photons.push_back(CompactPhoton::Pack(photon));
+                            }
+
+                            // Path termination
+                            const Float rrProb = 0.5_f;
+                            if (ctx.rng.Next() > rrProb)
+                            {
+                                return false;
+                            }
+                            else
+                            {
+                                throughput /= rrProb;
+                            }
+
+                            return true;
+                        });
                     });
 
-                    // Update information in the measreument point
-                    if (mp.N + M == 0_f)
+                    for (auto& ctx : contexts)
                     {
-                        return;
+                        photons.insert(photons.end(), ctx.photons.begin(), ctx.photons.end());
                     }
-                    const Float ratio = (mp.N + alpha_ * M) / (mp.N + M);
-                    mp.tau = (mp.tau + mp.throughputE * deltaTau) * ratio;
-                    mp.radius = mp.radius * Math::Sqrt(ratio);
-                    mp.N = mp.N + alpha_ * M;
-                });
+
+                    totalPhotonTraceSamples += numPhotonTraceSamples;
+                }
+                #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                // Record to film
-                film->Clear();
-                for (int i = 0; i < (int)mps.size(); i++)
+                #pragma region Build photon map
                 {
-                    const auto& mp = mps[i];
-                    const auto C = mp.tau / (mp.radius * mp.radius * Math::Pi() * totalPhotonTraceSamples) + mp.emission / (Float)(pass + 1);
-                    film->SetPixel(i % W, i / W, C);
+                    LM_LOG_INFO("Building photon map");
+                    LM_LOG_INDENTER();
+
+                    photonmap_->SetMaxQueryRadius(maxRadius);
+
+                    const auto buildStartTime = std::chrono::high_resolution_clock::now();
+                    photonmap_->Build(std::move(photons));
+                    LM_LOG_INFO(boost::str(boost::format("Build time: %.3f s") % PassScheduler::Elapsed(buildStartTime)));
                 }
-                #if LM_SPPM_DEBUG
+                photonTime = PassScheduler::Elapsed(photonStartTime);
+                #pragma endregion
+            
+                // --------------------------------------------------------------------------------
+
+                #pragma region Progressive density estimation
                 {
-                    boost::format f(debugOutputPath_);
-                    f.exceptions(boost::io::all_error_bits ^ (boost::io::too_many_args_bit | boost::io::too_few_args_bit));
-                    film->Save(boost::str(f % pass));
+                    LM_LOG_INFO("Density estimation");
+                    LM_LOG_INDENTER();
+
+                    // --------------------------------------------------------------------------------
+
+                    const auto queryStartTime = std::chrono::high_resolution_clock::now();
+                    Parallel::For(mps.size(), [&](long long index, int threadid, bool init)
+                    {
+                        auto& mp = mps[index];
+                        if (!mp.valid)
+                        {
+                            return;
+                        }
+
+                        // Accumulate tau 
+                        SPD deltaTau;
+                        Float M = 0_f;
+                        photonmap_->CollectPhotonsBatch(mp.v.geom.p, mp.radius, [&](const Photon* photons, int numPhotons) -> void
+                        {
+                            for (int i = 0; i < numPhotons; i++)
+                            {
+                                const auto& photon = photons[i];
+                                if (mp.numVertices + photon.numVertices - 1 > maxNumVertices_)
+                                {
+                                    continue;
+                                }
+                                const auto f = mp.v.primitive->EvaluateDirection(mp.v.geom, SurfaceInteractionType::BSDF, mp.wi, photon.wi, TransportDirection::EL, true);
+                                deltaTau += f * photon.throughput;
+                                M += 1_f;
+                            }
+                        });
+
+                        // Update information in the measreument point
+                        UpdateMeasurementPoint(mp, deltaTau, M);
+                    });
+                    LM_LOG_INFO(boost::str(boost::format("Query time: %.3f s") % PassScheduler::Elapsed(queryStartTime)));
                 }
-                #endif
-                #if LM_SPPM_DEBUG_OUTPUT_PER_30_SEC
+                #pragma endregion
+            }
+            else
+            {
+                #pragma region Trace photons and splat into measurement points
+                const auto photonStartTime = std::chrono::high_resolution_clock::now();
                 {
-                    static auto prevOutputTime = std::chrono::high_resolution_clock::now();
-                    const auto currentTime = std::chrono::high_resolution_clock::now();
-                    const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevOutputTime).count()) / 1000.0;
-                    if (elapsed > 30.0)
+                    LM_LOG_INFO("Tracing photons");
+                    LM_LOG_INDENTER();
+
+                    struct Context
                     {
-                        static long long outN = 0;
-                        boost::format f("%03d");
-                        f.exceptions(boost::io::all_error_bits ^ (boost::io::too_many_args_bit | boost::io::too_few_args_bit));
-                        film->Save(boost::str(f % outN));
-                        outN++;
-                        prevOutputTime = currentTime;
+                        Random rng;
+                    };
+                    std::vector<Context> contexts(Parallel::GetNumThreads());
+                    for (auto& ctx : contexts)
+                    {
+                        ctx.rng.SetSeed(initRng->NextUInt());
                     }
+
+                    Parallel::For(numPhotonTraceSamples, [&](long long index, int threadid, bool init)
+                    {
+                        auto& ctx = contexts[threadid];
+                        emissionGuide_.TracePhoton(scene, &ctx.rng, threadid, maxNumVertices_, VisibleToMeasurementPoints, [&](int numVertices, const Vec2& /*rasterPos*/, const SubpathSampler::PathVertex& pv, const SubpathSampler::PathVertex& v, SPD& throughput) -> bool
+                        {
+                            // Skip initial vertex
+                            if (numVertices == 1)
+                            {
+                                return true;
+                            }
+
+                            // Accumulate the photon into the measurement points within their radii
+                            if ((v.type & SurfaceInteractionType::D) > 0 || (v.type & SurfaceInteractionType::G) > 0)
+                            {
+                                const auto wi = Math::Normalize(pv.geom.p - v.geom.p);
+                                grid.Query(v.geom.p, maxRadius, [&](int begin, int end) -> void
+                                {
+                                    for (int i = begin; i < end; i++)
+                                    {
+                                        const int mpIndex = sortedMps[i];
+                                        const auto& mp = mps[mpIndex];
+                                        if (Math::Length2(mp.v.geom.p - v.geom.p) >= mp.radius * mp.radius)
+                                        {
+                                            continue;
+                                        }
+                                        if (mp.numVertices + numVertices - 1 > maxNumVertices_)
+                                        {
+                                            continue;
+                                        }
+                                        const auto f = mp.v.primitive->EvaluateDirection(mp.v.geom, SurfaceInteractionType::BSDF, mp.wi, wi, TransportDirection::EL, true);
+                                        auto& stat = splatStats[mpIndex];
+                                        tbb::spin_mutex::scoped_lock lock(stat.mutex);
+                                        stat.deltaTau += f * throughput;
+                                        stat.M += 1_f;
+                                    }
+                                });
+                            }
+
+                            // Path termination
+                            const Float rrProb = 0.5_f;
+                            if (ctx.rng.Next() > rrProb)
+                            {
+                                return false;
+                            }
+                            else
+                            {
+                                throughput /= rrProb;
+                            }
+
+                            return true;
+                        });
+                    });
+
+                    totalPhotonTraceSamples += numPhotonTraceSamples;
                 }
-                #endif
+                photonTime = PassScheduler::Elapsed(photonStartTime);
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Progressive update of measurement points
+                Parallel::For(mps.size(), [&](long long index, int threadid, bool init)
+                {
+                    auto& mp = mps[index];
+                    auto& stat = splatStats[index];
+                    if (mp.valid)
+                    {
+                        UpdateMeasurementPoint(mp, stat.deltaTau, stat.M);
+                    }
+                    stat.deltaTau = SPD();
+                    stat.M = 0_f;
+                });
+                #pragma endregion
+            }
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Update emission guide
+            if (emissionGuide_.Enabled())
+            {
+                emissionGuide_.Update();
             }
             #pragma endregion
 
             // --------------------------------------------------------------------------------
 
-            #if LM_SPPM_RENDER_WITH_TIME
+            #pragma region Record to film
+            film->Clear();
+            for (int i = 0; i < (int)mps.size(); i++)
             {
-                const auto currentTime = std::chrono::high_resolution_clock::now();
-                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
-                if (elapsed > renderTime_)
-                {
-                    break;
-                }
+                const auto& mp = mps[i];
+                const auto C = mp.tau / (mp.radius * mp.radius * Math::Pi() * totalPhotonTraceSamples) + mp.emission / (Float)(pass + 1);
+                film->SetPixel(i % W, i / W, C);
             }
-            #endif
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            passSched_.EndPass(photonTime);
+            passSched_.SaveProgress(film);
         }
         #pragma endregion
 
@@ -40,6 +40,12 @@
 
 LM_NAMESPACE_BEGIN
 
+namespace
+{
+    // Number of intersection queries issued from the current thread
+    thread_local long long NumIntersectQueries_ = 0;
+}
+
 class Scene3_ final : public Scene3
 {
 public:
@@ -457,6 +463,8 @@ public:
 
     LM_IMPL_F(Intersect) = [this](const Ray& ray, Intersection& isect) -> bool
     {
+        NumIntersectQueries_++;
+
         // Intersect with accel
         bool hit = accel_->Intersect(this, ray, isect, Math::EpsIsect(), Math::Inf());
 
@@ -479,6 +487,7 @@ public:
 
     LM_IMPL_F(IntersectWithRange) = [this](const Ray& ray, Intersection& isect, Float minT, Float maxT) -> bool
     {
+        NumIntersectQueries_++;
         return accel_->Intersect(this, ray, isect, minT, maxT);
     };
 
@@ -627,6 +636,11 @@ public:
         return (int)(lightPrimitiveIndices_.size());
     };
 
+    LM_IMPL_F(NumIntersectQueries) = [this]() -> long long
+    {
+        return NumIntersectQueries_;
+    };
+
 private:
 
     std::vector<std::unique_ptr<Primitive>> primitives_;                // Primitives
@@ -0,0 +1,177 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch_test.h>
+#include <lightmetrica/detail/photonmap.h>
+#include <lightmetrica/detail/photongather.h>
+#include <lightmetrica-test/mathutils.h>
+#include <random>
+
+LM_TEST_NAMESPACE_BEGIN
+
+#pragma region CompactPhoton
+
+namespace
+{
+    auto PackThroughput(const Vec3& rgb) -> Vec3
+    {
+        Photon photon;
+        photon.throughput = SPD::FromRGB(rgb);
+        photon.wi = Vec3(0_f, 0_f, 1_f);
+        photon.numVertices = 1;
+        return CompactPhoton::Pack(photon).Unpack().throughput.ToRGB();
+    }
+
+    auto PackDirection(const Vec3& wi) -> Vec3
+    {
+        Photon photon;
+        photon.wi = wi;
+        photon.numVertices = 1;
+        return CompactPhoton::Pack(photon).Unpack().wi;
+    }
+
+    // Angle between the directions, computed in double precision and independent of the lengths
+    // (`Math::Normalize` with SSE is only accurate up to the approximate reciprocal square root)
+    auto Angle(const Vec3& a, const Vec3& b) -> double
+    {
+        const double dot = (double)(a.x) * b.x + (double)(a.y) * b.y + (double)(a.z) * b.z;
+        const double la = std::sqrt((double)(a.x) * a.x + (double)(a.y) * a.y + (double)(a.z) * a.z);
+        const double lb = std::sqrt((double)(b.x) * b.x + (double)(b.y) * b.y + (double)(b.z) * b.z);
+        return std::acos(std::max(-1.0, std::min(1.0, dot / (la * lb))));
+    }
+}
+
+TEST(CompactPhotonTest, PackUnpack)
+{
+    Photon photon;
+    photon.p = Vec3(1_f, -2_f, 3.5_f);
+    photon.throughput = SPD::FromRGB(Vec3(0.5_f, 0.25_f, 1_f));
+    photon.wi = Math::Normalize(Vec3(1_f, 2_f, 3_f));
+    photon.numVertices = 5;
+    const auto unpacked = CompactPhoton::Pack(photon).Unpack();
+    EXPECT_TRUE(ExpectVecNear(photon.p, unpacked.p));
+    EXPECT_TRUE(ExpectVecNear(photon.throughput.ToRGB(), unpacked.throughput.ToRGB(), 1_f / 256_f));
+    EXPECT_TRUE(ExpectNear(0.0, Angle(photon.wi, unpacked.wi), 1e-4));
+    EXPECT_EQ(5, unpacked.numVertices);
+}
+
+TEST(CompactPhotonTest, ThroughputRGBE)
+{
+    // Zero throughput is decoded exactly
+    EXPECT_TRUE(ExpectVecNear(Vec3(), PackThroughput(Vec3())));
+
+    // The error of each channel is bounded by 2^-8 of the maximum channel
+    const std::vector<Vec3> throughputs{
+        Vec3(1_f, 1_f, 1_f),
+        Vec3(0.5_f, 0_f, 0_f),
+        Vec3(1_f, 1e-3_f, 0.25_f),
+        Vec3(1e-4_f, 3e-5_f, 7e-4_f),
+        Vec3(1e10_f, 2e9_f, 1_f),
+        Vec3(3e30_f, 1e30_f, 5e29_f),
+    };
+    for (const auto& c : throughputs)
+    {
+        const auto m = Math::Max(c.x, Math::Max(c.y, c.z));
+        EXPECT_TRUE(ExpectVecNear(c, PackThroughput(c), m / 256_f * 1.001_f));
+    }
+}
+
+TEST(CompactPhotonTest, DirectionOctahedral)
+{
+    // The quantization step of 2^-15 in the octahedral domain bounds the angular error by about 1e-4.
+    // Poles, equator, and the folded lower hemisphere including the edges of the fold
+    const std::vector<Vec3> directions{
+        Vec3(0_f, 0_f, 1_f),
+        Vec3(0_f, 0_f, -1_f),
+        Vec3(1_f, 0_f, 0_f),
+        Vec3(0_f, -1_f, 0_f),
+        Math::Normalize(Vec3(1_f, 1_f, 0_f)),
+        Math::Normalize(Vec3(1_f, 1_f, -1_f)),
+        Math::Normalize(Vec3(-1_f, 1_f, -1_f)),
+        Math::Normalize(Vec3(-0.3_f, -0.7_f, -0.5_f)),
+        Math::Normalize(Vec3(0.7_f, -1e-3_f, -0.1_f)),
+        Math::Normalize(Vec3(1e-3_f, 1e-3_f, -1_f)),
+        Math::Normalize(Vec3(0_f, 1_f, -1e-3_f)),
+    };
+    for (const auto& d : directions)
+    {
+        EXPECT_TRUE(ExpectNear(0.0, Angle(d, PackDirection(d)), 1e-4));
+    }
+}
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region PhotonGatherUtils
+
+TEST(PhotonGatherUtilsTest, TestRange)
+{
+    // Random photons in the unit cube, avoiding the distances too close to the query radius
+    // where the single precision test and the reference might disagree
+    const Vec3 p(0.5_f, 0.4_f, 0.6_f);
+    const Float radius = 0.35_f;
+    const int N = 103;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    std::vector<CompactPhoton> photons(N);
+    for (auto& photon : photons)
+    {
+        do
+        {
+            for (int j = 0; j < 3; j++) { photon.p[j] = dist(gen); }
+        } while (Math::Abs(Math::Length(photon.Position() - p) - radius) < 1e-4_f);
+
+        // Fill the bytes following the position, which are loaded together by the SIMD path
+        std::fill(std::begin(photon.throughput), std::end(photon.throughput), (std::uint8_t)(0xff));
+        photon.wi[0] = photon.wi[1] = 0xffff;
+        photon.numVertices = 0xffff;
+    }
+
+    // Begin offsets and range lengths not aligned to the SIMD width cover the scalar tail
+    for (const int begin : { 0, 1, 3, 5, 8 })
+    {
+        for (const int length : { 0, 1, 3, 4, 7, 8, 9, 13, 16, 17, 31, 95 })
+        {
+            const int end = begin + length;
+            std::vector<int> expected;
+            for (int i = begin; i < end; i++)
+            {
+                if (Math::Length2(photons[i].Position() - p) < radius * radius)
+                {
+                    expected.push_back(i);
+                }
+            }
+
+            std::vector<int> actual;
+            PhotonGatherUtils::TestRange(photons.data(), begin, end, p, radius * radius, [&](int i) -> void { actual.push_back(i); });
+            std::sort(actual.begin(), actual.end());
+            EXPECT_EQ(expected, actual) << "begin " << begin << ", end " << end;
+        }
+    }
+}
+
+#pragma endregion
+
+LM_TEST_NAMESPACE_END